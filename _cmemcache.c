@@ -5,27 +5,208 @@
 */
 
 #include <Python.h>
+#include <structmember.h>
 #include "memcache.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+/* python ignores SIGPIPE anyway */
+#define MSG_NOSIGNAL 0
+#endif
+
 #define _FLAG_PICKLE  1<<0
 #define _FLAG_INTEGER 1<<1
 #define _FLAG_LONG    1<<2
+#define _FLAG_NATIVE  1<<3
+#define _FLAG_TOMBSTONE 1<<4
 
 PyObject* picklemodule=NULL;
 PyObject* loads=NULL;
 
 /*** Types ***/
 
+/* A byte buffer that only grows, data[start:size] is in use */
+typedef struct
+{
+    char* data;
+    size_t start;
+    size_t size;
+    size_t capacity;
+} Buffer;
+
+/* A server as passed to set_servers() */
+typedef struct
+{
+    char* name;                  /* "host:port" */
+    int weight;
+    int baseWeight;              /* as passed to set_servers(), see reweight() */
+    unsigned long long evictions;/* of the server at the last reweight() */
+    struct memcache_server* ms;  /* the libmemcache server, NULL for unix sockets */
+} Server;
+
+/* Maps key hashes to servers, each server is in the buckets weight times */
+typedef struct
+{
+    int numServers;
+    Server* servers;
+    int numBuckets;
+    int* buckets;                /* indices in servers */
+    int numUnix;                 /* unix domain socket servers, not in libmemcache */
+} Routing;
+
+/* A validated key, borrowed from the python key object */
+typedef struct
+{
+    const char* key;
+    int len;
+    uint32_t hash;
+    int server;                  /* index in Routing.servers, -1 if there are none */
+    int local;                   /* a tombstone in the local mirror, not requested */
+} Key;
+
+#define KEYBATCH_INLINE 16
+
+/* The keys of a multi key call, validated, hashed and routed in one pass */
+typedef struct
+{
+    PyObject* seq;               /* keeps the key objects alive */
+    Py_ssize_t size;
+    Key* keys;
+    Key inlineKeys[KEYBATCH_INLINE];
+} KeyBatch;
+
+/* Size of the per client error ring, a power of 2 */
+#define ERROR_RING_SIZE 32
+
+/* An error reported by libmemcache, copied as is in errFunc */
+typedef struct
+{
+    volatile unsigned int seq;   /* ring position + 1 once the entry is complete */
+    char severity;
+    char cont;                   /* 'n' or 'a' means libmemcache wanted to exit/abort */
+    int errnum;
+    int lineno;
+    const char* funcname;
+    char errstr[120];
+} ErrorEntry;
+
+/* A connection of our own to a server, see pumpConns */
+typedef struct
+{
+    int fd;                      /* -1 if not connected */
+    int failed;                  /* don't reconnect during this call */
+    int outstanding;             /* commands queued or sent without a complete reply */
+    Buffer wbuf;                 /* commands not sent yet */
+    Buffer rbuf;                 /* replies not parsed yet */
+} Conn;
+
+/* A shared memory cache of values, see open_near_cache() */
+typedef struct NearCache NearCache;
+
+/* A get waiting to be merged into a multi get, see batchedGet */
+typedef struct PendingGet PendingGet;
+
+/* The write behind ring and thread of a client, see open_write_behind() */
+typedef struct WriteBehind WriteBehind;
+
+/* Longest value that is interned, see internValue */
+#define INTERN_MAX_SIZE 24
+
+/* A value shared by the gets of the same bytes */
+typedef struct
+{
+    PyObject* value;             /* NULL if the slot is free */
+    int kind;                    /* 0 for str, _FLAG_INTEGER or _FLAG_LONG */
+    int size;
+    char data[INTERN_MAX_SIZE];
+} InternSlot;
+
 typedef struct 
 {
     PyObject_HEAD
     struct memcache* mc;
+    Routing* routing;
+    unsigned int routingVersion;         /* bumped by set_servers() */
+    Conn* conns;                         /* one per Routing.servers */
+    int numConns;
+    struct pollfd* pollfds;              /* poll() arguments for pumpConns */
+    int* pollConns;                      /* index in conns of each pollfd */
+    int native;                          /* use the conns for all commands */
+    int tcpNoDelay;                      /* socket options of the conns */
+    int keepAlive;
+    int sndBuf;                          /* 0 is the system default */
+    int rcvBuf;
     struct memcache_err_ctxt mc_err_ctxt;/* to pass in ourself to collect exception info */
     mcErrFunc mcErr;
     struct memcache_ctxt* mc_ctxt;       /* to hold a pointer to mc_err_ctxt */
     int debug;
-    int throwException;
-    char exceptionStr[256];
+    int raiseErrors;                     /* raise fatal errors instead of returning */
+    double tombstoneTtl;                 /* seconds to mirror tombstones, 0 is off */
+    PyObject* tombstones;                /* key -> expire time of mirrored tombstones */
+    NearCache* near;                     /* NULL unless open_near_cache() */
+    WriteBehind* writeBehind;            /* NULL unless open_write_behind() */
+    
+    /* With autoBatch set the client can be shared by threads, see batchedGet */
+    int autoBatch;                       /* merge up to this many gets, 0 is off */
+    int batchWindow;                     /* microseconds a merged get waits for more */
+    int syncReady;                       /* the locks and conditions are initialized */
+    pthread_mutex_t ioLock;              /* held during calls while autoBatch is set */
+    pthread_mutex_t batchLock;           /* protects the pending gets */
+    pthread_cond_t batchFull;            /* numPending reached autoBatch */
+    pthread_cond_t batchDone;            /* a batch of pending gets is done */
+    PendingGet* pending;
+    int numPending;
+    int batchLeader;                     /* a caller is collecting pending */
+    int lastBatchSize;
+    int profile;                         /* time the calls that release the GIL */
+    double timeout;                      /* default seconds per call, 0 is none */
+    double reweightInterval;             /* seconds between reweight() calls, 0 is off */
+    double nextReweight;                 /* profileTime() of the next one */
+    double reweightThreshold;            /* share of the buckets a server must move */
+    int internValues;                    /* slots of interned values, 0 is off */
+    int numInterned;                     /* internValues rounded up to a power of 2 */
+    InternSlot* interned;
+    
+    /* Written by errFunc without the GIL, read by collectErrors with the GIL */
+    ErrorEntry errors[ERROR_RING_SIZE];
+    volatile unsigned int errorHead;     /* next entry errFunc writes */
+    unsigned int errorTail;              /* next entry collectErrors reads */
+    PyObject* lastErrors;                /* exceptions not yet fetched by last_errors() */
+    
+    /* client statistics, see get_client_stats() */
+    unsigned long numErrors;
+    unsigned long numFatalErrors;
+    unsigned long numErrorsDropped;
+    unsigned long numTombstoneHits;      /* tombstones found in the local mirror */
+    unsigned long numNearHits;
+    unsigned long numNearMisses;
+    unsigned long numBatches;            /* merged multi gets of autoBatch */
+    unsigned long numBatchedGets;
+    unsigned long numProfiledCalls;      /* with profile set, see profileCall */
+    double releasedTime;                 /* seconds without the GIL */
+    double gilWaitTime;                  /* seconds waiting to get the GIL back */
+    unsigned long numTimeouts;           /* calls that missed their deadline */
+    unsigned long numReweights;          /* routing swaps of reweight() */
+    unsigned long numInternHits;         /* values shared instead of created */
+    unsigned long internSaved;           /* bytes of the objects not created */
+    unsigned long numWritesQueued;       /* sets and deletes put in the write behind ring */
+    unsigned long numWritesDropped;      /* not queued because the ring was full */
+    unsigned long numWritesFailed;       /* queued but lost with a failing server */
+    unsigned int maxWriteDepth;          /* most writes in the ring at once */
 } CmemcacheObject;
 
 /*** Defines ***/
@@ -45,6 +226,145 @@ cmemcache_dealloc(CmemcacheObject* self);
 
 static mcErrFunc mcErr = 0;
 
+static void
+freeKeys(KeyBatch* batch);
+
+static PyObject*
+decodeValue(CmemcacheObject* self, const char* data, size_t size, int flags,
+            PyObject* serializers);
+
+static PyObject*
+internValue(CmemcacheObject* self, const char* data, size_t size, int kind);
+
+static void
+freeInterned(CmemcacheObject* self);
+
+static void
+freeNearCache(NearCache* near);
+
+static int
+queueWrite(CmemcacheObject* self, const Key* key, const char* cmd, int cmdLen,
+           const char* value, int valuelen);
+
+static int
+restartWriteBehind(CmemcacheObject* self);
+
+static int
+drainWriteBehind(CmemcacheObject* self);
+
+static void
+closeWriteBehind(CmemcacheObject* self);
+
+static int
+reweightServers(CmemcacheObject* self);
+
+/* Errors reported by libmemcache, see last_errors() */
+static PyObject* MemcachedError = NULL;
+static PyObject* MemcachedConnectionError = NULL;
+static PyObject* MemcachedTimeoutError = NULL;
+static PyObject* MemcachedServerError = NULL;
+
+/* Returned for keys with a tombstone, see set_tombstone() */
+static PyObject* Tombstone = NULL;
+
+/* The python-memcache key exceptions */
+static PyObject* MemcachedKeyError = NULL;
+static PyObject* MemcachedKeyLengthError = NULL;
+static PyObject* MemcachedKeyCharacterError = NULL;
+static PyObject* MemcachedKeyNoneError = NULL;
+static PyObject* MemcachedKeyTypeError = NULL;
+
+/* The client and key of the libmemcache call in progress on this thread. The ctxt
+   callbacks (errFunc, hashFunc, serverFindFunc) need them, and ectxt->misc can not be
+   used for that (see errFunc). */
+static __thread CmemcacheObject* activeClient = NULL;
+static __thread const Key* activeKey = NULL;
+
+/* The keys of the libmemcache multi get in progress on this thread, see hashFunc. */
+static __thread const KeyBatch* activeBatch = NULL;
+
+/* The profileTime() the call in progress on this thread must be done by, 0 for none, and
+   the client whose last call on this thread missed its deadline. See startDeadline. */
+static __thread double callDeadline = 0;
+static __thread const CmemcacheObject* timedOutClient = NULL;
+
+//----------------------------------------------------------------------------------------
+//
+static CmemcacheObject*
+lockClient(CmemcacheObject* self)
+{
+    // Called without the GIL. A client shared by threads (autoBatch set) does one call at
+    // a time, returns self if it was locked.
+    if (self->autoBatch)
+    {
+        pthread_mutex_lock(&self->ioLock);
+        return self;
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+unlockClient(CmemcacheObject* self)
+{
+    if (self)
+    {
+        pthread_mutex_unlock(&self->ioLock);
+    }
+}
+
+//----------------------------------------------------------------------------------------
+//
+static double
+profileTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+profileCall(CmemcacheObject* self, double start, double released)
+{
+    // With the GIL again, account the time from start (GIL released) to released (call
+    // done), and from there to now (GIL acquired).
+    const double t = profileTime();
+    ++self->numProfiledCalls;
+    self->releasedTime += released - start;
+    self->gilWaitTime += t - released;
+}
+
+/* Py_BEGIN_ALLOW_THREADS and Py_END_ALLOW_THREADS, timed when self->profile is set. */
+#define BEGIN_RELEASE_GIL(self)                                         \
+    {                                                                   \
+    CmemcacheObject* const profiled = (self)->profile ? (self) : NULL;  \
+    const double callStart = profiled ? profileTime() : 0;              \
+    PyThreadState* const callState = PyEval_SaveThread()
+
+#define END_RELEASE_GIL                                                 \
+    const double callDone = profiled ? profileTime() : 0;               \
+    PyEval_RestoreThread(callState);                                    \
+    if (profiled)                                                       \
+        profileCall(profiled, callStart, callDone);                     \
+    }
+
+/* Release the GIL for a libmemcache call on behalf of self (and key, may be NULL). */
+#define BEGIN_MC_CALL(self, key)                \
+    BEGIN_RELEASE_GIL(self);                    \
+    CmemcacheObject* const lockedClient = lockClient(self); \
+    activeClient = (self);                      \
+    activeKey = (key)
+
+#define END_MC_CALL                             \
+    activeClient = NULL;                        \
+    activeKey = NULL;                           \
+    activeBatch = NULL;                         \
+    unlockClient(lockedClient);                 \
+    END_RELEASE_GIL
+
 //----------------------------------------------------------------------------------------
 //
 static time_t expParamToExpTime(long int expParam)
@@ -54,6 +374,36 @@ static time_t expParamToExpTime(long int expParam)
     return expParam < 0 ? 0 : expParam > 0x7FFFFFFF ? 0x7FFFFFFF : expParam;
 }
 
+//----------------------------------------------------------------------------------------
+//
+static void
+pushError(CmemcacheObject* self, char severity, char cont, int errnum,
+          const char* funcname, int lineno, const char* errstr)
+{
+    // No locks and no formatting here, just copy the error into the ring. Several
+    // threads may be in calls on the same client, so claim the entry atomically.
+    const unsigned int pos = __sync_fetch_and_add(&self->errorHead, 1);
+    ErrorEntry* entry = &self->errors[pos % ERROR_RING_SIZE];
+    entry->seq = 0;
+    __sync_synchronize();
+    entry->severity = severity;
+    entry->cont = cont;
+    entry->errnum = errnum;
+    entry->lineno = lineno;
+    entry->funcname = funcname;
+    entry->errstr[0] = 0;
+    if (errstr)
+    {
+        strncat(entry->errstr, errstr, sizeof(entry->errstr) - 1);
+    }
+    __sync_synchronize();
+    entry->seq = pos + 1;
+}
+
+/* Report an error of our own code (not libmemcache), like errFunc would. */
+#define reportError(self, errnum, errstr)                               \
+    pushError((self), MCM_ERR_LVL_ERR, 'y', (errnum), __FUNCTION__, __LINE__, (errstr))
+
 //----------------------------------------------------------------------------------------
 //
 static int32_t errFunc(MCM_ERR_FUNC_ARGS)
@@ -72,35 +422,27 @@ static int32_t errFunc(MCM_ERR_FUNC_ARGS)
 
     /*
       Dang, ectxt->misc is reset in mcm_err() (through that bzero), so we can't use
-      misc to get our CmemcacheObject.
+      misc to get our CmemcacheObject. Use the client of the call in progress instead.
     */
-    CmemcacheObject* self = (CmemcacheObject*) ectxt->misc;
-    /* Outputing the errors is confusing, so don't output anything */
-    if (self && self->mcErr)
+    CmemcacheObject* self = activeClient;
+    if (self)
     {
-        self->mcErr(ctxt, ectxt);
+        pushError(self, ectxt->severity, ectxt->cont, ectxt->errnum,
+                  ectxt->funcname, ectxt->lineno, ectxt->errstr);
+        
+        /* Outputing the errors is confusing, so only output them when debugging */
+        if (self->debug && self->mcErr)
+        {
+            self->mcErr(ctxt, ectxt);
+        }
     }
     else if (mcErr)
     {
         mcErr(ctxt, ectxt);
     }
-    /* FIXME */
     
-    // Throw an exception for errors that will exit/abort.
     if (ectxt->cont == 'n' || ectxt->cont == 'a')
     {
-        if (self)
-        {
-            CmemcacheObject* self = (CmemcacheObject*) ectxt->misc;
-            /* might be multiple errors before throwing, only collect first error */
-            if (!self->throwException)
-            {
-                snprintf(self->exceptionStr, sizeof(self->exceptionStr)-1,
-                         "%s", ectxt->errstr);
-                self->throwException = 1;
-            }
-        }
-        
         // Try not to abort/exit. Without my patch this might segfault libmemcache.
         ectxt->cont = 'y';
     }
@@ -110,736 +452,5799 @@ static int32_t errFunc(MCM_ERR_FUNC_ARGS)
 
 //----------------------------------------------------------------------------------------
 //
-static int
-do_set_servers(CmemcacheObject* self, PyObject* servers)
+static PyObject*
+errorToException(const ErrorEntry* entry)
 {
-    debug(("do_set_servers\n"));
+    const char* funcname = entry->funcname ? entry->funcname : "?";
+    PyObject* exc = NULL;
     
-    if (!PySequence_Check(servers))
+    if (entry->errnum)
     {
-        PyErr_BadArgument();
-        return -1;
+        // system error, like connect() or read() failing
+        exc = PyObject_CallFunction(entry->errnum == ETIMEDOUT ? MemcachedTimeoutError :
+                                    MemcachedConnectionError, "(iN)", entry->errnum,
+                                    PyString_FromFormat("%s():%d: %s: %s",
+                                                        funcname, entry->lineno,
+                                                        entry->errstr,
+                                                        strerror(entry->errnum)));
     }
-
-    int error = 0;
-    
-    /* there seems to be no way to remove servers, so get rid of memcache all together */
-    if (self->mc)
+    else
     {
-        mcm_free(self->mc_ctxt, self->mc);
-        self->mc = NULL;
+        exc = PyObject_CallFunction(MemcachedServerError, "(N)",
+                                    PyString_FromFormat("%s():%d: %s", funcname,
+                                                        entry->lineno, entry->errstr));
     }
-    assert(self->mc == NULL);
-
-    /* create new instance */
-    self->mc = mcm_new(self->mc_ctxt);
-    debug(("new mc %p\n", self->mc));
-    if (self->mc == NULL)
+    if (exc)
     {
-        PyErr_NoMemory();
-        return -1;
+        PyObject* severity = PyInt_FromLong(entry->severity);
+        PyObject_SetAttrString(exc, "severity", severity);
+        Py_XDECREF(severity);
     }
+    return exc;
+}
 
-    /* add servers, allow any sequence of strings */
-    const int size = PySequence_Size(servers);
-    int i;
-    for (i = 0; i < size && error == 0; ++i)
+//----------------------------------------------------------------------------------------
+//
+static int
+collectErrors(CmemcacheObject* self, int raise)
+{
+    // Convert the errors errFunc put in the ring into exceptions for last_errors().
+    PyObject* error = NULL;
+    const unsigned int head = self->errorHead;
+    
+    if (head - self->errorTail > ERROR_RING_SIZE)
     {
-        PyObject* item = PySequence_GetItem(servers, i);
-        if (item)
+        self->numErrorsDropped += head - self->errorTail - ERROR_RING_SIZE;
+        self->errorTail = head - ERROR_RING_SIZE;
+    }
+    while (self->errorTail != head)
+    {
+        const ErrorEntry* slot = &self->errors[self->errorTail % ERROR_RING_SIZE];
+        const unsigned int seq = slot->seq;
+        __sync_synchronize();
+        const ErrorEntry entry = *slot;
+        __sync_synchronize();
+        if (seq != slot->seq || (int)(seq - (self->errorTail + 1)) < 0)
         {
-            PyObject* name = NULL;
-            int weight = 1;
-            
-            if (PyString_Check(item))
-            {
-                name = item;
-            }
-            else if (PyTuple_Check(item))
-            {
-                error = ! PyArg_ParseTuple(item, "Oi", &name, &weight);
-            }
-            if (name)    
-            {
-                const char* cserver = PyString_AsString(name);
-                assert(cserver);
-                debug(("cserver %s weight %d\n", cserver, weight));
-            
-                /* mc_server_add4 is not happy without ':' (it segfaults!) so check */
-                if (strstr(cserver, ":") == NULL)
-                {
-                    PyErr_Format(PyExc_TypeError,
-                                 "expected \"server:port\" but \"%s\" found", cserver);
-                    error = 1;
-                }
-                else
-                {
-                    int i;
-                    if (weight>15)
-                    {
-                        weight = 15;
-                    }
-                    Py_BEGIN_ALLOW_THREADS;
-                    for (i = 0; i < weight; ++i)
-                    {
-                        debug_def(int retval =)
-                            mcm_server_add4(self->mc_ctxt, self->mc, cserver);
-                        debug(("retval %d\n", retval));
-                    }
-                    Py_END_ALLOW_THREADS;
-                }
-            }
-            else
-            {
-                PyErr_BadArgument();
-                error = 1;
-            }
-            Py_DECREF(item);
+            // still being written, pick it up next time
+            break;
+        }
+        ++self->errorTail;
+        if (seq != self->errorTail)
+        {
+            // overwritten by a later error already
+            ++self->numErrorsDropped;
+            continue;
+        }
+        
+        ++self->numErrors;
+        if (entry.cont == 'n' || entry.cont == 'a')
+        {
+            ++self->numFatalErrors;
+        }
+        PyObject* exc = errorToException(&entry);
+        if (exc == NULL)
+        {
+            PyErr_Clear();
+            continue;
+        }
+        if (self->lastErrors == NULL)
+        {
+            self->lastErrors = PyList_New(0);
+        }
+        if (self->lastErrors == NULL || PyList_Append(self->lastErrors, exc) < 0)
+        {
+            PyErr_Clear();
+        }
+        else if (PyList_GET_SIZE(self->lastErrors) > ERROR_RING_SIZE)
+        {
+            PySequence_DelItem(self->lastErrors, 0);
         }
+        if (raise && error == NULL && entry.severity >= MCM_ERR_LVL_ERR)
+        {
+            error = exc;
+            Py_INCREF(error);
+        }
+        Py_DECREF(exc);
     }
+    
     if (error)
     {
-        mcm_free(self->mc_ctxt, self->mc);
-        self->mc = NULL;
+        PyErr_SetObject((PyObject*)error->ob_type, error);
+        Py_DECREF(error);
         return -1;
     }
     return 0;
 }
 
+/* Collect errors of the libmemcache call just done, -1 if an exception was raised. */
+#define checkErrors(self)                               \
+    ((self)->errorHead == (self)->errorTail ? 0 :       \
+     collectErrors((self), (self)->raiseErrors))
+
 //----------------------------------------------------------------------------------------
 //
 static int
-cmemcache_init(CmemcacheObject* self, PyObject* args, PyObject* kwds)
+bufferReserve(Buffer* buf, size_t extra)
 {
-    PyObject* servers = NULL;
-    char debug = 0;
-
-    if (!PyArg_ParseTuple(args, "O|b", &servers, &debug))
-        return -1; 
-
-    self->mc_ctxt = mcMemNewCtxt(free, malloc, malloc, realloc);
-    if (!self->mc_ctxt) {
-        return -1;
+    // Called without the GIL too, so no python exception on errors.
+    if (buf->size + extra <= buf->capacity)
+    {
+        return 0;
     }
-
-    /* put back pointer in misc */
-    self->mc_ctxt->ectxt->misc = self;
-    self->mcErr = self->mc_ctxt->mcErr; /* bummer, no mcErrGetCtxt */
-    
-    /* our ectxt->misc self pointer will be reset before we use it, so keep global
-       mcErr pointer as well. */
-    if (mcErr == 0) {
-        mcErr = self->mc_ctxt->mcErr; /* bummer, no mcErrGetCtxt */
+    if (buf->start > 0)
+    {
+        // make room by moving the data in use to the front first
+        memmove(buf->data, buf->data + buf->start, buf->size - buf->start);
+        buf->size -= buf->start;
+        buf->start = 0;
+        if (buf->size + extra <= buf->capacity)
+        {
+            return 0;
+        }
     }
+    size_t capacity = buf->capacity ? buf->capacity : 256;
+    while (capacity < buf->size + extra)
+    {
+        capacity *= 2;
+    }
+    char* data = realloc(buf->data, capacity);
+    if (data == NULL)
+    {
+        return -1;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
 
-    /* install our error func to adjust the ectxt to not exit() or abort(). */
-    mcErrSetupCtxt(self->mc_ctxt, errFunc);
+/*** Keys and server routing ***/
 
-    /* Instead of using errFunc we could also just mcm_err_filter_add ERR and FATAL but
-     * then our errFunc would not be called either. */
+/* memcached protocol limit */
+#define MAX_KEY_LENGTH 250
 
-    /* mcm_err_filter_add/del broken in libmemcache-1.4.0.rc2, needs to be patched for
-       to filter info, notice and warn */
-    debug(("error filter %x\n", mcm_err_filter_get(self->mc_ctxt)));
-#ifdef NDEBUG
-    /* turn off some message/errors */
-    mcm_err_filter_add(self->mc_ctxt, MCM_ERR_LVL_INFO);
-    mcm_err_filter_add(self->mc_ctxt, MCM_ERR_LVL_NOTICE);
-    mcm_err_filter_add(self->mc_ctxt, MCM_ERR_LVL_WARN);
-#endif
-    debug(("error filter %x\n", mcm_err_filter_get(self->mc_ctxt)));
+/* weights only size the routing buckets, but keep them reasonable */
+#define MAX_SERVER_WEIGHT 100
 
-    /* init self */
-    self->debug = debug;
-    self->throwException = 0; // FIXME: not used yet, better to fix libmemcache to retry
-    self->exceptionStr[0] = 0;
+//----------------------------------------------------------------------------------------
+//
+static const uint32_t crc32Table[256] = {
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f, 0xe963a535,
+    0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988, 0x09b64c2b, 0x7eb17cbd,
+    0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de, 0x1adad47d,
+    0x6ddde4eb, 0xf4d4b551, 0x83d385c7, 0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec,
+    0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4,
+    0xa2677172, 0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59, 0x26d930ac,
+    0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
+    0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924, 0x2f6f7c87, 0x58684c11, 0xc1611dab,
+    0xb6662d3d, 0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f,
+    0x9fbfe4a5, 0xe8b8d433, 0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb,
+    0x086d3d2d, 0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea,
+    0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65, 0x4db26158, 0x3ab551ce,
+    0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a,
+    0x346ed9fc, 0xad678846, 0xda60b8d0, 0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
+    0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409,
+    0xce61e49f, 0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a, 0xead54739,
+    0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8,
+    0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1, 0xf00f9344, 0x8708a3d2, 0x1e01f268,
+    0x6906c2fe, 0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0,
+    0x10da7a5a, 0x67dd4acc, 0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8,
+    0xa1d1937e, 0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55, 0x316e8eef,
+    0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236, 0xcc0c7795, 0xbb0b4703,
+    0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7,
+    0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d, 0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a,
+    0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae,
+    0x0cb61b38, 0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777, 0x88085ae6,
+    0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
+    0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2, 0xa7672661, 0xd06016f7, 0x4969474d,
+    0x3e6e77db, 0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5,
+    0x47b2cf7f, 0x30b5ffe9, 0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605,
+    0xcdd70693, 0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
 
-    /* set/init the servers */
-    return do_set_servers(self, servers);
+//----------------------------------------------------------------------------------------
+//
+static uint32_t
+keyHash(const char* key, size_t len)
+{
+    // Same as memcache.py serverHashFunction(), so both clients agree on the server of a
+    // key: ((crc32(key) & 0xffffffff) >> 16) & 0x7fff
+    uint32_t crc = 0xFFFFFFFF;
+    const unsigned char* p = (const unsigned char*)key;
+    const unsigned char* end = p + len;
+    while (p < end)
+    {
+        crc = crc32Table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ((crc ^ 0xFFFFFFFF) >> 16) & 0x7FFF;
 }
 
 //----------------------------------------------------------------------------------------
 //
-static PyObject*
-cmemcache_set_servers(PyObject* pyself, PyObject* servers)
+static int
+routeHash(const Routing* routing, uint32_t hash)
 {
-    CmemcacheObject* self = (CmemcacheObject*)pyself;
-    
-    if (do_set_servers(self, servers) != -1)
+    if (routing == NULL || routing->numBuckets == 0)
     {
-        Py_INCREF(Py_None);
-        return Py_None;
+        return -1;
     }
-    /* fixme: what to return in the error case, shouldn't an exception have been raised? */
-    return NULL;
+    return routing->buckets[hash % routing->numBuckets];
 }
 
 //----------------------------------------------------------------------------------------
 //
 static void
-cmemcache_dealloc(CmemcacheObject* self)
+freeRouting(Routing* routing)
 {
-    debug(("cmemcache_dealloc\n"));
-    
-    Py_BEGIN_ALLOW_THREADS;
+    if (routing)
+    {
+        int i;
+        for (i = 0; i < routing->numServers; ++i)
+        {
+            free(routing->servers[i].name);
+        }
+        free(routing->servers);
+        free(routing->buckets);
+        free(routing);
+    }
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+parseKey(CmemcacheObject* self, PyObject* obj, Key* key)
+{
+    PyObject* str = obj;
+    int explicitHash = 0;
+    
+    // (hash, key) puts key on the server of hash, like memcache.py
+    if (PyTuple_Check(obj) && PyTuple_GET_SIZE(obj) == 2)
+    {
+        PyObject* hash = PyTuple_GET_ITEM(obj, 0);
+        if (!PyInt_Check(hash) && !PyLong_Check(hash))
+        {
+            PyErr_SetString(MemcachedKeyTypeError, "key hash must be an integer");
+            return -1;
+        }
+        key->hash = (uint32_t)PyInt_AsUnsignedLongMask(hash);
+        explicitHash = 1;
+        str = PyTuple_GET_ITEM(obj, 1);
+    }
+    if (PyUnicode_Check(str))
+    {
+        // Borrowed and cached on the unicode object, the way "s#" does it.
+        str = _PyUnicode_AsDefaultEncodedString(str, NULL);
+        if (str == NULL)
+        {
+            return -1;
+        }
+    }
+    if (str == Py_None)
+    {
+        PyErr_SetString(MemcachedKeyNoneError, "key is None");
+        return -1;
+    }
+    if (!PyString_Check(str))
+    {
+        PyErr_Format(MemcachedKeyTypeError, "key must be str, not %.100s",
+                     str->ob_type->tp_name);
+        return -1;
+    }
+    key->key = PyString_AS_STRING(str);
+    key->len = PyString_GET_SIZE(str);
+    
+    if (key->len == 0)
+    {
+        PyErr_SetString(MemcachedKeyNoneError, "key is empty");
+        return -1;
+    }
+    if (key->len > MAX_KEY_LENGTH)
+    {
+        PyErr_Format(MemcachedKeyLengthError, "key length is > %d", MAX_KEY_LENGTH);
+        return -1;
+    }
+    const unsigned char* p = (const unsigned char*)key->key;
+    const unsigned char* end = p + key->len;
+    for (; p < end; ++p)
+    {
+        // whitespace and control characters break the protocol
+        if (*p <= ' ' || *p == 127)
+        {
+            PyErr_Format(MemcachedKeyCharacterError,
+                         "control or whitespace character 0x%02x in key", *p);
+            return -1;
+        }
+    }
+    
+    if (!explicitHash)
+    {
+        key->hash = keyHash(key->key, key->len);
+    }
+    key->server = routeHash(self->routing, key->hash);
+    key->local = 0;
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+freeKeys(KeyBatch* batch)
+{
+    if (batch->keys != batch->inlineKeys)
+    {
+        PyMem_Free(batch->keys);
+    }
+    batch->keys = batch->inlineKeys;
+    batch->size = 0;
+    Py_CLEAR(batch->seq);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+parseKeys(CmemcacheObject* self, PyObject* keys, KeyBatch* batch)
+{
+    batch->keys = batch->inlineKeys;
+    batch->size = 0;
+    batch->seq = PySequence_Fast(keys, "keys must be a sequence");
+    if (batch->seq == NULL)
+    {
+        return -1;
+    }
+    
+    const Py_ssize_t size = PySequence_Fast_GET_SIZE(batch->seq);
+    if (size > KEYBATCH_INLINE)
+    {
+        batch->keys = PyMem_New(Key, size);
+        if (batch->keys == NULL)
+        {
+            batch->keys = batch->inlineKeys;
+            freeKeys(batch);
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    
+    // Validate, hash and route all keys in one go.
+    PyObject** items = PySequence_Fast_ITEMS(batch->seq);
+    Py_ssize_t i;
+    for (i = 0; i < size; ++i)
+    {
+        if (parseKey(self, items[i], &batch->keys[i]) < 0)
+        {
+            freeKeys(batch);
+            return -1;
+        }
+    }
+    batch->size = size;
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+addKeys(CmemcacheObject* self, struct memcache_req* req, const KeyBatch* batch)
+{
+    Py_ssize_t i;
+    for (i = 0; i < batch->size; ++i)
+    {
+        const Key* key = &batch->keys[i];
+        if (key->local)
+            continue;
+        debug(("key \"%.*s\" len %d\n", key->len, key->key, key->len));
+        struct memcache_res* res = mcm_req_add(self->mc_ctxt, req, (char*)key->key, key->len);
+        res->hash = key->hash; // so libmemcache does not hash again
+        mcm_res_free_on_delete(self->mc_ctxt, res, 1);
+    }
+}
+
+//----------------------------------------------------------------------------------------
+//
+static u_int32_t
+hashFunc(MCM_HASH_FUNC)
+{
+    // Keys are hashed when parsed, libmemcache only asks for the one of the call in
+    // progress, or for a copy of a multi get key whose hash is 0 (its "not hashed").
+    if (activeKey && activeKey->len == (int)len && memcmp(activeKey->key, key, len) == 0)
+    {
+        return activeKey->hash;
+    }
+    Py_ssize_t i;
+    for (i = 0; activeBatch && i < activeBatch->size; ++i)
+    {
+        const Key* k = &activeBatch->keys[i];
+        if (k->hash == 0 && k->len == (int)len && memcmp(k->key, key, len) == 0)
+        {
+            return 0;
+        }
+    }
+    return keyHash(key, len);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static struct memcache_server*
+serverFindFunc(MCM_SERVER_FIND_FUNC)
+{
+    if (activeClient == NULL || activeClient->routing == NULL)
+    {
+        return NULL;
+    }
+    
+    // Route with our own (weighted) buckets, skip servers libmemcache marked as down.
+    const Routing* routing = activeClient->routing;
+    int i;
+    for (i = 0; i < routing->numBuckets; ++i)
+    {
+        const int server = routing->buckets[(hash + i) % routing->numBuckets];
+        struct memcache_server* ms = routing->servers[server].ms;
+        if (ms && ms->active != 'd')
+        {
+            return ms;
+        }
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static struct memcache_server*
+lastServer(struct memcache* mc)
+{
+    struct memcache_server *ms = mc->server_list.tqh_first;
+    while (ms && ms->entries.tqe_next)
+    {
+        ms = ms->entries.tqe_next;
+    }
+    return ms;
+}
+
+/*** Native connections ***/
+
+/*
+  Connections of our own next to the libmemcache ones, one per server, for the things
+  libmemcache can not do, like keeping many commands in flight. All of this runs without
+  the GIL, errors go to the error ring.
+*/
+
+/* How long to wait for a server that does not respond at all, if the call has no
+   earlier deadline */
+#define NATIVE_IO_TIMEOUT_MS 10000
+
+/* Seconds the stats of a periodic reweight() may take, without a client timeout */
+#define REWEIGHT_TIMEOUT 1.0
+
+/* Keys per get command */
+#define GET_BATCH_KEYS 100
+
+/* Parses the complete replies in conn->rbuf, see pumpConns */
+typedef int (*ReplyFunc)(CmemcacheObject* self, Conn* conn, void* arg);
+
+//----------------------------------------------------------------------------------------
+//
+static void
+connClose(Conn* conn)
+{
+    if (conn->fd >= 0)
+    {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    // keep the buffers, they are reused for the next connection
+    conn->wbuf.start = conn->wbuf.size = 0;
+    conn->rbuf.start = conn->rbuf.size = 0;
+    conn->outstanding = 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+freeConns(Conn* conns, int numConns)
+{
+    int i;
+    for (i = 0; conns && i < numConns; ++i)
+    {
+        connClose(&conns[i]);
+        free(conns[i].wbuf.data);
+        free(conns[i].rbuf.data);
+    }
+    free(conns);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+connFail(CmemcacheObject* self, Conn* conn, int errnum, const char* errstr)
+{
+    // The commands in flight are lost, and don't try this server again in this call.
+    reportError(self, errnum, errstr);
+    connClose(conn);
+    conn->failed = 1;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+pollTimeout(void)
+{
+    // The poll() timeout in milliseconds for the call in progress, 0 once its deadline
+    // passed.
+    if (callDeadline == 0)
+    {
+        return NATIVE_IO_TIMEOUT_MS;
+    }
+    const double left = (callDeadline - profileTime()) * 1000;
+    return left <= 0 ? 0 : left < NATIVE_IO_TIMEOUT_MS ? (int)left + 1 : NATIVE_IO_TIMEOUT_MS;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+deadlineExceeded(CmemcacheObject* self, Conn* conns, int numConns)
+{
+    // Give up on the commands in flight, their replies would confuse the next call. This
+    // is a warning, the replies that did arrive are returned.
+    int i;
+    for (i = 0; i < numConns; ++i)
+    {
+        Conn* conn = &conns[i];
+        if (conn->outstanding > 0 || conn->wbuf.start < conn->wbuf.size)
+        {
+            connClose(conn);
+            conn->failed = 1;
+        }
+    }
+    if (timedOutClient != self)
+    {
+        timedOutClient = self;
+        __sync_fetch_and_add(&self->numTimeouts, 1);
+        pushError(self, MCM_ERR_LVL_WARN, 'y', ETIMEDOUT, __FUNCTION__, __LINE__,
+                  "deadline exceeded");
+    }
+}
+
+//----------------------------------------------------------------------------------------
+//
+static const char*
+unixSocketPath(const char* name)
+{
+    // "unix:/path" or "/path" server addresses are unix domain sockets
+    if (strncmp(name, "unix:", 5) == 0)
+    {
+        return name + 5;
+    }
+    return name[0] == '/' ? name : NULL;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+connSocket(CmemcacheObject* self, int family, int socktype, int protocol)
+{
+    const int fd = socket(family, socktype, protocol);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    // failing options are not fatal, the defaults work too
+    int on = 1;
+    if (family != AF_UNIX)
+    {
+        if (self->tcpNoDelay)
+        {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        if (self->keepAlive)
+        {
+            setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        }
+    }
+    if (self->sndBuf > 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &self->sndBuf, sizeof(self->sndBuf));
+    }
+    if (self->rcvBuf > 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &self->rcvBuf, sizeof(self->rcvBuf));
+    }
+    return fd;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+connConnect(int fd, const struct sockaddr* addr, socklen_t addrlen)
+{
+    // Connect the non-blocking fd within pollTimeout(), returns 0 or the errno.
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (connect(fd, addr, addrlen) == 0)
+    {
+        return 0;
+    }
+    if (errno != EINPROGRESS)
+    {
+        return errno;
+    }
+    struct pollfd pollfd;
+    pollfd.fd = fd;
+    pollfd.events = POLLOUT;
+    int ready;
+    do
+    {
+        pollfd.revents = 0;
+        ready = poll(&pollfd, 1, pollTimeout());
+    }
+    while (ready < 0 && errno == EINTR);
+    if (ready <= 0)
+    {
+        return ready == 0 ? ETIMEDOUT : errno;
+    }
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+    {
+        return errno;
+    }
+    return error;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+connOpen(CmemcacheObject* self, Conn* conn, const char* name)
+{
+    int fd = -1;
+    int errnum = 0;
+    const char* path = unixSocketPath(name);
+    if (path)
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path))
+        {
+            connFail(self, conn, 0, "unix socket path too long");
+            return -1;
+        }
+        strcpy(addr.sun_path, path);
+        fd = connSocket(self, AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 &&
+            (errnum = connConnect(fd, (struct sockaddr*)&addr, sizeof(addr))) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    else
+    {
+        char host[256];
+        const char* colon = strrchr(name, ':');
+        if (colon == NULL || colon - name >= (int)sizeof(host))
+        {
+            connFail(self, conn, 0, "bad server address");
+            return -1;
+        }
+        memcpy(host, name, colon - name);
+        host[colon - name] = 0;
+    
+        struct addrinfo hints;
+        struct addrinfo* addrs = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        const int retval = getaddrinfo(host, colon + 1, &hints, &addrs);
+        if (retval != 0)
+        {
+            connFail(self, conn, 0, gai_strerror(retval));
+            return -1;
+        }
+    
+        struct addrinfo* addr;
+        for (addr = addrs; addr && fd < 0; addr = addr->ai_next)
+        {
+            fd = connSocket(self, addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (fd >= 0 && (errnum = connConnect(fd, addr->ai_addr, addr->ai_addrlen)) != 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addrs);
+    }
+    if (fd < 0 && errnum == ETIMEDOUT && pollTimeout() == 0)
+    {
+        // the deadline, not the server, see pumpServerConns
+        return -1;
+    }
+    if (fd < 0)
+    {
+        connFail(self, conn, errnum, "connect() failed");
+        return -1;
+    }
+    
+    conn->fd = fd;
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+connWrite(Conn* conn)
+{
+    Buffer* buf = &conn->wbuf;
+    while (buf->start < buf->size)
+    {
+        const ssize_t n = send(conn->fd, buf->data + buf->start, buf->size - buf->start,
+                               MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        buf->start += n;
+    }
+    buf->start = buf->size = 0;
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+connRead(Conn* conn)
+{
+    Buffer* buf = &conn->rbuf;
+    if (buf->start == buf->size)
+    {
+        buf->start = buf->size = 0;
+    }
+    if (bufferReserve(buf, 16384) < 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (;;)
+    {
+        const ssize_t n = recv(conn->fd, buf->data + buf->size,
+                               buf->capacity - buf->size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+        {
+            // connection closed by server
+            if (n == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+        buf->size += n;
+        return 0;
+    }
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+connLine(Conn* conn, const char** line, size_t* len)
+{
+    // Next complete "...\r\n" reply line, without the "\r\n".
+    Buffer* buf = &conn->rbuf;
+    const char* start = buf->data + buf->start;
+    const char* end = memchr(start, '\n', buf->size - buf->start);
+    if (end == NULL)
+    {
+        return 0;
+    }
+    *line = start;
+    *len = end - start;
+    if (*len > 0 && start[*len - 1] == '\r')
+    {
+        --*len;
+    }
+    buf->start += end + 1 - start;
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+connQueueSet(Conn* conn, const char* key, int keyLen, int flags, time_t exptime,
+             const char* data, size_t size)
+{
+    char header[MAX_KEY_LENGTH + 64];
+    const int headerLen = snprintf(header, sizeof(header), "set %.*s %d %ld %lu\r\n",
+                                   keyLen, key, flags, (long)exptime, (unsigned long)size);
+    if (bufferReserve(&conn->wbuf, headerLen + size + 2) < 0)
+    {
+        return -1;
+    }
+    char* p = conn->wbuf.data + conn->wbuf.size;
+    memcpy(p, header, headerLen);
+    memcpy(p + headerLen, data, size);
+    memcpy(p + headerLen + size, "\r\n", 2);
+    conn->wbuf.size += headerLen + size + 2;
+    ++conn->outstanding;
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+queueGets(CmemcacheObject* self, const KeyBatch* batch, int* order, int* next, int* end)
+{
+    /*
+      Group the keys by server and queue get commands of GET_BATCH_KEYS keys. order gets
+      the batch indices grouped by server, order[next[server]:end[server]] are the keys
+      of server, in the order of the replies.
+    */
+    Py_ssize_t i;
+    int server;
+    memset(end, 0, self->numConns * sizeof(int));
+    for (i = 0; i < batch->size; ++i)
+    {
+        if (batch->keys[i].server >= 0 && batch->keys[i].server < self->numConns &&
+            !batch->keys[i].local)
+        {
+            ++end[batch->keys[i].server];
+        }
+    }
+    int pos = 0;
+    for (server = 0; server < self->numConns; ++server)
+    {
+        next[server] = pos;
+        pos += end[server];
+        end[server] = next[server];
+    }
+    for (i = 0; i < batch->size; ++i)
+    {
+        if (batch->keys[i].server >= 0 && batch->keys[i].server < self->numConns &&
+            !batch->keys[i].local)
+        {
+            order[end[batch->keys[i].server]++] = i;
+        }
+    }
+    
+    for (server = 0; server < self->numConns; ++server)
+    {
+        Conn* conn = &self->conns[server];
+        for (pos = next[server]; pos < end[server]; ++pos)
+        {
+            const Key* key = &batch->keys[order[pos]];
+            if (bufferReserve(&conn->wbuf, key->len + 8) < 0)
+            {
+                return -1;
+            }
+            char* p = conn->wbuf.data + conn->wbuf.size;
+            if ((pos - next[server]) % GET_BATCH_KEYS == 0)
+            {
+                memcpy(p, "get", 3);
+                p += 3;
+            }
+            *p++ = ' ';
+            memcpy(p, key->key, key->len);
+            p += key->len;
+            if ((pos - next[server]) % GET_BATCH_KEYS == GET_BATCH_KEYS - 1 ||
+                pos == end[server] - 1)
+            {
+                memcpy(p, "\r\n", 2);
+                p += 2;
+                ++conn->outstanding;
+            }
+            conn->wbuf.size = p - conn->wbuf.data;
+        }
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+connReplyError(CmemcacheObject* self, const char* line, size_t len)
+{
+    // ERROR, CLIENT_ERROR and SERVER_ERROR replies, report them and carry on
+    if ((len >= 5 && memcmp(line, "ERROR", 5) == 0) ||
+        (len >= 12 && memcmp(line, "CLIENT_ERROR", 12) == 0) ||
+        (len >= 12 && memcmp(line, "SERVER_ERROR", 12) == 0))
+    {
+        char errstr[sizeof(((ErrorEntry*)0)->errstr)];
+        const size_t n = len < sizeof(errstr) - 1 ? len : sizeof(errstr) - 1;
+        memcpy(errstr, line, n);
+        errstr[n] = 0;
+        reportError(self, 0, errstr);
+        return 0;
+    }
+    return -1;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+parseDecimal(const char** pp, const char* end, unsigned long long* value)
+{
+    const char* p = *pp;
+    while (p < end && *p == ' ')
+    {
+        ++p;
+    }
+    if (p == end || *p < '0' || *p > '9')
+    {
+        return -1;
+    }
+    *value = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        *value = *value * 10 + (*p++ - '0');
+    }
+    *pp = p;
+    return 0;
+}
+
+/* A VALUE of a get reply, pointing into Conn.rbuf until the next connRead */
+typedef struct
+{
+    const char* key;
+    int keyLen;
+    unsigned int flags;
+    const char* data;
+    size_t size;
+} Value;
+
+//----------------------------------------------------------------------------------------
+//
+static int
+connValue(CmemcacheObject* self, Conn* conn, Value* value)
+{
+    /*
+      Next reply of a get command in conn->rbuf: 1 for a VALUE, 2 for the END (or the error)
+      of the command, 0 if the reply is not complete yet and -1 for garbage.
+    */
+    Buffer* buf = &conn->rbuf;
+    const size_t start = buf->start;
+    const char* line;
+    size_t len;
+    if (!connLine(conn, &line, &len))
+    {
+        return 0;
+    }
+    if (len == 3 && memcmp(line, "END", 3) == 0)
+    {
+        return 2;
+    }
+    if (len > 6 && memcmp(line, "VALUE ", 6) == 0)
+    {
+        const char* p = line + 6;
+        const char* end = line + len;
+        value->key = p;
+        while (p < end && *p != ' ')
+        {
+            ++p;
+        }
+        value->keyLen = p - value->key;
+        unsigned long long flags;
+        unsigned long long size;
+        if (parseDecimal(&p, end, &flags) < 0 || parseDecimal(&p, end, &size) < 0)
+        {
+            return -1;
+        }
+        if (buf->size - buf->start < size + 2)
+        {
+            // wait for the rest of the data block
+            buf->start = start;
+            return 0;
+        }
+        value->flags = flags;
+        value->data = buf->data + buf->start;
+        value->size = size;
+        buf->start += size + 2;
+        return 1;
+    }
+    return connReplyError(self, line, len) < 0 ? -1 : 2;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+pumpServerConns(CmemcacheObject* self, Conn* conns, const Server* servers, int numConns,
+                struct pollfd* pollfds, int* pollConns, int lowWater, ReplyFunc parse,
+                void* arg)
+{
+    /*
+      Called without the GIL. Write the queued commands of conns (one per server, with
+      room for numConns in pollfds and pollConns) and read the replies, until no server
+      has more than lowWater commands outstanding or the deadline of the call passed.
+      Servers that fail lose their outstanding commands.
+    */
+    for (;;)
+    {
+        int numPoll = 0;
+        int expired = 0;
+        int i;
+        for (i = 0; i < numConns; ++i)
+        {
+            Conn* conn = &conns[i];
+            const int writing = conn->wbuf.start < conn->wbuf.size;
+            if (conn->outstanding <= lowWater && !writing)
+                continue;
+            if (conn->fd < 0 && (conn->failed ||
+                                 connOpen(self, conn, servers[i].name) < 0))
+            {
+                expired |= pollTimeout() == 0;
+                connClose(conn);
+                continue;
+            }
+            pollfds[numPoll].fd = conn->fd;
+            pollfds[numPoll].events = (writing ? POLLOUT : 0) |
+                (conn->outstanding > 0 ? POLLIN : 0);
+            pollfds[numPoll].revents = 0;
+            pollConns[numPoll++] = i;
+        }
+        const int timeout = pollTimeout();
+        if (numPoll == 0 && !expired)
+        {
+            return;
+        }
+        if (timeout == 0)
+        {
+            deadlineExceeded(self, conns, numConns);
+            return;
+        }
+        
+        const int ready = poll(pollfds, numPoll, timeout);
+        const int errnum = errno;
+        if (ready < 0 && errnum == EINTR)
+        {
+            continue;
+        }
+        if (ready == 0 && timeout < NATIVE_IO_TIMEOUT_MS)
+        {
+            // the deadline, not the servers
+            deadlineExceeded(self, conns, numConns);
+            return;
+        }
+        for (i = 0; i < numPoll; ++i)
+        {
+            Conn* conn = &conns[pollConns[i]];
+            const short revents = pollfds[i].revents;
+            if (ready < 0)
+            {
+                connFail(self, conn, errnum, "poll() failed");
+            }
+            else if (ready == 0)
+            {
+                connFail(self, conn, ETIMEDOUT, "server did not respond");
+            }
+            else if ((revents & POLLOUT) && connWrite(conn) < 0)
+            {
+                connFail(self, conn, errno, "send() failed");
+            }
+            else if ((revents & (POLLIN | POLLERR | POLLHUP)) && connRead(conn) < 0)
+            {
+                connFail(self, conn, errno, "recv() failed");
+            }
+            else if ((revents & POLLIN) && parse(self, conn, arg) < 0)
+            {
+                connFail(self, conn, 0, "unexpected reply");
+            }
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+pumpConns(CmemcacheObject* self, int lowWater, ReplyFunc parse, void* arg)
+{
+    // pumpServerConns on the connections of the client, called with its lock.
+    pumpServerConns(self, self->conns, self->routing ? self->routing->servers : NULL,
+                    self->numConns, self->pollfds, self->pollConns, lowWater, parse, arg);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+resetConns(CmemcacheObject* self)
+{
+    // Start of a call, retry the servers that failed before.
+    int i;
+    for (i = 0; i < self->numConns; ++i)
+    {
+        self->conns[i].failed = 0;
+    }
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+do_set_servers(CmemcacheObject* self, PyObject* servers)
+{
+    debug(("do_set_servers\n"));
+    
+    if (!PySequence_Check(servers))
+    {
+        PyErr_BadArgument();
+        return -1;
+    }
+
+    int error = 0;
+    
+    /* there seems to be no way to remove servers, so get rid of memcache all together:
+       build a new instance, routing and connections, and swap them in when complete */
+    struct memcache* mc = mcm_new(self->mc_ctxt);
+    debug(("new mc %p\n", mc));
+    const int size = PySequence_Size(servers);
+    Routing* routing = calloc(1, sizeof(Routing));
+    if (routing)
+    {
+        routing->servers = calloc(size > 0 ? size : 1, sizeof(Server));
+    }
+    if (mc == NULL || routing == NULL || routing->servers == NULL)
+    {
+        if (mc)
+        {
+            mcm_free(self->mc_ctxt, mc);
+        }
+        freeRouting(routing);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    /* add servers, allow any sequence of strings */
+    int i;
+    for (i = 0; i < size && error == 0; ++i)
+    {
+        PyObject* item = PySequence_GetItem(servers, i);
+        if (item)
+        {
+            PyObject* name = NULL;
+            int weight = 1;
+            
+            if (PyString_Check(item))
+            {
+                name = item;
+            }
+            else if (PyTuple_Check(item))
+            {
+                error = ! PyArg_ParseTuple(item, "Oi", &name, &weight);
+            }
+            const char* cserver = name ? PyString_AsString(name) : NULL;
+            if (cserver)
+            {
+                debug(("cserver %s weight %d\n", cserver, weight));
+            
+                /* mc_server_add4 is not happy without ':' (it segfaults!) so check */
+                const int unixSocket = unixSocketPath(cserver) != NULL;
+                if (!unixSocket && strstr(cserver, ":") == NULL)
+                {
+                    PyErr_Format(PyExc_TypeError,
+                                 "expected \"server:port\" or \"unix:/path\" but \"%s\" found",
+                                 cserver);
+                    error = 1;
+                }
+                else
+                {
+                    /* Add each server once, the weight is in the routing buckets. */
+                    weight = weight < 0 ? 0 : weight > MAX_SERVER_WEIGHT ?
+                        MAX_SERVER_WEIGHT : weight;
+                    Server* server = &routing->servers[routing->numServers++];
+                    server->name = strdup(cserver);
+                    server->weight = weight;
+                    server->baseWeight = weight;
+                    routing->numBuckets += weight;
+                    if (unixSocket)
+                    {
+                        /* libmemcache only does TCP, see useNative */
+                        ++routing->numUnix;
+                    }
+                    else
+                    {
+                        BEGIN_MC_CALL(self, NULL);
+                        debug_def(int retval =)
+                            mcm_server_add4(self->mc_ctxt, mc, cserver);
+                        debug(("retval %d\n", retval));
+                        END_MC_CALL;
+                        collectErrors(self, 0);
+                        server->ms = lastServer(mc);
+                    }
+                    if (server->name == NULL)
+                    {
+                        PyErr_NoMemory();
+                        error = 1;
+                    }
+                }
+            }
+            else
+            {
+                PyErr_BadArgument();
+                error = 1;
+            }
+            Py_DECREF(item);
+        }
+    }
+    if (error == 0 && routing->numBuckets > 0)
+    {
+        routing->buckets = malloc(routing->numBuckets * sizeof(int));
+        if (routing->buckets == NULL)
+        {
+            PyErr_NoMemory();
+            error = 1;
+        }
+        else
+        {
+            int bucket = 0;
+            int w;
+            for (i = 0; i < routing->numServers; ++i)
+            {
+                for (w = 0; w < routing->servers[i].weight; ++w)
+                {
+                    routing->buckets[bucket++] = i;
+                }
+            }
+        }
+    }
+    const int numConns = routing->numServers > 0 ? routing->numServers : 1;
+    Conn* conns = NULL;
+    struct pollfd* pollfds = NULL;
+    int* pollConns = NULL;
+    if (error == 0)
+    {
+        conns = calloc(numConns, sizeof(Conn));
+        pollfds = calloc(numConns, sizeof(struct pollfd));
+        pollConns = calloc(numConns, sizeof(int));
+        if (conns == NULL || pollfds == NULL || pollConns == NULL)
+        {
+            PyErr_NoMemory();
+            error = 1;
+        }
+        else
+        {
+            for (i = 0; i < numConns; ++i)
+            {
+                conns[i].fd = -1;
+            }
+        }
+    }
+    if (error)
+    {
+        mcm_free(self->mc_ctxt, mc);
+        freeRouting(routing);
+        free(conns);
+        free(pollfds);
+        free(pollConns);
+        return -1;
+    }
+
+    // Swap with the GIL (parseKey) and ioLock (the calls in flight of a shared client)
+    // held, and free the old ones after, like reweightServers.
+    CmemcacheObject* locked;
+    Py_BEGIN_ALLOW_THREADS;
+    locked = lockClient(self);
+    Py_END_ALLOW_THREADS;
+    struct memcache* oldMc = self->mc;
+    Routing* oldRouting = self->routing;
+    Conn* oldConns = self->conns;
+    const int oldNumConns = self->numConns;
+    struct pollfd* oldPollfds = self->pollfds;
+    int* oldPollConns = self->pollConns;
+    self->mc = mc;
+    self->routing = routing;
+    ++self->routingVersion;
+    self->conns = conns;
+    self->numConns = routing->numServers;
+    self->pollfds = pollfds;
+    self->pollConns = pollConns;
+    unlockClient(locked);
+
+    if (oldMc)
+    {
+        mcm_free(self->mc_ctxt, oldMc);
+    }
+    freeRouting(oldRouting);
+    freeConns(oldConns, oldNumConns);
+    free(oldPollfds);
+    free(oldPollConns);
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+cmemcache_init(CmemcacheObject* self, PyObject* args, PyObject* kwds)
+{
+    PyObject* servers = NULL;
+    char debug = 0;
+
+    if (!PyArg_ParseTuple(args, "O|b", &servers, &debug))
+        return -1; 
+
+    self->mc_ctxt = mcMemNewCtxt(free, malloc, malloc, realloc);
+    if (!self->mc_ctxt) {
+        return -1;
+    }
+
+    /* errFunc only calls this when debugging */
+    self->mcErr = self->mc_ctxt->mcErr; /* bummer, no mcErrGetCtxt */
+    
+    /* for errors outside of our calls (activeClient not set), keep global mcErr pointer
+       as well. */
+    if (mcErr == 0) {
+        mcErr = self->mc_ctxt->mcErr; /* bummer, no mcErrGetCtxt */
+    }
+
+    /* install our error func to adjust the ectxt to not exit() or abort(). */
+    mcErrSetupCtxt(self->mc_ctxt, errFunc);
+
+    /* route keys with our own (memcache.py compatible) hash and weighted buckets */
+    self->mc_ctxt->mcHashKey = hashFunc;
+    self->mc_ctxt->mcServerFind = serverFindFunc;
+
+    /* Instead of using errFunc we could also just mcm_err_filter_add ERR and FATAL but
+     * then our errFunc would not be called either. */
+
+    /* mcm_err_filter_add/del broken in libmemcache-1.4.0.rc2, needs to be patched for
+       to filter info, notice and warn */
+    debug(("error filter %x\n", mcm_err_filter_get(self->mc_ctxt)));
+#ifdef NDEBUG
+    /* turn off some message/errors */
+    mcm_err_filter_add(self->mc_ctxt, MCM_ERR_LVL_INFO);
+    mcm_err_filter_add(self->mc_ctxt, MCM_ERR_LVL_NOTICE);
+    mcm_err_filter_add(self->mc_ctxt, MCM_ERR_LVL_WARN);
+#endif
+    debug(("error filter %x\n", mcm_err_filter_get(self->mc_ctxt)));
+
+    /* init self */
+    self->debug = debug;
+    self->raiseErrors = 0;
+    self->tcpNoDelay = 1;
+    self->keepAlive = 1;
+    self->batchWindow = 50;
+    self->reweightThreshold = 0.05;
+    if (!self->syncReady)
+    {
+        pthread_mutex_init(&self->ioLock, NULL);
+        pthread_mutex_init(&self->batchLock, NULL);
+        pthread_cond_init(&self->batchFull, NULL);
+        pthread_cond_init(&self->batchDone, NULL);
+        self->syncReady = 1;
+    }
+
+    /* set/init the servers */
+    return do_set_servers(self, servers);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_set_servers(PyObject* pyself, PyObject* servers)
+{
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    
+    if (do_set_servers(self, servers) != -1)
+    {
+        if (self->writeBehind && restartWriteBehind(self) < 0)
+            return NULL;
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    /* fixme: what to return in the error case, shouldn't an exception have been raised? */
+    return NULL;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+cmemcache_dealloc(CmemcacheObject* self)
+{
+    debug(("cmemcache_dealloc\n"));
+    
+    closeWriteBehind(self);
+    Py_BEGIN_ALLOW_THREADS;
     if (self->mc)
     {
-        mcm_free(self->mc_ctxt, self->mc);
-        self->mc = 0;
+        mcm_free(self->mc_ctxt, self->mc);
+        self->mc = 0;
+    }
+    if (self->mc_ctxt)
+    {
+        mcMemFreeCtxt(self->mc_ctxt);
+        self->mc_ctxt = 0;
+    }
+    Py_END_ALLOW_THREADS;
+    freeRouting(self->routing);
+    self->routing = NULL;
+    freeConns(self->conns, self->numConns);
+    self->conns = NULL;
+    free(self->pollfds);
+    free(self->pollConns);
+    Py_CLEAR(self->lastErrors);
+    Py_CLEAR(self->tombstones);
+    freeNearCache(self->near);
+    self->near = NULL;
+    freeInterned(self);
+    if (self->syncReady)
+    {
+        pthread_mutex_destroy(&self->ioLock);
+        pthread_mutex_destroy(&self->batchLock);
+        pthread_cond_destroy(&self->batchFull);
+        pthread_cond_destroy(&self->batchDone);
+    }
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+/*** Negative caching ***/
+
+/*
+  A tombstone is an empty value with _FLAG_TOMBSTONE, stored with set_tombstone() once a
+  key is known to not exist in the backend. get() and get_multi() return the Tombstone
+  sentinel for it. With tombstone_ttl set, tombstones are also mirrored in the client
+  for that many seconds, so repeated gets of absent keys do not go to the servers.
+  Stores and deletes through the same client drop the mirrored tombstone.
+*/
+
+/* Mirrored tombstones before expired ones are purged */
+#define MAX_LOCAL_TOMBSTONES 10000
+
+//----------------------------------------------------------------------------------------
+//
+static double
+now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+rememberTombstone(CmemcacheObject* self, const Key* key)
+{
+    if (self->tombstoneTtl <= 0)
+    {
+        return;
+    }
+    if (self->tombstones == NULL)
+    {
+        self->tombstones = PyDict_New();
+    }
+    else if (PyDict_Size(self->tombstones) >= MAX_LOCAL_TOMBSTONES)
+    {
+        // purge the expired ones, or all if they are all still valid
+        const double t = now();
+        PyObject* expired = PyList_New(0);
+        PyObject* keyobj;
+        PyObject* expires;
+        Py_ssize_t pos = 0;
+        while (expired && PyDict_Next(self->tombstones, &pos, &keyobj, &expires))
+        {
+            if (PyFloat_AS_DOUBLE(expires) <= t && PyList_Append(expired, keyobj) < 0)
+            {
+                Py_CLEAR(expired);
+            }
+        }
+        for (pos = 0; expired && pos < PyList_GET_SIZE(expired); ++pos)
+        {
+            PyDict_DelItem(self->tombstones, PyList_GET_ITEM(expired, pos));
+        }
+        if (expired == NULL || PyList_GET_SIZE(expired) == 0)
+        {
+            PyDict_Clear(self->tombstones);
+        }
+        Py_XDECREF(expired);
+    }
+    PyObject* keyobj = PyString_FromStringAndSize(key->key, key->len);
+    PyObject* expires = PyFloat_FromDouble(now() + self->tombstoneTtl);
+    if (self->tombstones == NULL || keyobj == NULL || expires == NULL ||
+        PyDict_SetItem(self->tombstones, keyobj, expires) < 0)
+    {
+        // the mirror is only an optimization
+        PyErr_Clear();
+    }
+    Py_XDECREF(keyobj);
+    Py_XDECREF(expires);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+isLocalTombstone(CmemcacheObject* self, const Key* key, int forget)
+{
+    // Look up key in the mirror, expired tombstones (and all with forget) are removed.
+    if (self->tombstones == NULL || PyDict_Size(self->tombstones) == 0)
+    {
+        return 0;
+    }
+    PyObject* keyobj = PyString_FromStringAndSize(key->key, key->len);
+    PyObject* expires = keyobj ? PyDict_GetItem(self->tombstones, keyobj) : NULL;
+    int found = 0;
+    if (expires)
+    {
+        found = !forget && PyFloat_AS_DOUBLE(expires) > now();
+        if (!found)
+        {
+            PyDict_DelItem(self->tombstones, keyobj);
+        }
+    }
+    Py_XDECREF(keyobj);
+    PyErr_Clear();
+    if (found)
+    {
+        ++self->numTombstoneHits;
+    }
+    return found;
+}
+
+#define forgetTombstone(self, key) isLocalTombstone((self), (key), 1)
+
+/*** Near cache ***/
+
+/*
+  An optional cache of small values in a memory mapped file, shared by all processes
+  (and clients) that open the same file, in front of the network gets. It is a fixed
+  array of slots, open addressed with NEAR_PROBES probes. Each slot is a seqlock: the
+  writer makes seq odd, writes the entry and makes seq even again, readers copy the
+  entry and retry (or miss) when seq changed meanwhile. Writers first claim the slot by
+  putting their pid in writer, writers that find a slot busy don't wait, it's only a
+  cache. A slot left claimed (and seq odd) by a process that died in the middle of a
+  write is taken over by the next writer. Entries expire ttl seconds after they were
+  fetched, and are invalidated by stores and deletes through the clients that share the
+  file.
+*/
+
+#define NEAR_MAGIC "CMEMNEAR"
+#define NEAR_VERSION 2
+#define NEAR_PROBES 4
+
+typedef struct
+{
+    char magic[8];               /* written last by the process that creates the file */
+    uint32_t version;
+    uint32_t numSlots;           /* a power of 2 */
+    uint32_t slotSize;
+    uint32_t reserved;
+} NearHeader;
+
+typedef struct
+{
+    volatile uint32_t seq;       /* odd while the entry is written */
+    volatile uint32_t writer;    /* pid of the process writing the entry, or 0 */
+    uint64_t hash;
+    uint64_t expires;            /* milliseconds since the epoch, 0 for a free slot */
+    uint32_t keyLen;
+    uint32_t flags;
+    uint32_t size;
+    uint32_t reserved;
+    char data[];                 /* the key, then the value */
+} NearEntry;
+
+struct NearCache
+{
+    char* map;
+    size_t mapSize;
+    uint32_t numSlots;
+    uint32_t slotSize;
+    double ttl;
+};
+
+//----------------------------------------------------------------------------------------
+//
+static uint64_t
+nearHash(const char* key, int len)
+{
+    // 64 bit FNV-1a, the 15 bit routing hash is too small for this
+    uint64_t hash = 14695981039346656037ULL;
+    int i;
+    for (i = 0; i < len; ++i)
+    {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static NearEntry*
+nearSlot(const NearCache* near, uint64_t hash, int probe)
+{
+    const uint32_t slot = (uint32_t)(hash + probe) & (near->numSlots - 1);
+    return (NearEntry*)(near->map + sizeof(NearHeader) + (size_t)slot * near->slotSize);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+nearLock(NearEntry* entry)
+{
+    // Claim entry for writing and make its seq odd, 0 if another live process (or thread)
+    // is writing it.
+    const uint32_t pid = getpid();
+    const uint32_t owner = entry->writer;
+    if (owner && (owner == pid || kill(owner, 0) == 0 || errno != ESRCH))
+    {
+        return 0;
+    }
+    if (!__sync_bool_compare_and_swap(&entry->writer, owner, pid))
+    {
+        return 0;
+    }
+    // a dead owner may have left seq odd already
+    if (!(entry->seq & 1))
+    {
+        entry->seq = entry->seq + 1;
+    }
+    __sync_synchronize();
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+nearUnlock(NearEntry* entry)
+{
+    __sync_synchronize();
+    entry->seq = entry->seq + 1;
+    __sync_synchronize();
+    entry->writer = 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+freeNearCache(NearCache* near)
+{
+    if (near)
+    {
+        munmap(near->map, near->mapSize);
+        free(near);
+    }
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+nearLookup(CmemcacheObject* self, const char* key, int keyLen, unsigned int* flags)
+{
+    // The value of key as a new string, or NULL if it is not in the near cache.
+    const NearCache* near = self->near;
+    if (near == NULL)
+    {
+        return NULL;
+    }
+    const uint64_t hash = nearHash(key, keyLen);
+    const uint64_t t = (uint64_t)(now() * 1000);
+    const size_t maxData = near->slotSize - sizeof(NearEntry);
+    int probe;
+    for (probe = 0; probe < NEAR_PROBES; ++probe)
+    {
+        NearEntry* entry = nearSlot(near, hash, probe);
+        const uint32_t seq = entry->seq;
+        __sync_synchronize();
+        const uint32_t size = entry->size;
+        if ((seq & 1) || entry->hash != hash || entry->keyLen != (uint32_t)keyLen ||
+            entry->expires <= t || keyLen + (size_t)size > maxData ||
+            memcmp(entry->data, key, keyLen) != 0)
+        {
+            continue;
+        }
+        *flags = entry->flags;
+        PyObject* value = PyString_FromStringAndSize(entry->data + keyLen, size);
+        __sync_synchronize();
+        if (value && entry->seq == seq)
+        {
+            ++self->numNearHits;
+            return value;
+        }
+        // overwritten while copying
+        Py_XDECREF(value);
+        PyErr_Clear();
+        break;
+    }
+    ++self->numNearMisses;
+    return NULL;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+nearStore(CmemcacheObject* self, const char* key, int keyLen, const char* data,
+          size_t size, unsigned int flags)
+{
+    // Put a fetched value in the near cache, data NULL invalidates key.
+    const NearCache* near = self->near;
+    if (near == NULL || (data && keyLen + size > near->slotSize - sizeof(NearEntry)))
+    {
+        return;
+    }
+    const uint64_t hash = nearHash(key, keyLen);
+    const uint64_t t = (uint64_t)(now() * 1000);
+    
+    // The slot of key, else a free or expired one, else the one that expires first.
+    NearEntry* victim = NULL;
+    int probe;
+    for (probe = 0; probe < NEAR_PROBES; ++probe)
+    {
+        NearEntry* entry = nearSlot(near, hash, probe);
+        if (entry->hash == hash && entry->keyLen == (uint32_t)keyLen &&
+            memcmp(entry->data, key, keyLen) == 0)
+        {
+            victim = entry;
+            break;
+        }
+        if (victim == NULL || (victim->expires > t && entry->expires < victim->expires))
+        {
+            victim = entry;
+        }
+    }
+    if (data == NULL && (victim->hash != hash || victim->keyLen != (uint32_t)keyLen))
+    {
+        // nothing to invalidate
+        return;
+    }
+    
+    if (!nearLock(victim))
+    {
+        return;
+    }
+    victim->hash = hash;
+    victim->keyLen = keyLen;
+    victim->flags = flags;
+    victim->size = data ? size : 0;
+    memcpy(victim->data, key, keyLen);
+    if (data)
+    {
+        memcpy(victim->data + keyLen, data, size);
+    }
+    victim->expires = data ? t + (uint64_t)(near->ttl * 1000) : 0;
+    nearUnlock(victim);
+}
+
+#define nearInvalidate(self, key, keyLen) nearStore((self), (key), (keyLen), NULL, 0, 0)
+
+//----------------------------------------------------------------------------------------
+//
+static void
+nearClear(CmemcacheObject* self)
+{
+    // Invalidate all entries, for flush_all().
+    const NearCache* near = self->near;
+    uint32_t slot;
+    for (slot = 0; near && slot < near->numSlots; ++slot)
+    {
+        NearEntry* entry = (NearEntry*)(near->map + sizeof(NearHeader) +
+                                        (size_t)slot * near->slotSize);
+        if (entry->expires && nearLock(entry))
+        {
+            entry->expires = 0;
+            nearUnlock(entry);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+addLocalValues(CmemcacheObject* self, KeyBatch* batch, PyObject* dict, int decode,
+               PyObject* serializers)
+{
+    // Put the mirrored tombstones and near cache values of a multi get in dict, marking
+    // their keys local.
+    Py_ssize_t i;
+    int numLocal = 0;
+    for (i = 0; dict && i < batch->size; ++i)
+    {
+        Key* key = &batch->keys[i];
+        PyObject* val = NULL;
+        unsigned int flags;
+        if (isLocalTombstone(self, key, 0))
+        {
+            Py_INCREF(Tombstone);
+            val = Tombstone;
+        }
+        else if ((val = nearLookup(self, key->key, key->len, &flags)) && decode)
+        {
+            PyObject* raw = val;
+            val = decodeValue(self, PyString_AS_STRING(raw), PyString_GET_SIZE(raw), flags,
+                              serializers);
+            Py_DECREF(raw);
+            if (val == NULL)
+            {
+                return -1;
+            }
+        }
+        if (val)
+        {
+            PyObject* keyobj = PyString_FromStringAndSize(key->key, key->len);
+            if (keyobj == NULL || PyDict_SetItem(dict, keyobj, val) < 0)
+            {
+                Py_XDECREF(keyobj);
+                Py_DECREF(val);
+                return -1;
+            }
+            Py_DECREF(keyobj);
+            Py_DECREF(val);
+            key->local = 1;
+            ++numLocal;
+        }
+    }
+    return numLocal;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_open_near_cache(PyObject* pyself, PyObject* args, PyObject* kwds)
+{
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    static char* kwlist[] = { "path", "size", "slot_size", "ttl", "mode", NULL };
+    const char* path = NULL;
+    Py_ssize_t size = 16 << 20;
+    int slotSize = 512;
+    double ttl = 1.0;
+    int mode = 0600;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|nidi", kwlist,
+                                     &path, &size, &slotSize, &ttl, &mode))
+        return NULL;
+    if (slotSize < (int)sizeof(NearEntry) + 16 || slotSize % 8 != 0 ||
+        size < (Py_ssize_t)sizeof(NearHeader) + slotSize)
+    {
+        PyErr_SetString(PyExc_ValueError, "bad near cache size or slot_size");
+        return NULL;
+    }
+    uint32_t numSlots = 1;
+    while ((Py_ssize_t)(numSlots * 2) * slotSize + (Py_ssize_t)sizeof(NearHeader) <= size &&
+           numSlots < 0x40000000)
+    {
+        numSlots *= 2;
+    }
+    
+    NearCache* near = calloc(1, sizeof(NearCache));
+    if (near == NULL)
+        return PyErr_NoMemory();
+    near->ttl = ttl;
+    
+    // Use the geometry of an existing file, else create it. The mapping starts out as
+    // zeros, which is all free slots.
+    const int fd = open(path, O_RDWR | O_CREAT, mode);
+    struct stat st;
+    NearHeader header;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        goto ioerror;
+    }
+    if (st.st_size >= (off_t)sizeof(header) &&
+        pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, NEAR_MAGIC, 8) == 0)
+    {
+        if (header.version != NEAR_VERSION || header.numSlots == 0 ||
+            (header.numSlots & (header.numSlots - 1)) != 0 ||
+            header.slotSize < sizeof(NearEntry) + 16 ||
+            st.st_size < (off_t)(sizeof(header) + (size_t)header.numSlots * header.slotSize))
+        {
+            close(fd);
+            free(near);
+            PyErr_Format(PyExc_ValueError, "%s is not a cmemcache near cache file", path);
+            return NULL;
+        }
+        numSlots = header.numSlots;
+        slotSize = header.slotSize;
+    }
+    else
+    {
+        memset(&header, 0, sizeof(header));
+        header.version = NEAR_VERSION;
+        header.numSlots = numSlots;
+        header.slotSize = slotSize;
+        if (ftruncate(fd, sizeof(header) + (size_t)numSlots * slotSize) < 0 ||
+            pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            pwrite(fd, NEAR_MAGIC, 8, 0) != 8)
+        {
+            goto ioerror;
+        }
+    }
+    near->numSlots = numSlots;
+    near->slotSize = slotSize;
+    near->mapSize = sizeof(header) + (size_t)numSlots * slotSize;
+    near->map = mmap(NULL, near->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (near->map == MAP_FAILED)
+    {
+        goto ioerror;
+    }
+    close(fd);
+    
+    freeNearCache(self->near);
+    self->near = near;
+    Py_INCREF(Py_None);
+    return Py_None;
+    
+ioerror:
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char*)path);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(near);
+    return NULL;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_close_near_cache(PyObject* pyself, PyObject* args)
+{
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    freeNearCache(self->near);
+    self->near = NULL;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/*** Native transport ***/
+
+/*
+  With native set, with unix domain socket servers, or with a deadline (libmemcache
+  only has its own timeouts per read), all commands go over the native connections
+  instead of libmemcache. The replies are parsed without the GIL into
+  plain buffers, python objects are only created after the I/O.
+*/
+
+#define useNative(self) ((self)->native || callDeadline ||                         \
+                         ((self)->routing && (self)->routing->numUnix))
+
+//----------------------------------------------------------------------------------------
+//
+static int
+startDeadline(CmemcacheObject* self, PyObject* timeout)
+{
+    // Set callDeadline for a call with the timeout argument, None (or NULL) for the
+    // client timeout. Reweights the servers first when that is due.
+    if (self->reweightInterval > 0 && profileTime() >= self->nextReweight)
+    {
+        callDeadline = profileTime() +
+            (self->timeout > 0 ? self->timeout : REWEIGHT_TIMEOUT);
+        if (reweightServers(self) < 0)
+            return -1;
+    }
+    double seconds = self->timeout;
+    if (timeout && timeout != Py_None)
+    {
+        seconds = PyFloat_AsDouble(timeout);
+        if (seconds == -1 && PyErr_Occurred())
+            return -1;
+    }
+    callDeadline = seconds > 0 ? profileTime() + seconds : 0;
+    if (timedOutClient == self)
+    {
+        timedOutClient = NULL;
+    }
+    return 0;
+}
+
+/* The reply line of a single command */
+typedef struct
+{
+    char line[128];
+    int done;
+} LineReply;
+
+/* Values of get replies are copied out of the connections as a ValueRecord, followed
+   by the key and the data. */
+typedef struct
+{
+    int keyLen;
+    unsigned int flags;
+    size_t size;
+} ValueRecord;
+
+//----------------------------------------------------------------------------------------
+//
+static int
+parseLineReply(CmemcacheObject* self, Conn* conn, void* arg)
+{
+    LineReply* reply = (LineReply*)arg;
+    const char* line;
+    size_t len;
+    while (conn->outstanding > 0 && connLine(conn, &line, &len))
+    {
+        --conn->outstanding;
+        const size_t n = len < sizeof(reply->line) - 1 ? len : sizeof(reply->line) - 1;
+        memcpy(reply->line, line, n);
+        reply->line[n] = 0;
+        reply->done = 1;
+        // errors are reported, the caller only sees that the reply is not the expected one
+        connReplyError(self, line, len);
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+nativeCommand(CmemcacheObject* self, int server, const char* cmd, int cmdLen,
+              const char* data, size_t size, LineReply* reply)
+{
+    // Called without the GIL. Send cmd, and the data block if any, to server and wait
+    // for the reply line.
+    reply->done = 0;
+    reply->line[0] = 0;
+    // a key routed before set_servers() swapped the servers can be out of range
+    if (server < 0 || server >= self->numConns)
+    {
+        return -1;
+    }
+    Conn* conn = &self->conns[server];
+    if (bufferReserve(&conn->wbuf, cmdLen + size + 2) < 0)
+    {
+        reportError(self, ENOMEM, "out of memory");
+        return -1;
+    }
+    char* p = conn->wbuf.data + conn->wbuf.size;
+    memcpy(p, cmd, cmdLen);
+    p += cmdLen;
+    if (data)
+    {
+        memcpy(p, data, size);
+        memcpy(p + size, "\r\n", 2);
+        p += size + 2;
+    }
+    conn->wbuf.size = p - conn->wbuf.data;
+    ++conn->outstanding;
+    resetConns(self);
+    pumpConns(self, 0, parseLineReply, reply);
+    return reply->done ? 0 : -1;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+bufferPutValue(Buffer* values, const Value* value)
+{
+    // Append a copy of value, see nextValue.
+    ValueRecord record;
+    record.keyLen = value->keyLen;
+    record.flags = value->flags;
+    record.size = value->size;
+    if (bufferReserve(values, sizeof(record) + value->keyLen + value->size) < 0)
+    {
+        return -1;
+    }
+    char* p = values->data + values->size;
+    memcpy(p, &record, sizeof(record));
+    memcpy(p + sizeof(record), value->key, value->keyLen);
+    memcpy(p + sizeof(record) + value->keyLen, value->data, value->size);
+    values->size += sizeof(record) + value->keyLen + value->size;
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+parseGetReplies(CmemcacheObject* self, Conn* conn, void* arg)
+{
+    Buffer* values = (Buffer*)arg;
+    Value value;
+    int retval = 0;
+    while (conn->outstanding > 0 && (retval = connValue(self, conn, &value)) > 0)
+    {
+        if (retval == 2)
+        {
+            --conn->outstanding;
+            continue;
+        }
+        if (bufferPutValue(values, &value) < 0)
+        {
+            reportError(self, ENOMEM, "out of memory");
+        }
+    }
+    return retval < 0 ? -1 : 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+nextValue(const Buffer* values, size_t* pos, Value* value)
+{
+    // Iterate over the values of nativeGet.
+    if (*pos >= values->size)
+    {
+        return 0;
+    }
+    ValueRecord record;
+    memcpy(&record, values->data + *pos, sizeof(record));
+    value->key = values->data + *pos + sizeof(record);
+    value->keyLen = record.keyLen;
+    value->flags = record.flags;
+    value->data = value->key + record.keyLen;
+    value->size = record.size;
+    *pos += sizeof(record) + record.keyLen + record.size;
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+nativeGet(CmemcacheObject* self, const KeyBatch* batch, Buffer* values)
+{
+    // Called without the GIL. Get the keys of batch (except the local ones) into values.
+    int* order = malloc((batch->size + 2 * self->numConns + 1) * sizeof(int));
+    if (order == NULL)
+    {
+        return -1;
+    }
+    resetConns(self);
+    const int retval = queueGets(self, batch, order, order + batch->size,
+                                 order + batch->size + self->numConns);
+    pumpConns(self, 0, parseGetReplies, values);
+    free(order);
+    return retval;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+parseStatsReplies(CmemcacheObject* self, Conn* conn, void* arg)
+{
+    // Collect the "STAT <name> <value>" lines, "\n" terminated, without the "STAT ".
+    Buffer* stats = (Buffer*)arg;
+    const char* line;
+    size_t len;
+    while (conn->outstanding > 0 && connLine(conn, &line, &len))
+    {
+        if (len > 5 && memcmp(line, "STAT ", 5) == 0)
+        {
+            if (bufferReserve(stats, len - 4) == 0)
+            {
+                memcpy(stats->data + stats->size, line + 5, len - 5);
+                stats->data[stats->size + len - 5] = '\n';
+                stats->size += len - 4;
+            }
+        }
+        else
+        {
+            --conn->outstanding;
+            if (!(len == 3 && memcmp(line, "END", 3) == 0) &&
+                connReplyError(self, line, len) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+nativeValue(CmemcacheObject* self, const Value* value, int decode, PyObject* serializers)
+{
+    // The python value of a get reply, tombstones are remembered and other values are put
+    // in the near cache.
+    if (value->flags & _FLAG_TOMBSTONE)
+    {
+        Key key;
+        key.key = value->key;
+        key.len = value->keyLen;
+        rememberTombstone(self, &key);
+        Py_INCREF(Tombstone);
+        return Tombstone;
+    }
+    nearStore(self, value->key, value->keyLen, value->data, value->size, value->flags);
+    if (decode)
+    {
+        return decodeValue(self, value->data, value->size, value->flags, serializers);
+    }
+    return internValue(self, value->data, value->size, 0);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+nativeGetMulti(CmemcacheObject* self, KeyBatch* batch, PyObject* dict, int decode,
+               PyObject* serializers)
+{
+    // get_multi() and get_multiflags() of the native transport, frees batch.
+    Buffer values = { NULL, 0, 0, 0 };
+    int nomem;
+    BEGIN_MC_CALL(self, NULL);
+    nomem = nativeGet(self, batch, &values) < 0;
+    END_MC_CALL;
+    if (checkErrors(self) < 0)
+    {
+        Py_CLEAR(dict);
+    }
+    else if (nomem)
+    {
+        Py_CLEAR(dict);
+        PyErr_NoMemory();
+    }
+    
+    size_t pos = 0;
+    Value value;
+    while (dict && nextValue(&values, &pos, &value))
+    {
+        PyObject* key = PyString_FromStringAndSize(value.key, value.keyLen);
+        PyObject* val = nativeValue(self, &value, decode, serializers);
+        if (key && val)
+        {
+            PyDict_SetItem(dict, key, val);
+        }
+        Py_XDECREF(key);
+        Py_XDECREF(val);
+    }
+    free(values.data);
+    freeKeys(batch);
+    return dict;
+}
+
+/*** Auto batching ***/
+
+/*
+  With auto_batch set, single gets of threads sharing the client are merged into multi
+  gets. The first caller becomes the leader of a batch: it waits up to batchWindow
+  microseconds (or until autoBatch gets are pending) for other callers, then for the
+  call in progress, and gets the keys of all pending callers at once. The others sleep
+  until the leader copied their values into their own buffers. Callers that arrive while
+  a batch is in flight join the next one, so the batches grow with the load. The window
+  is skipped when the last batch had a single get, so a lone thread only pays for it
+  once.
+*/
+
+struct PendingGet
+{
+    const Key* key;
+    Buffer* values;              /* the value of key, see nextValue */
+    double deadline;             /* callDeadline of the caller */
+    int nomem;
+    int timedOut;
+    int done;
+    PendingGet* next;
+};
+
+//----------------------------------------------------------------------------------------
+//
+static void
+runBatch(CmemcacheObject* self, PendingGet* batch, int size)
+{
+    // Called without the GIL and with ioLock. Get the keys of batch into their values.
+    KeyBatch keys;
+    keys.seq = NULL;
+    keys.size = 0;
+    keys.keys = size > KEYBATCH_INLINE ? malloc(size * sizeof(Key)) : keys.inlineKeys;
+    PendingGet* pending;
+    if (keys.keys == NULL)
+    {
+        for (pending = batch; pending; pending = pending->next)
+        {
+            pending->nomem = 1;
+        }
+        return;
+    }
+    for (pending = batch; pending; pending = pending->next)
+    {
+        keys.keys[keys.size++] = *pending->key;
+    }
+    
+    activeClient = self;
+    Value value;
+    if (useNative(self))
+    {
+        // the replies are in server order, match them to the first caller without one
+        Buffer values = { NULL, 0, 0, 0 };
+        const int nomem = nativeGet(self, &keys, &values) < 0;
+        size_t pos = 0;
+        while (nextValue(&values, &pos, &value))
+        {
+            for (pending = batch; pending; pending = pending->next)
+            {
+                if (pending->values->size == 0 && pending->key->len == value.keyLen &&
+                    memcmp(pending->key->key, value.key, value.keyLen) == 0)
+                {
+                    pending->nomem = bufferPutValue(pending->values, &value) < 0;
+                    break;
+                }
+            }
+        }
+        for (pending = batch; nomem && pending; pending = pending->next)
+        {
+            pending->nomem = 1;
+        }
+        free(values.data);
+    }
+    else
+    {
+        struct memcache_req* req = mcm_req_new(self->mc_ctxt);
+        struct memcache_res* res;
+        addKeys(self, req, &keys);
+        activeBatch = &keys;
+        mcm_get(self->mc_ctxt, self->mc, req);
+        pending = batch;
+        TAILQ_FOREACH(res, &req->query, entries)
+        {
+            if (mcm_res_found(self->mc_ctxt, res))
+            {
+                value.key = res->key;
+                value.keyLen = res->len;
+                value.flags = res->flags;
+                value.data = res->val;
+                value.size = res->size;
+                pending->nomem = bufferPutValue(pending->values, &value) < 0;
+            }
+            pending = pending->next;
+        }
+        mcm_req_free(self->mc_ctxt, req);
+        activeBatch = NULL;
+    }
+    activeClient = NULL;
+    if (keys.keys != keys.inlineKeys)
+    {
+        free(keys.keys);
+    }
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+batchedGet(CmemcacheObject* self, const Key* key, Buffer* values)
+{
+    // Called without the GIL. Get key into values as part of a batch, see above.
+    PendingGet pending;
+    pending.key = key;
+    pending.values = values;
+    pending.deadline = callDeadline;
+    pending.nomem = 0;
+    pending.timedOut = 0;
+    pending.done = 0;
+    
+    pthread_mutex_lock(&self->batchLock);
+    pending.next = self->pending;
+    self->pending = &pending;
+    ++self->numPending;
+    if (!self->batchLeader)
+    {
+        self->batchLeader = 1;
+        if (self->lastBatchSize > 1)
+        {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            const long usec = tv.tv_usec + self->batchWindow;
+            struct timespec deadline;
+            deadline.tv_sec = tv.tv_sec + usec / 1000000;
+            deadline.tv_nsec = (usec % 1000000) * 1000;
+            while (self->numPending < self->autoBatch &&
+                   pthread_cond_timedwait(&self->batchFull, &self->batchLock,
+                                          &deadline) != ETIMEDOUT)
+            {
+            }
+        }
+        pthread_mutex_unlock(&self->batchLock);
+        
+        // more callers join while the call in progress finishes
+        pthread_mutex_lock(&self->ioLock);
+        pthread_mutex_lock(&self->batchLock);
+        PendingGet* batch = self->pending;
+        const int size = self->numPending;
+        self->pending = NULL;
+        self->numPending = 0;
+        self->batchLeader = 0;
+        self->lastBatchSize = size;
+        ++self->numBatches;
+        self->numBatchedGets += size;
+        pthread_mutex_unlock(&self->batchLock);
+        
+        // the batch has the earliest deadline of its gets
+        const double deadline = callDeadline;
+        PendingGet* p;
+        for (p = batch; p; p = p->next)
+        {
+            if (p->deadline && (callDeadline == 0 || p->deadline < callDeadline))
+            {
+                callDeadline = p->deadline;
+            }
+        }
+        runBatch(self, batch, size);
+        const int timedOut = timedOutClient == self;
+        callDeadline = deadline;
+        pthread_mutex_unlock(&self->ioLock);
+        
+        pthread_mutex_lock(&self->batchLock);
+        for (; batch; batch = batch->next)
+        {
+            batch->timedOut = timedOut;
+            batch->done = 1;
+        }
+        pthread_cond_broadcast(&self->batchDone);
+    }
+    else if (self->numPending >= self->autoBatch)
+    {
+        pthread_cond_signal(&self->batchFull);
+    }
+    while (!pending.done)
+    {
+        pthread_cond_wait(&self->batchDone, &self->batchLock);
+    }
+    pthread_mutex_unlock(&self->batchLock);
+    if (pending.timedOut)
+    {
+        timedOutClient = self;
+    }
+    return pending.nomem ? -1 : 0;
+}
+
+enum StoreType
+{
+    SET,
+    ADD,
+    REPLACE
+};
+
+static PyObject*
+storeKey(CmemcacheObject* self, const Key* key, const char* value, int valuelen,
+         time_t expTime, int flags, enum StoreType storeType);
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_store(PyObject* pyself, PyObject* args, PyObject* kwds, enum StoreType storeType)
+{
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    
+    assert(self->mc);
+    
+    static char* kwlist[] = { "key", "val", "time", "flags", "timeout", NULL };
+    PyObject* keyobj = NULL;
+    Key key;
+    const char* value = NULL;
+    int valuelen = 0;
+    time_t expTime;
+    long int expParam = 0;
+    int flags = 0;
+    PyObject* timeout = NULL;
+    
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "Os#|liO", kwlist, &keyobj, &value,
+                                      &valuelen, &expParam, &flags, &timeout))
+        return NULL;
+    if (parseKey(self, keyobj, &key) < 0 || startDeadline(self, timeout) < 0)
+        return NULL;
+
+    expTime = expParamToExpTime(expParam);
+    
+    return storeKey(self, &key, value, valuelen, expTime, flags, storeType);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+storeKey(CmemcacheObject* self, const Key* key, const char* value, int valuelen,
+         time_t expTime, int flags, enum StoreType storeType)
+{
+    int retval = 0;
+    
+    forgetTombstone(self, key);
+    if (self->writeBehind && storeType == SET)
+    {
+        char cmd[MAX_KEY_LENGTH + 64];
+        const int cmdLen = snprintf(cmd, sizeof(cmd), "set %.*s %d %ld %d noreply\r\n",
+                                    key->len, key->key, flags, (long)expTime, valuelen);
+        retval = queueWrite(self, key, cmd, cmdLen, value, valuelen);
+        nearInvalidate(self, key->key, key->len);
+        return retval < 0 ? NULL : PyInt_FromLong(retval);
+    }
+    if (! drainWriteBehind(self))
+    {
+        return checkErrors(self) < 0 ? NULL : PyInt_FromLong(0);
+    }
+    BEGIN_MC_CALL(self, key);
+    debug(("cmemcache_store %d %s '%s' time %ld flags %d\n",
+           storeType, key->key, value, expTime, flags));
+    if (useNative(self))
+    {
+        static const char* commands[] = { "set", "add", "replace" };
+        char cmd[MAX_KEY_LENGTH + 64];
+        const int cmdLen = snprintf(cmd, sizeof(cmd), "%s %.*s %d %ld %d\r\n",
+                                    commands[storeType], key->len, key->key, flags,
+                                    (long)expTime, valuelen);
+        LineReply reply;
+        nativeCommand(self, key->server, cmd, cmdLen, value, valuelen, &reply);
+        retval = strcmp(reply.line, "STORED") == 0 ? 0 : -1;
+    }
+    else
+    {
+        switch(storeType)
+        {
+            case SET:
+                retval = mcm_set(self->mc_ctxt, self->mc,
+                                 (char*)key->key, key->len, value, valuelen, expTime, flags);
+                break;
+            case ADD:
+                retval = mcm_add(self->mc_ctxt, self->mc,
+                                 (char*)key->key, key->len, value, valuelen, expTime, flags);
+                break;
+            case REPLACE:
+                retval = mcm_replace(self->mc_ctxt, self->mc, (char*)key->key, key->len,
+                                     value, valuelen, expTime, flags);
+                break;
+        }
+    }
+    debug(("retval = %d\n", retval));
+    END_MC_CALL;
+    nearInvalidate(self, key->key, key->len);
+    if (checkErrors(self) < 0)
+        return NULL;
+
+    // retval == 0 means success, and retval < 0 are error values.
+    // Convert to memcache convention: Nonzero on success.
+    return PyInt_FromLong(retval == 0);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_set(PyObject* pyself, PyObject* args, PyObject* kwds)
+{
+    return cmemcache_store(pyself, args, kwds, SET);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_add(PyObject* pyself, PyObject* args, PyObject* kwds)
+{
+    return cmemcache_store(pyself, args, kwds, ADD);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_replace(PyObject* pyself, PyObject* args, PyObject* kwds)
+{
+    return cmemcache_store(pyself, args, kwds, REPLACE);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_set_tombstone(PyObject* pyself, PyObject* args, PyObject* kwds)
+{
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    
+    assert(self->mc);
+    
+    static char* kwlist[] = { "key", "time", "timeout", NULL };
+    PyObject* keyobj = NULL;
+    Key key;
+    long int expParam = 0;
+    PyObject* timeout = NULL;
+    
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|lO", kwlist,
+                                      &keyobj, &expParam, &timeout))
+        return NULL;
+    if (parseKey(self, keyobj, &key) < 0 || startDeadline(self, timeout) < 0)
+        return NULL;
+
+    PyObject* retval = storeKey(self, &key, "", 0, expParamToExpTime(expParam),
+                                _FLAG_TOMBSTONE, SET);
+    if (retval && PyInt_AsLong(retval))
+    {
+        rememberTombstone(self, &key);
+    }
+    return retval;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_get_imp(PyObject* pyself, PyObject* args, PyObject* kwds, int retFlags)
+{
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    
+    assert(self->mc);
+    
+    static char* kwlist[] = { "key", "timeout", "serializers", NULL };
+    PyObject* keyobj = NULL;
+    Key key;
+    PyObject* timeout = NULL;
+    PyObject* serializers = NULL;
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|OO!", kwlist, &keyobj, &timeout,
+                                      &PyDict_Type, &serializers) ||
+        parseKey(self, keyobj, &key) < 0 || startDeadline(self, timeout) < 0)
+    {
+        debug(("bad arguments\n"));
+        return NULL;
+    }
+    debug(("cmemcache_get_imp %s len %d\n", key.key, key.len));
+    // With serializers get decodes the value by its flags, like get_multiflags.
+    const int decode = serializers && ! retFlags;
+    
+    if (isLocalTombstone(self, &key, 0))
+    {
+        if (retFlags)
+            return Py_BuildValue("si", "", _FLAG_TOMBSTONE);
+        Py_INCREF(Tombstone);
+        return Tombstone;
+    }
+    unsigned int nearFlags;
+    PyObject* nearValue = nearLookup(self, key.key, key.len, &nearFlags);
+    if (nearValue)
+    {
+        if (retFlags)
+            return Py_BuildValue("Ni", nearValue, (int)nearFlags);
+        if (! decode)
+            return nearValue;
+        PyObject* val = decodeValue(self, PyString_AS_STRING(nearValue),
+                                    PyString_GET_SIZE(nearValue), nearFlags, serializers);
+        Py_DECREF(nearValue);
+        if (val == NULL && ! PyErr_Occurred())
+        {
+            Py_INCREF(Py_None);
+            val = Py_None;
+        }
+        return val;
+    }
+    
+    struct memcache_req *req = NULL;
+    struct memcache_res *res;
+    Buffer values = { NULL, 0, 0, 0 };
+    Value value = { NULL, 0, 0, NULL, 0 };
+    int found = 0;
+    int nomem = 0;
+    
+    if (self->autoBatch)
+    {
+        BEGIN_RELEASE_GIL(self);
+        nomem = batchedGet(self, &key, &values) < 0;
+        END_RELEASE_GIL;
+        size_t pos = 0;
+        found = nextValue(&values, &pos, &value);
+    }
+    else
+    {
+        BEGIN_MC_CALL(self, &key);
+        if (useNative(self))
+        {
+            KeyBatch batch;
+            batch.seq = NULL;
+            batch.size = 1;
+            batch.keys = batch.inlineKeys;
+            batch.inlineKeys[0] = key;
+            nomem = nativeGet(self, &batch, &values) < 0;
+            size_t pos = 0;
+            found = nextValue(&values, &pos, &value);
+        }
+        else
+        {
+            req = mcm_req_new(self->mc_ctxt);
+            res = mcm_req_add(self->mc_ctxt, req, (char*)key.key, key.len);
+            res->hash = key.hash;
+            mcm_res_free_on_delete(self->mc_ctxt, res, 1);
+            mcm_get(self->mc_ctxt, self->mc, req);
+            debug(("attempt %d found %d res %ld '%s'\n",
+                   mcm_res_attempted(self->mc_ctxt, res),
+                   mcm_res_found(self->mc_ctxt, res), res->size, (char*)res->val));
+            found = mcm_res_found(self->mc_ctxt, res);
+            value.data = res->val;
+            value.size = res->size;
+            value.flags = res->flags;
+        }
+        END_MC_CALL;
+    }
+    
+    PyObject* retval;
+    if (checkErrors(self) < 0)
+    {
+        retval = NULL;
+    }
+    else if (nomem)
+    {
+        retval = PyErr_NoMemory();
+    }
+    else if (found)
+    {
+        if (value.flags & _FLAG_TOMBSTONE)
+        {
+            rememberTombstone(self, &key);
+        }
+        else
+        {
+            nearStore(self, key.key, key.len, value.data, value.size, value.flags);
+        }
+        if (retFlags)
+        {
+            retval = Py_BuildValue("Ni", internValue(self, value.data, value.size, 0),
+                                   (int)value.flags);
+        }
+        else if (value.flags & _FLAG_TOMBSTONE)
+        {
+            Py_INCREF(Tombstone);
+            retval = Tombstone;
+        }
+        else if (decode)
+        {
+            retval = decodeValue(self, value.data, value.size, value.flags, serializers);
+            if (retval == NULL && ! PyErr_Occurred())
+            {
+                Py_INCREF(Py_None);
+                retval = Py_None;
+            }
+        }
+        else
+        {
+            retval = internValue(self, value.data, value.size, 0);
+        }
+    }
+    else
+    {
+        Py_INCREF(Py_None);
+        retval = Py_None;
+    }
+    if (req)
+    {
+        mcm_req_free(self->mc_ctxt, req);
+    }
+    free(values.data);
+    return retval;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_get(PyObject* pyself, PyObject* args, PyObject* kwds)
+{
+    return cmemcache_get_imp(pyself, args, kwds, 0);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_getflags(PyObject* pyself, PyObject* args, PyObject* kwds)
+{
+    return cmemcache_get_imp(pyself, args, kwds, 1);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_get_multi(PyObject* pyself, PyObject* args, PyObject* kwds)
+{
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    
+    debug(("cmemcache_get_multi\n"));
+
+    assert(self->mc);
+    
+    static char* kwlist[] = { "keys", "timeout", NULL };
+    PyObject* keys = NULL;
+    PyObject* timeout = NULL;
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &keys, &timeout) ||
+        startDeadline(self, timeout) < 0)
+        return NULL;
+    
+    KeyBatch batch;
+    if (parseKeys(self, keys, &batch) < 0)
+        return NULL;
+    
+    PyObject* dict = PyDict_New();
+    if (addLocalValues(self, &batch, dict, 0, NULL) < 0)
+    {
+        Py_CLEAR(dict);
+    }
+    if (useNative(self))
+    {
+        return nativeGetMulti(self, &batch, dict, 0, NULL);
+    }
+    
+    struct memcache_req *req;
+    struct memcache_res *res;
+    req = mcm_req_new(self->mc_ctxt);
+    addKeys(self, req, &batch);
+    BEGIN_MC_CALL(self, NULL);
+    activeBatch = &batch;
+    mcm_get(self->mc_ctxt, self->mc, req);
+    END_MC_CALL;
+    if (checkErrors(self) < 0)
+    {
+        Py_CLEAR(dict);
+    }
+    
+    // Put all the found results in the dictionary.
+    Py_ssize_t i = 0;
+    TAILQ_FOREACH(res, &req->query, entries)
+    {
+        while (batch.keys[i].local)
+        {
+            ++i;
+        }
+        if (dict && mcm_res_found(self->mc_ctxt, res))
+        {
+            debug(("res found, add %s\n", res->key));
+            PyObject* key = PyString_FromStringAndSize(res->key, res->len);
+            PyObject* val;
+            if (res->flags & _FLAG_TOMBSTONE)
+            {
+                rememberTombstone(self, &batch.keys[i]);
+                Py_INCREF(Tombstone);
+                val = Tombstone;
+            }
+            else
+            {
+                nearStore(self, res->key, res->len, res->val, res->size, res->flags);
+                val = internValue(self, res->val, res->size, 0);
+            }
+            PyDict_SetItem(dict, key, val);
+            Py_DECREF(key);
+            Py_DECREF(val);
+        }
+        ++i;
+    }
+    mcm_req_free(self->mc_ctxt, req);
+    freeKeys(&batch);
+
+    return dict;
+}
+
+/*** Native value encoding ***/
+
+/*
+  Compact binary encoding of the json-like types (None, bool, int, long, float, str,
+  unicode, list, tuple, dict), stored with _FLAG_NATIVE. Much cheaper than pickle for
+  those types because encoding and decoding never call back into python. Every value is
+  a one byte tag followed by its payload, all integers are little endian. The first byte
+  of an encoded value is the format version.
+*/
+#define NATIVE_VERSION   1
+#define NATIVE_MAX_DEPTH 64
+
+#define NATIVE_NONE    'N'
+#define NATIVE_TRUE    'T'
+#define NATIVE_FALSE   'F'
+#define NATIVE_INT8    'b'
+#define NATIVE_INT32   'i'
+#define NATIVE_INT64   'q'
+#define NATIVE_LONG    'l' /* u32 byte count, two's complement bytes */
+#define NATIVE_FLOAT   'd' /* ieee 754 double */
+#define NATIVE_STRING  's' /* u32 length, bytes */
+#define NATIVE_UNICODE 'u' /* u32 length, utf-8 bytes */
+#define NATIVE_LIST    'L' /* u32 count, values */
+#define NATIVE_TUPLE   't' /* u32 count, values */
+#define NATIVE_DICT    'D' /* u32 count, key value pairs */
+
+/* Encoding is done with the GIL held, so one buffer is enough. It only grows. */
+static Buffer encodeBuffer = { NULL, 0, 0, 0 };
+
+//----------------------------------------------------------------------------------------
+//
+static int
+bufferPutTag(Buffer* buf, char tag, uint64_t value, int nbytes)
+{
+    if (bufferReserve(buf, 1 + nbytes) < 0)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    unsigned char* p = (unsigned char*)buf->data + buf->size;
+    int i;
+    *p++ = tag;
+    for (i = 0; i < nbytes; ++i)
+    {
+        *p++ = (unsigned char)(value >> (8 * i));
+    }
+    buf->size += 1 + nbytes;
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+bufferPutBytes(Buffer* buf, char tag, const char* data, size_t len)
+{
+    if (len > 0xFFFFFFFFUL)
+    {
+        PyErr_SetString(PyExc_TypeError, "value too large to encode");
+        return -1;
+    }
+    if (bufferPutTag(buf, tag, len, 4) < 0)
+    {
+        return -1;
+    }
+    if (bufferReserve(buf, len) < 0)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+encodeObject(Buffer* buf, PyObject* obj, int depth)
+{
+    if (depth > NATIVE_MAX_DEPTH)
+    {
+        PyErr_SetString(PyExc_TypeError, "value nested too deep to encode");
+        return -1;
+    }
+    
+    // Only exact types, subclasses may carry state or behaviour we would lose.
+    if (obj == Py_None)
+    {
+        return bufferPutTag(buf, NATIVE_NONE, 0, 0);
+    }
+    else if (PyBool_Check(obj))
+    {
+        return bufferPutTag(buf, obj == Py_True ? NATIVE_TRUE : NATIVE_FALSE, 0, 0);
+    }
+    else if (PyInt_CheckExact(obj))
+    {
+        long val = PyInt_AS_LONG(obj);
+        if (val >= -128 && val <= 127)
+        {
+            return bufferPutTag(buf, NATIVE_INT8, (uint64_t)val, 1);
+        }
+        if (val >= -2147483647L - 1 && val <= 2147483647L)
+        {
+            return bufferPutTag(buf, NATIVE_INT32, (uint64_t)val, 4);
+        }
+        return bufferPutTag(buf, NATIVE_INT64, (uint64_t)val, 8);
+    }
+    else if (PyLong_CheckExact(obj))
+    {
+        size_t nbytes = _PyLong_NumBits(obj) / 8 + 1;
+        if (nbytes == (size_t)-1 / 8 + 1 || nbytes > 0xFFFFFFFFUL)
+        {
+            PyErr_SetString(PyExc_TypeError, "long too large to encode");
+            return -1;
+        }
+        if (bufferPutTag(buf, NATIVE_LONG, nbytes, 4) < 0)
+        {
+            return -1;
+        }
+        if (bufferReserve(buf, nbytes) < 0)
+        {
+            PyErr_NoMemory();
+            return -1;
+        }
+        if (_PyLong_AsByteArray((PyLongObject*)obj,
+                                (unsigned char*)buf->data + buf->size, nbytes, 1, 1) < 0)
+        {
+            return -1;
+        }
+        buf->size += nbytes;
+        return 0;
+    }
+    else if (PyFloat_CheckExact(obj))
+    {
+        if (bufferReserve(buf, 9) < 0)
+        {
+            PyErr_NoMemory();
+            return -1;
+        }
+        buf->data[buf->size] = NATIVE_FLOAT;
+        if (_PyFloat_Pack8(PyFloat_AS_DOUBLE(obj),
+                           (unsigned char*)buf->data + buf->size + 1, 1) < 0)
+        {
+            return -1;
+        }
+        buf->size += 9;
+        return 0;
+    }
+    else if (PyString_CheckExact(obj))
+    {
+        return bufferPutBytes(buf, NATIVE_STRING,
+                              PyString_AS_STRING(obj), PyString_GET_SIZE(obj));
+    }
+    else if (PyUnicode_CheckExact(obj))
+    {
+        PyObject* utf8 = PyUnicode_AsUTF8String(obj);
+        if (utf8 == NULL)
+        {
+            return -1;
+        }
+        int retval = bufferPutBytes(buf, NATIVE_UNICODE,
+                                    PyString_AS_STRING(utf8), PyString_GET_SIZE(utf8));
+        Py_DECREF(utf8);
+        return retval;
+    }
+    else if (PyList_CheckExact(obj) || PyTuple_CheckExact(obj))
+    {
+        const int isList = PyList_CheckExact(obj);
+        const Py_ssize_t size = isList ? PyList_GET_SIZE(obj) : PyTuple_GET_SIZE(obj);
+        Py_ssize_t i;
+        if (bufferPutTag(buf, isList ? NATIVE_LIST : NATIVE_TUPLE, size, 4) < 0)
+        {
+            return -1;
+        }
+        for (i = 0; i < size; ++i)
+        {
+            PyObject* item = isList ? PyList_GET_ITEM(obj, i) : PyTuple_GET_ITEM(obj, i);
+            if (encodeObject(buf, item, depth + 1) < 0)
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    else if (PyDict_CheckExact(obj))
+    {
+        Py_ssize_t pos = 0;
+        PyObject* key;
+        PyObject* val;
+        if (bufferPutTag(buf, NATIVE_DICT, PyDict_Size(obj), 4) < 0)
+        {
+            return -1;
+        }
+        while (PyDict_Next(obj, &pos, &key, &val))
+        {
+            if (encodeObject(buf, key, depth + 1) < 0 ||
+                encodeObject(buf, val, depth + 1) < 0)
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    
+    PyErr_Format(PyExc_TypeError, "can not encode %.100s", obj->ob_type->tp_name);
+    return -1;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static uint64_t
+readUnsigned(const unsigned char* p, int nbytes)
+{
+    uint64_t val = 0;
+    int i;
+    for (i = 0; i < nbytes; ++i)
+    {
+        val |= (uint64_t)p[i] << (8 * i);
+    }
+    return val;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+decodeObject(const unsigned char** pp, const unsigned char* end, int depth)
+{
+    const unsigned char* p = *pp;
+    PyObject* retval = NULL;
+    
+#define NEED(n)                                                         \
+    if ((size_t)(end - p) < (size_t)(n))                                \
+    {                                                                   \
+        PyErr_SetString(PyExc_ValueError, "truncated native value");    \
+        return NULL;                                                    \
+    }
+
+    if (depth > NATIVE_MAX_DEPTH)
+    {
+        PyErr_SetString(PyExc_ValueError, "native value nested too deep");
+        return NULL;
+    }
+    NEED(1);
+    const char tag = *p++;
+    switch (tag)
+    {
+        case NATIVE_NONE:
+            Py_INCREF(Py_None);
+            retval = Py_None;
+            break;
+        case NATIVE_TRUE:
+            Py_INCREF(Py_True);
+            retval = Py_True;
+            break;
+        case NATIVE_FALSE:
+            Py_INCREF(Py_False);
+            retval = Py_False;
+            break;
+        case NATIVE_INT8:
+            NEED(1);
+            retval = PyInt_FromLong((signed char)p[0]);
+            p += 1;
+            break;
+        case NATIVE_INT32:
+            NEED(4);
+            retval = PyInt_FromLong((int32_t)readUnsigned(p, 4));
+            p += 4;
+            break;
+        case NATIVE_INT64:
+            NEED(8);
+            retval = PyInt_FromLong((long)(int64_t)readUnsigned(p, 8));
+            p += 8;
+            break;
+        case NATIVE_LONG:
+        {
+            NEED(4);
+            const size_t nbytes = readUnsigned(p, 4);
+            p += 4;
+            NEED(nbytes);
+            retval = _PyLong_FromByteArray(p, nbytes, 1, 1);
+            p += nbytes;
+            break;
+        }
+        case NATIVE_FLOAT:
+        {
+            NEED(8);
+            const double val = _PyFloat_Unpack8(p, 1);
+            if (val == -1.0 && PyErr_Occurred())
+            {
+                return NULL;
+            }
+            retval = PyFloat_FromDouble(val);
+            p += 8;
+            break;
+        }
+        case NATIVE_STRING:
+        case NATIVE_UNICODE:
+        {
+            NEED(4);
+            const size_t len = readUnsigned(p, 4);
+            p += 4;
+            NEED(len);
+            if (tag == NATIVE_STRING)
+            {
+                retval = PyString_FromStringAndSize((const char*)p, len);
+            }
+            else
+            {
+                retval = PyUnicode_DecodeUTF8((const char*)p, len, "strict");
+            }
+            p += len;
+            break;
+        }
+        case NATIVE_LIST:
+        case NATIVE_TUPLE:
+        {
+            NEED(4);
+            const size_t size = readUnsigned(p, 4);
+            p += 4;
+            // every item takes at least one byte, avoids huge bogus allocations
+            NEED(size);
+            retval = tag == NATIVE_LIST ? PyList_New(size) : PyTuple_New(size);
+            size_t i;
+            for (i = 0; retval && i < size; ++i)
+            {
+                PyObject* item = decodeObject(&p, end, depth + 1);
+                if (item == NULL)
+                {
+                    Py_CLEAR(retval);
+                }
+                else if (tag == NATIVE_LIST)
+                {
+                    PyList_SET_ITEM(retval, i, item); // steals item reference
+                }
+                else
+                {
+                    PyTuple_SET_ITEM(retval, i, item); // steals item reference
+                }
+            }
+            break;
+        }
+        case NATIVE_DICT:
+        {
+            NEED(4);
+            const size_t size = readUnsigned(p, 4);
+            p += 4;
+            NEED(size * 2);
+            retval = PyDict_New();
+            size_t i;
+            for (i = 0; retval && i < size; ++i)
+            {
+                PyObject* key = decodeObject(&p, end, depth + 1);
+                PyObject* val = key ? decodeObject(&p, end, depth + 1) : NULL;
+                if (val == NULL || PyDict_SetItem(retval, key, val) < 0)
+                {
+                    Py_CLEAR(retval);
+                }
+                Py_XDECREF(key);
+                Py_XDECREF(val);
+            }
+            break;
+        }
+        default:
+            PyErr_Format(PyExc_ValueError, "unknown native tag 0x%02x", tag & 0xFF);
+            return NULL;
+    }
+#undef NEED
+    
+    *pp = p;
+    return retval;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+decodeNative(const char* data, size_t size)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + size;
+    
+    if (size < 1 || *p != NATIVE_VERSION)
+    {
+        PyErr_SetString(PyExc_ValueError, "unknown native value format");
+        return NULL;
+    }
+    ++p;
+    PyObject* retval = decodeObject(&p, end, 0);
+    if (retval && p != end)
+    {
+        Py_DECREF(retval);
+        PyErr_SetString(PyExc_ValueError, "trailing bytes after native value");
+        return NULL;
+    }
+    return retval;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_encode(PyObject* module, PyObject* obj)
+{
+    encodeBuffer.size = 0;
+    if (bufferPutTag(&encodeBuffer, NATIVE_VERSION, 0, 0) < 0 ||
+        encodeObject(&encodeBuffer, obj, 0) < 0)
+    {
+        return NULL;
+    }
+    return PyString_FromStringAndSize(encodeBuffer.data, encodeBuffer.size);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_decode(PyObject* module, PyObject* args)
+{
+    const char* data = NULL;
+    int size = 0;
+    
+    if (! PyArg_ParseTuple(args, "s#", &data, &size))
+        return NULL;
+
+    return decodeNative(data, size);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+decodeInteger(const char* data, size_t size, int isLong)
+{
+    // int(data) or long(data) of a value stored by Client, parsed in place: values are
+    // not null terminated. PyInt_FromLong shares the small ints.
+    const char* p = data;
+    const char* end = data + size;
+    while (p < end && Py_ISSPACE(*p))
+        ++p;
+    while (end > p && Py_ISSPACE(end[-1]))
+        --end;
+    const int negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+'))
+        ++p;
+    const char* digits = p;
+    unsigned long value = 0;
+    for (; p < end && Py_ISDIGIT(*p) && value <= (ULONG_MAX - 9) / 10; ++p)
+    {
+        value = value * 10 + (*p - '0');
+    }
+    if (p == end && p > digits && value <= LONG_MAX)
+    {
+        const long result = negative ? -(long)value : (long)value;
+        return isLong ? PyLong_FromLong(result) : PyInt_FromLong(result);
+    }
+    
+    // Too big for a long, or not a number: let python parse (or reject) a copy.
+    char* copy = PyMem_Malloc(size + 1);
+    if (copy == NULL)
+    {
+        return PyErr_NoMemory();
+    }
+    memcpy(copy, data, size);
+    copy[size] = '\0';
+    PyObject* val = isLong ? PyLong_FromString(copy, NULL, 10) :
+        PyInt_FromString(copy, NULL, 10);
+    PyMem_Free(copy);
+    return val;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+decodeValue(CmemcacheObject* self, const char* data, size_t size, int flags,
+            PyObject* serializers)
+{
+    PyObject* val = NULL;
+    
+    if (flags == 0) {
+        // Return the string.
+        val = internValue(self, data, size, 0);
+    }
+    else if (flags & _FLAG_TOMBSTONE) {
+        Py_INCREF(Tombstone);
+        val = Tombstone;
+    }
+    else if (flags & _FLAG_NATIVE) {
+        val = decodeNative(data, size);
+    }
+    else if (flags & _FLAG_INTEGER) {
+        val = internValue(self, data, size, _FLAG_INTEGER);
+    }
+    else if (flags & _FLAG_LONG) {
+        val = internValue(self, data, size, _FLAG_LONG);
+    }
+    else if (flags & _FLAG_PICKLE) {
+        // Create the string, put it in a tuple to pass as parameters to
+        // unpickle
+        val = PyString_FromStringAndSize(data, size);
+        PyObject *tuple = PyTuple_New(1);
+        PyTuple_SetItem(tuple, 0, val); // steals val reference
+        val = PyObject_CallObject(loads, tuple);
+        Py_DECREF(tuple);
+    }
+    else if (serializers && PyDict_Size(serializers) > 0) {
+        // Registered serializer, see Client.register_serializer().
+        PyObject* flagsobj = PyInt_FromLong(flags);
+        PyObject* serializerLoads = flagsobj ? PyDict_GetItem(serializers, flagsobj) : NULL;
+        Py_XDECREF(flagsobj);
+        if (serializerLoads) {
+            val = PyObject_CallFunction(serializerLoads, "s#", data, (int)size);
+        }
+    }
+
+    // Values that can not be decoded are skipped, get() returns None for them.
+    if (val == NULL) {
+        PyErr_Clear();
+    }
+    return val;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_get_multiflags(PyObject* pyself, PyObject* args, PyObject* kwds)
+{
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    
+    debug(("cmemcache_get_multiflags\n"));
+
+    assert(self->mc);
+    
+    static char* kwlist[] = { "keys", "serializers", "timeout", NULL };
+    PyObject* keys = NULL;
+    PyObject* serializers = NULL;
+    PyObject* timeout = NULL;
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|O!O", kwlist, &keys, &PyDict_Type,
+                                      &serializers, &timeout) ||
+        startDeadline(self, timeout) < 0)
+        return NULL;
+    
+    KeyBatch batch;
+    if (parseKeys(self, keys, &batch) < 0)
+        return NULL;
+    
+    PyObject* dict = PyDict_New();
+    if (addLocalValues(self, &batch, dict, 1, serializers) < 0)
+    {
+        Py_CLEAR(dict);
+    }
+    if (useNative(self))
+    {
+        return nativeGetMulti(self, &batch, dict, 1, serializers);
+    }
+    
+    struct memcache_req *req;
+    struct memcache_res *res;
+    req = mcm_req_new(self->mc_ctxt);
+    addKeys(self, req, &batch);
+    BEGIN_MC_CALL(self, NULL);
+    activeBatch = &batch;
+    mcm_get(self->mc_ctxt, self->mc, req);
+    END_MC_CALL;
+    if (checkErrors(self) < 0)
+    {
+        Py_CLEAR(dict);
+    }
+
+    // Put all the found results in the dictionary.
+    Py_ssize_t i = 0;
+    TAILQ_FOREACH(res, &req->query, entries)
+    {
+        while (batch.keys[i].local)
+        {
+            ++i;
+        }
+        if (dict && mcm_res_found(self->mc_ctxt, res))
+        {
+            debug(("res found, add %s %s f %d\n",
+                   res->key, (char*)res->val, res->flags));
+            if (res->flags & _FLAG_TOMBSTONE)
+            {
+                rememberTombstone(self, &batch.keys[i]);
+            }
+            else
+            {
+                nearStore(self, res->key, res->len, res->val, res->size, res->flags);
+            }
+            PyObject* key = PyString_FromStringAndSize(res->key, res->len);
+            PyObject* val = decodeValue(self, res->val, res->size, (int)res->flags,
+                                        serializers);
+            if (val) {
+                PyDict_SetItem(dict, key, val);
+                Py_DECREF(val);
+            }
+            Py_DECREF(key);
+        }
+        ++i;
+    }
+    mcm_req_free(self->mc_ctxt, req);
+    freeKeys(&batch);
+
+    return dict;
+}
+
+/*** Value interning ***/
+
+/*
+  With intern_values set, the str, int and long values of up to INTERN_MAX_SIZE bytes
+  are looked up in a direct mapped table of that many slots before they are created, so
+  the gets of the same bytes share one (immutable) object: a cache full of small counters,
+  flags and enum strings costs the memory of the distinct values only. The hits and the
+  bytes of the objects they did not allocate are in get_client_stats(). The table is only
+  used with the GIL held.
+*/
+
+//----------------------------------------------------------------------------------------
+//
+static void
+freeInterned(CmemcacheObject* self)
+{
+    int i;
+    for (i = 0; self->interned && i < self->numInterned; ++i)
+    {
+        Py_XDECREF(self->interned[i].value);
+    }
+    PyMem_Free(self->interned);
+    self->interned = NULL;
+    self->numInterned = 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+newValue(const char* data, size_t size, int kind)
+{
+    if (kind == 0)
+    {
+        return PyString_FromStringAndSize(data, size);
+    }
+    return decodeInteger(data, size, kind == _FLAG_LONG);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+internValue(CmemcacheObject* self, const char* data, size_t size, int kind)
+{
+    // data as a new reference to a str (kind 0), int (_FLAG_INTEGER) or long
+    // (_FLAG_LONG), the one of the previous get of the same bytes if it is still interned.
+    if (self->internValues <= 0)
+    {
+        if (self->interned)
+        {
+            freeInterned(self);
+        }
+        return newValue(data, size, kind);
+    }
+    if (size > INTERN_MAX_SIZE)
+    {
+        return newValue(data, size, kind);
+    }
+    int slots = 1;
+    while (slots < self->internValues && slots < (1 << 20))
+    {
+        slots <<= 1;
+    }
+    if (slots != self->numInterned)
+    {
+        freeInterned(self);
+        self->interned = PyMem_New(InternSlot, slots);
+        if (self->interned == NULL)
+        {
+            return PyErr_NoMemory();
+        }
+        memset(self->interned, 0, slots * sizeof(InternSlot));
+        self->numInterned = slots;
+    }
+
+    InternSlot* slot = &self->interned[(nearHash(data, (int)size) ^ kind) & (slots - 1)];
+    PyObject* value = slot->value;
+    if (value && slot->kind == kind && slot->size == (int)size &&
+        memcmp(slot->data, data, size) == 0)
+    {
+        const PyTypeObject* type = Py_TYPE(value);
+        ++self->numInternHits;
+        self->internSaved += type->tp_basicsize +
+            (type->tp_itemsize ? labs((long)Py_SIZE(value)) * type->tp_itemsize : 0);
+        Py_INCREF(value);
+        return value;
+    }
+    value = newValue(data, size, kind);
+    if (value)
+    {
+        Py_XDECREF(slot->value);
+        Py_INCREF(value);
+        slot->value = value;
+        slot->kind = kind;
+        slot->size = (int)size;
+        memcpy(slot->data, data, size);
+    }
+    return value;
+}
+
+/*** Streaming multi get ***/
+
+/*
+  iter_get_multi() gets the keys batch_size at a time, on connections of its own so the
+  client can be used while iterating. Every batch is sent before the values of the one
+  before it are yielded: the servers work on the next batch while python consumes the
+  current one, and no more than two batches of keys and values are held at a time.
+*/
+
+typedef struct
+{
+    PyObject_HEAD
+    CmemcacheObject* client;
+    PyObject* keys;              /* iterator of the keys, NULL once exhausted */
+    int batchSize;
+    int decode;                  /* with serializers, like get_multiflags() */
+    PyObject* serializers;
+    PyObject* timeout;           /* of each batch, see startDeadline */
+    unsigned int routingVersion; /* of the client when conns were made */
+    Conn* conns;                 /* swapped with the client's during a batch */
+    int numConns;
+    int inFlight;                /* a batch was sent and its replies not read */
+    PyObject* local;             /* tombstones and near cache values of the batch */
+    Py_ssize_t localPos;
+    Buffer values;               /* of the batch read last, see nextValue */
+    size_t pos;
+} GetMultiIterator;
+
+static PyTypeObject GetMultiIteratorType;
+
+//----------------------------------------------------------------------------------------
+//
+static int
+getMultiNextBatch(GetMultiIterator* it)
+{
+    // Read the values of the batch in flight, and send the next batch.
+    CmemcacheObject* self = it->client;
+    if (it->routingVersion != self->routingVersion)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "set_servers() during iter_get_multi()");
+        return -1;
+    }
+    if (startDeadline(self, it->timeout) < 0)
+        return -1;
+    
+    KeyBatch batch;
+    batch.keys = batch.inlineKeys;
+    batch.size = 0;
+    batch.seq = NULL;
+    Py_CLEAR(it->local);
+    it->localPos = 0;
+    if (it->keys)
+    {
+        PyObject* list = PyList_New(0);
+        PyObject* item = NULL;
+        while (list && PyList_GET_SIZE(list) < it->batchSize &&
+               (item = PyIter_Next(it->keys)))
+        {
+            if (PyList_Append(list, item) < 0)
+            {
+                Py_CLEAR(list);
+            }
+            Py_DECREF(item);
+        }
+        if (list == NULL || PyErr_Occurred())
+        {
+            Py_XDECREF(list);
+            return -1;
+        }
+        if (item == NULL)
+        {
+            Py_CLEAR(it->keys);
+        }
+        // batch.seq keeps the list
+        const int error = parseKeys(self, list, &batch) < 0;
+        Py_DECREF(list);
+        if (error)
+            return -1;
+        it->local = PyDict_New();
+        if (it->local == NULL ||
+            addLocalValues(self, &batch, it->local, it->decode, it->serializers) < 0)
+        {
+            freeKeys(&batch);
+            return -1;
+        }
+    }
+    int* order = NULL;
+    if (batch.size > 0)
+    {
+        order = malloc((batch.size + 2 * self->numConns + 1) * sizeof(int));
+        if (order == NULL)
+        {
+            freeKeys(&batch);
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    
+    it->values.start = it->values.size = 0;
+    it->pos = 0;
+    int nomem = 0;
+    int swapped = 0;
+    int i;
+    BEGIN_MC_CALL(self, NULL);
+    // set_servers() in another thread can have swapped the servers while waiting
+    swapped = it->routingVersion != self->routingVersion;
+    if (!swapped)
+    {
+        Conn* const clientConns = self->conns;
+        self->conns = it->conns;
+        if (it->inFlight)
+        {
+            pumpConns(self, 0, parseGetReplies, &it->values);
+        }
+        resetConns(self);
+        if (order)
+        {
+            nomem = queueGets(self, &batch, order, order + batch.size,
+                              order + batch.size + self->numConns) < 0;
+            // only send it, the replies are read for the next batch
+            pumpConns(self, INT_MAX, parseGetReplies, &it->values);
+        }
+        it->inFlight = 0;
+        for (i = 0; i < self->numConns; ++i)
+        {
+            it->inFlight |= self->conns[i].outstanding > 0;
+        }
+        self->conns = clientConns;
+    }
+    END_MC_CALL;
+    
+    free(order);
+    freeKeys(&batch);
+    if (swapped)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "set_servers() during iter_get_multi()");
+        return -1;
+    }
+    if (nomem)
+    {
+        collectErrors(self, 0);
+        PyErr_NoMemory();
+        return -1;
+    }
+    return checkErrors(self);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+getMultiIterator_next(GetMultiIterator* it)
+{
+    for (;;)
+    {
+        PyObject* key;
+        PyObject* val;
+        if (it->local && PyDict_Next(it->local, &it->localPos, &key, &val))
+        {
+            return PyTuple_Pack(2, key, val);
+        }
+        Value value;
+        while (nextValue(&it->values, &it->pos, &value))
+        {
+            val = nativeValue(it->client, &value, it->decode, it->serializers);
+            if (val)
+            {
+                return Py_BuildValue("(s#N)", value.key, value.keyLen, val);
+            }
+            if (PyErr_Occurred())
+                return NULL;
+        }
+        if (it->keys == NULL && !it->inFlight)
+        {
+            // StopIteration
+            return NULL;
+        }
+        if (getMultiNextBatch(it) < 0)
+            return NULL;
+    }
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+getMultiIterator_dealloc(GetMultiIterator* it)
+{
+    // Closing the connections drops a batch in flight.
+    freeConns(it->conns, it->numConns);
+    free(it->values.data);
+    Py_XDECREF(it->client);
+    Py_XDECREF(it->keys);
+    Py_XDECREF(it->serializers);
+    Py_XDECREF(it->timeout);
+    Py_XDECREF(it->local);
+    PyObject_Del(it);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_iter_get_multi(PyObject* pyself, PyObject* args, PyObject* kwds)
+{
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    
+    debug(("cmemcache_iter_get_multi\n"));
+
+    static char* kwlist[] = { "keys", "batch_size", "serializers", "timeout", NULL };
+    PyObject* keys = NULL;
+    int batchSize = 1000;
+    PyObject* serializers = NULL;
+    PyObject* timeout = NULL;
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|iO!O", kwlist, &keys, &batchSize,
+                                      &PyDict_Type, &serializers, &timeout))
+        return NULL;
+    
+    PyObject* iter = PyObject_GetIter(keys);
+    if (iter == NULL)
+        return NULL;
+    GetMultiIterator* it = PyObject_New(GetMultiIterator, &GetMultiIteratorType);
+    if (it == NULL)
+    {
+        Py_DECREF(iter);
+        return NULL;
+    }
+    Py_INCREF(self);
+    it->client = self;
+    it->keys = iter;
+    it->batchSize = batchSize < 1 ? 1 : batchSize;
+    it->decode = serializers != NULL;
+    Py_XINCREF(serializers);
+    it->serializers = serializers;
+    Py_XINCREF(timeout);
+    it->timeout = timeout;
+    it->routingVersion = self->routingVersion;
+    it->numConns = self->numConns;
+    it->conns = calloc(self->numConns > 0 ? self->numConns : 1, sizeof(Conn));
+    it->inFlight = 0;
+    it->local = NULL;
+    it->localPos = 0;
+    memset(&it->values, 0, sizeof(it->values));
+    it->pos = 0;
+    if (it->conns == NULL)
+    {
+        Py_DECREF(it);
+        return PyErr_NoMemory();
+    }
+    int i;
+    for (i = 0; i < it->numConns; ++i)
+    {
+        it->conns[i].fd = -1;
+    }
+    return (PyObject*)it;
+}
+
+static PyTypeObject GetMultiIteratorType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "GetMultiIterator",        /*tp_name*/
+    sizeof(GetMultiIterator),  /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)getMultiIterator_dealloc,  /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Iterator of iter_get_multi()", /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    0,		               /* tp_weaklistoffset */
+    PyObject_SelfIter,         /* tp_iter */
+    (iternextfunc)getMultiIterator_next, /* tp_iternext */
+};
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_delete(PyObject* pyself, PyObject* args, PyObject* kwds)
+{
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    
+    debug(("cmemcache_delete\n"));
+
+    assert(self->mc);
+    
+    static char* kwlist[] = { "key", "time", "timeout", NULL };
+    PyObject* keyobj = NULL;
+    Key key;
+    time_t expTime;
+    long int expParam = 0;
+    PyObject* timeout = NULL;
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|lO", kwlist,
+                                      &keyobj, &expParam, &timeout))
+        return NULL;
+    if (parseKey(self, keyobj, &key) < 0 || startDeadline(self, timeout) < 0)
+        return NULL;
+
+    expTime = expParamToExpTime(expParam);
+
+    int retval;
+    
+    forgetTombstone(self, &key);
+    if (self->writeBehind)
+    {
+        // like a delete that was done, or one that failed when it is dropped
+        char cmd[MAX_KEY_LENGTH + 48];
+        const int cmdLen = expTime ?
+            snprintf(cmd, sizeof(cmd), "delete %.*s %ld noreply\r\n",
+                     key.len, key.key, (long)expTime) :
+            snprintf(cmd, sizeof(cmd), "delete %.*s noreply\r\n", key.len, key.key);
+        retval = queueWrite(self, &key, cmd, cmdLen, NULL, 0);
+        nearInvalidate(self, key.key, key.len);
+        return retval < 0 ? NULL : PyInt_FromLong(retval ? 0 : -1);
+    }
+    BEGIN_MC_CALL(self, &key);
+    debug(("cmemcache_delete %s expTime %ld\n", key.key, expTime));
+    if (useNative(self))
+    {
+        // like libmemcache: 0 when deleted, 1 when not found
+        char cmd[MAX_KEY_LENGTH + 32];
+        const int cmdLen = expTime ?
+            snprintf(cmd, sizeof(cmd), "delete %.*s %ld\r\n",
+                     key.len, key.key, (long)expTime) :
+            snprintf(cmd, sizeof(cmd), "delete %.*s\r\n", key.len, key.key);
+        LineReply reply;
+        nativeCommand(self, key.server, cmd, cmdLen, NULL, 0, &reply);
+        retval = strcmp(reply.line, "DELETED") == 0 ? 0 :
+            strcmp(reply.line, "NOT_FOUND") == 0 ? 1 : -1;
+    }
+    else
+    {
+        retval = mcm_delete(self->mc_ctxt, self->mc, (char*)key.key, key.len, expTime);
+    }
+    debug(("retval = %d\n", retval));
+    END_MC_CALL;
+    nearInvalidate(self, key.key, key.len);
+    if (checkErrors(self) < 0)
+        return NULL;
+    
+    return PyInt_FromLong(retval);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_incr_decr(PyObject* pyself, PyObject* args, PyObject* kwds, int incr)
+{
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    
+    debug(("cmemcache_incr_decr\n"));
+
+    assert(self->mc);
+    
+    static char* kwlist[] = { "key", "delta", "timeout", NULL };
+    PyObject* keyobj = NULL;
+    Key key;
+    int delta = 1;
+    PyObject* timeout = NULL;
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|iO", kwlist,
+                                      &keyobj, &delta, &timeout))
+        return NULL;
+    if (parseKey(self, keyobj, &key) < 0 || startDeadline(self, timeout) < 0)
+        return NULL;
+
+    int newval;
+    int notFound = 0;
+    
+    forgetTombstone(self, &key);
+    if (! drainWriteBehind(self))
+    {
+        if (checkErrors(self) < 0)
+            return NULL;
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    BEGIN_MC_CALL(self, &key);
+    debug(("cmemcache_incr_decr %s %s delta %d\n",
+           incr ? "incr" : "decr", key.key, delta));
+    if (useNative(self))
+    {
+        char cmd[MAX_KEY_LENGTH + 32];
+        const int cmdLen = snprintf(cmd, sizeof(cmd), "%s %.*s %u\r\n",
+                                    incr ? "incr" : "decr", key.len, key.key, delta);
+        LineReply reply;
+        nativeCommand(self, key.server, cmd, cmdLen, NULL, 0, &reply);
+        const char* p = reply.line;
+        unsigned long long value = 0;
+        notFound = parseDecimal(&p, p + strlen(p), &value) < 0;
+        newval = value;
+    }
+    else if ( incr )
+    {
+        newval = mcm_incr(self->mc_ctxt, self->mc, (char*)key.key, key.len, delta);
+    }
+    else
+    {
+        newval = mcm_decr(self->mc_ctxt, self->mc, (char*)key.key, key.len, delta);
+    }
+    if (!useNative(self))
+    {
+        notFound = self->mc_ctxt->errnum;
+    }
+    debug(("newval %d errnum %d\n", newval, self->mc_ctxt->errnum));
+    END_MC_CALL;
+    nearInvalidate(self, key.key, key.len);
+    if (checkErrors(self) < 0)
+        return NULL;
+
+    if ( notFound )
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    return PyInt_FromLong(newval);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_incr(PyObject* pyself, PyObject* args, PyObject* kwds)
+{
+    return cmemcache_incr_decr( pyself, args, kwds, 1 );
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_decr(PyObject* pyself, PyObject* args, PyObject* kwds)
+{
+    return cmemcache_incr_decr( pyself, args, kwds, 0 );
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+nativeStats(CmemcacheObject* self)
+{
+    // get_stats() of the native transport, with all the stats the servers report.
+    PyObject* retval = PyList_New(0);
+    const unsigned int routingVersion = self->routingVersion;
+    int server;
+    for (server = 0; retval && server < self->numConns; ++server)
+    {
+        Buffer stats = { NULL, 0, 0, 0 };
+        BEGIN_MC_CALL(self, NULL);
+        // the servers can be swapped by set_servers() in another thread meanwhile
+        Conn* conn = self->routingVersion == routingVersion ? &self->conns[server] : NULL;
+        if (conn && bufferReserve(&conn->wbuf, 7) == 0)
+        {
+            memcpy(conn->wbuf.data + conn->wbuf.size, "stats\r\n", 7);
+            conn->wbuf.size += 7;
+            ++conn->outstanding;
+            resetConns(self);
+            pumpConns(self, 0, parseStatsReplies, &stats);
+        }
+        END_MC_CALL;
+        /* errors of the servers that fail are in last_errors() */
+        collectErrors(self, 0);
+        
+        if (stats.size > 0 && self->routingVersion == routingVersion)
+        {
+            PyObject* dict = PyDict_New();
+            const char* line = stats.data;
+            const char* end = stats.data + stats.size;
+            while (dict && line < end)
+            {
+                const char* eol = memchr(line, '\n', end - line);
+                const char* space = memchr(line, ' ', eol - line);
+                const char* valueStart = space ? space + 1 : eol;
+                PyObject* name = PyString_FromStringAndSize(line, (space ? space : eol) - line);
+                PyObject* value = PyString_FromStringAndSize(valueStart, eol - valueStart);
+                if (name == NULL || value == NULL || PyDict_SetItem(dict, name, value) < 0)
+                {
+                    Py_CLEAR(dict);
+                }
+                Py_XDECREF(name);
+                Py_XDECREF(value);
+                line = eol + 1;
+            }
+            PyObject* item = dict ? Py_BuildValue("(sO)",
+                                                  self->routing->servers[server].name,
+                                                  dict) : NULL;
+            if (item == NULL || PyList_Append(retval, item) < 0)
+            {
+                Py_CLEAR(retval);
+            }
+            Py_XDECREF(item);
+            Py_XDECREF(dict);
+        }
+        free(stats.data);
+    }
+    return retval;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_get_stats(PyObject* pyself, PyObject* args, PyObject* kwds)
+{
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    
+    debug(("cmemcache_get_stats\n"));
+
+    assert(self->mc);
+    static char* kwlist[] = { "timeout", NULL };
+    PyObject* timeout = NULL;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &timeout) ||
+        startDeadline(self, timeout) < 0)
+        return NULL;
+    if (useNative(self))
+    {
+        return nativeStats(self);
+    }
+    PyObject* retval = PyList_New(0);
+
+    /* loop copied from mcm_server_disconnect_all, but is there some supported way of
+       going through all the servers? The servers can be freed by set_servers() in
+       another thread while the GIL is released, stop when that happened. */
+    const unsigned int routingVersion = self->routingVersion;
+    struct memcache_server *ms = self->mc->server_list.tqh_first;
+    while (ms != NULL)
+    {
+        struct memcache_server_stats* stats = NULL;
+        struct memcache_server* next = NULL;
+        char buffer[128+1];
+        
+        BEGIN_MC_CALL(self, NULL);
+        if (self->routingVersion == routingVersion)
+        {
+            snprintf(buffer, 128, "%s:%s", ms->hostname, ms->port);
+            stats = mcm_server_stats(self->mc_ctxt, self->mc, ms);
+            next = ms->entries.tqe_next;
+        }
+        END_MC_CALL;
+        ms = next;
+        /* errors of the servers that fail are in last_errors() */
+        collectErrors(self, 0);
+        
+        if (stats != NULL)
+        {
+            PyObject* name = PyString_FromString(buffer);
+            PyObject* dict = PyDict_New();
+
+            PyObject* valobj;
+            
+#define SET_SNPRINTF(d, key, fmt, val)           \
+            snprintf(buffer, 128, fmt, val);     \
+            valobj = PyString_FromString(buffer); \
+            PyDict_SetItemString(d, key, valobj); \
+            Py_DECREF(valobj);                    \
+            valobj = NULL
+            
+#define SET_TIME(d, key, val) SET_SNPRINTF(d, key, "%ld", val)
+#define SET_ITEMU32(d, key, val) SET_SNPRINTF(d, key, "%u", val)
+#define SET_ITEMU64(d, key, val) SET_SNPRINTF(d, key, "%llu", val)
+#define SET_TIMEVAL(d, key, val)                                \
+            SET_SNPRINTF(d, key, "%lf", val.tv_sec + val.tv_usec * 1.0e-9)
+                
+            SET_ITEMU32(dict, "pid", stats->pid);
+            SET_TIME(dict, "uptime", stats->uptime);
+            SET_TIME(dict, "time", stats->time);
+            PyDict_SetItem(dict, PyString_FromString("version"),
+                           PyString_FromString(stats->version));
+            SET_TIMEVAL(dict, "rusage_user", stats->rusage_user);
+            SET_TIMEVAL(dict, "rusage_system", stats->rusage_system);
+            SET_ITEMU32(dict, "curr_items", stats->curr_items);
+            SET_ITEMU64(dict, "total_items", stats->total_items);
+            SET_ITEMU64(dict, "bytes", stats->bytes);
+            SET_ITEMU32(dict, "curr_connections", stats->curr_connections);
+            SET_ITEMU64(dict, "total_connections", stats->total_connections);
+            SET_ITEMU32(dict, "connection_structures", stats->connection_structures);
+            SET_ITEMU64(dict, "cmd_get", stats->cmd_get);
+#ifdef SEAN_HACKS
+            SET_ITEMU64(dict, "cmd_refresh", stats->cmd_refresh);
+#endif
+            SET_ITEMU64(dict, "cmd_set", stats->cmd_set);
+            SET_ITEMU64(dict, "get_hits", stats->get_hits);
+            SET_ITEMU64(dict, "get_misses", stats->get_misses);
+#ifdef SEAN_HACKS
+            SET_ITEMU64(dict, "refresh_hits", stats->refresh_hits);
+            SET_ITEMU64(dict, "refresh_misses", stats->refresh_misses);
+#endif
+            SET_ITEMU64(dict, "bytes_read", stats->bytes_read);
+            SET_ITEMU64(dict, "bytes_written", stats->bytes_written);
+            SET_ITEMU64(dict, "limit_maxbytes", stats->limit_maxbytes);
+
+            PyObject* tuple = PyTuple_New(2);
+            PyTuple_SetItem(tuple, 0, name);
+            PyTuple_SetItem(tuple, 1, dict);
+            PyList_Append(retval, tuple);
+            
+            mcm_server_stats_free(self->mc_ctxt, stats);
+        }
+    }
+    
+    return retval;
+}
+
+/*** Write behind ***/
+
+/*
+  With open_write_behind() sets and deletes do not wait for the servers: the command is
+  formatted with noreply into a QueuedWrite and put in a bounded ring, and a thread of
+  the client takes what is there, appends it per server to its own connections and sends
+  it. The ring is written with the GIL held, so there is one producer at a time and one
+  consumer, and head and tail are only moved after the slot is done. The lock and
+  conditions are only used to wake the thread when it sleeps, and by callers waiting for
+  room (block set) or for the ring to drain (flush_write_behind()). While callers wait,
+  the thread follows its batches with a "version" on each connection and waits for the
+  replies, so what they waited for is done by the servers and not just sent. Commands
+  that are not queued (add, replace, incr, decr, flush_all, load and restore) first wait
+  for that too, else they could overtake the queued sets and deletes of their keys.
+*/
+
+/* Seconds before a server that failed is connected to again by the thread */
+#define WRITE_BEHIND_RETRY 1.0
+
+/* Seconds the thread sleeps when it is not woken */
+#define WRITE_BEHIND_IDLE_MS 100
+
+/* A command of the ring, "set ... noreply\r\n<value>\r\n" or "delete ... noreply\r\n" */
+typedef struct
+{
+    int server;                  /* index in WriteBehind.names */
+    size_t size;
+    char data[1];
+} QueuedWrite;
+
+struct WriteBehind
+{
+    CmemcacheObject* client;     /* for the errors and socket options, outlives us */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;         /* the ring is no longer empty, or stop */
+    pthread_cond_t drained;      /* the thread moved tail, sent or confirmed slots */
+    int numServers;
+    char** names;                /* copies of the routing server names */
+    Conn* conns;
+    double* retryTime;           /* profileTime() before which a failed server is skipped */
+    int* versions;               /* "version" replies each conn waits for */
+    QueuedWrite** ring;
+    unsigned int size;           /* slots of ring, a power of 2 */
+    int block;                   /* wait for room instead of dropping */
+    volatile unsigned int head;  /* next slot to fill, moved with the GIL */
+    volatile unsigned int tail;  /* next slot the thread takes */
+    volatile unsigned int sent;  /* the slots before this are sent (or lost) */
+    volatile unsigned int done;  /* and these were followed by a version reply */
+    volatile int sleeping;       /* the thread waits for wake */
+    volatile int waiting;        /* callers wait for drained */
+    volatile int stop;
+};
+
+//----------------------------------------------------------------------------------------
+//
+static void
+writeBehindLost(WriteBehind* wb, Conn* conn)
+{
+    // The commands of conn that were not sent are lost, and the server is retried later.
+    // An idle connection the server closed is reconnected right away.
+    if (conn->outstanding > 0)
+    {
+        __sync_fetch_and_add(&wb->client->numWritesFailed, conn->outstanding);
+        wb->retryTime[conn - wb->conns] = profileTime() + WRITE_BEHIND_RETRY;
+    }
+    wb->versions[conn - wb->conns] = 0;
+    connClose(conn);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+writeBehindRead(WriteBehind* wb, Conn* conn)
+{
+    // noreply commands only get a reply on errors, report those. A connection the server
+    // closed is closed here too, before anything more is written to it.
+    int* versions = &wb->versions[conn - wb->conns];
+    const char* line;
+    size_t len;
+    if (connRead(conn) < 0)
+    {
+        reportError(wb->client, errno, "recv() failed");
+        writeBehindLost(wb, conn);
+        return;
+    }
+    while (connLine(conn, &line, &len))
+    {
+        if (len >= 8 && memcmp(line, "VERSION ", 8) == 0 && *versions > 0)
+        {
+            --*versions;
+        }
+        else
+        {
+            connReplyError(wb->client, line, len);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+writeBehindSend(WriteBehind* wb)
+{
+    // Send the wbuf of all conns, connecting them first when needed, and read the replies
+    // to the versions.
+    if (wb->numServers == 0)
+    {
+        return;
+    }
+    struct pollfd pollfds[wb->numServers];
+    int pollConns[wb->numServers];
+    const double t = profileTime();
+    int i;
+    for (i = 0; i < wb->numServers; ++i)
+    {
+        Conn* conn = &wb->conns[i];
+        if (conn->wbuf.size > conn->wbuf.start && conn->fd < 0)
+        {
+            // connOpen() reports why it failed, and forgets the queued commands
+            const int queued = conn->outstanding;
+            if (t < wb->retryTime[i] || connOpen(wb->client, conn, wb->names[i]) < 0)
+            {
+                conn->outstanding = queued;
+                writeBehindLost(wb, conn);
+            }
+        }
+    }
+    for (;;)
+    {
+        int numPoll = 0;
+        for (i = 0; i < wb->numServers; ++i)
+        {
+            Conn* conn = &wb->conns[i];
+            const int unsent = conn->wbuf.size > conn->wbuf.start;
+            if (conn->fd >= 0 && (unsent || wb->versions[i] > 0))
+            {
+                pollfds[numPoll].fd = conn->fd;
+                pollfds[numPoll].events = unsent ? POLLIN | POLLOUT : POLLIN;
+                pollfds[numPoll].revents = 0;
+                pollConns[numPoll++] = i;
+            }
+        }
+        if (numPoll == 0)
+        {
+            return;
+        }
+        const int ready = poll(pollfds, numPoll, NATIVE_IO_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        for (i = 0; i < numPoll; ++i)
+        {
+            Conn* conn = &wb->conns[pollConns[i]];
+            if (ready <= 0)
+            {
+                reportError(wb->client, ready == 0 ? ETIMEDOUT : errno, "poll() failed");
+                writeBehindLost(wb, conn);
+                continue;
+            }
+            if (pollfds[i].revents & (POLLIN | POLLERR | POLLHUP))
+            {
+                writeBehindRead(wb, conn);
+            }
+            if (conn->fd >= 0 && (pollfds[i].revents & POLLOUT))
+            {
+                if (connWrite(conn) < 0)
+                {
+                    reportError(wb->client, errno, "send() failed");
+                    writeBehindLost(wb, conn);
+                }
+                else if (conn->wbuf.size == 0)
+                {
+                    conn->outstanding = 0;
+                }
+            }
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void*
+writeBehindThread(void* arg)
+{
+    WriteBehind* wb = (WriteBehind*)arg;
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    
+    for (;;)
+    {
+        unsigned int tail = wb->tail;
+        const unsigned int head = wb->head;
+        __sync_synchronize();
+        int i;
+        if (tail == head)
+        {
+            if (wb->stop)
+            {
+                break;
+            }
+            if (wb->waiting && wb->done != wb->sent)
+            {
+                // a caller waits for slots that were sent before it came
+                const unsigned int sent = wb->sent;
+                for (i = 0; i < wb->numServers; ++i)
+                {
+                    Conn* conn = &wb->conns[i];
+                    if (conn->fd >= 0 && bufferReserve(&conn->wbuf, 9) == 0)
+                    {
+                        memcpy(conn->wbuf.data + conn->wbuf.size, "version\r\n", 9);
+                        conn->wbuf.size += 9;
+                        ++wb->versions[i];
+                    }
+                }
+                writeBehindSend(wb);
+                __sync_synchronize();
+                wb->done = sent;
+                pthread_mutex_lock(&wb->lock);
+                pthread_cond_broadcast(&wb->drained);
+                pthread_mutex_unlock(&wb->lock);
+                continue;
+            }
+            pthread_mutex_lock(&wb->lock);
+            wb->sleeping = 1;
+            __sync_synchronize();
+            if (wb->head == wb->tail && ! wb->stop)
+            {
+                struct timespec until;
+                clock_gettime(CLOCK_REALTIME, &until);
+                until.tv_nsec += WRITE_BEHIND_IDLE_MS * 1000000L;
+                until.tv_sec += until.tv_nsec / 1000000000L;
+                until.tv_nsec %= 1000000000L;
+                pthread_cond_timedwait(&wb->wake, &wb->lock, &until);
+            }
+            wb->sleeping = 0;
+            pthread_mutex_unlock(&wb->lock);
+            continue;
+        }
+        
+        // Servers that closed an idle connection are noticed before it is written to.
+        for (i = 0; i < wb->numServers; ++i)
+        {
+            Conn* conn = &wb->conns[i];
+            struct pollfd pollfd;
+            pollfd.fd = conn->fd;
+            pollfd.events = POLLIN;
+            pollfd.revents = 0;
+            if (conn->fd >= 0 && poll(&pollfd, 1, 0) > 0)
+            {
+                writeBehindRead(wb, conn);
+            }
+        }
+        for (; tail != head; ++tail)
+        {
+            QueuedWrite* write = wb->ring[tail & (wb->size - 1)];
+            Conn* conn = &wb->conns[write->server];
+            if (bufferReserve(&conn->wbuf, write->size) < 0)
+            {
+                __sync_fetch_and_add(&wb->client->numWritesFailed, 1);
+            }
+            else
+            {
+                memcpy(conn->wbuf.data + conn->wbuf.size, write->data, write->size);
+                conn->wbuf.size += write->size;
+                ++conn->outstanding;
+            }
+            free(write);
+        }
+        __sync_synchronize();
+        wb->tail = tail;
+        const int confirm = wb->waiting;
+        if (confirm)
+        {
+            // also on the connections with earlier slots that were not confirmed
+            for (i = 0; i < wb->numServers; ++i)
+            {
+                Conn* conn = &wb->conns[i];
+                if ((conn->fd >= 0 || conn->wbuf.size > conn->wbuf.start) &&
+                    bufferReserve(&conn->wbuf, 9) == 0)
+                {
+                    memcpy(conn->wbuf.data + conn->wbuf.size, "version\r\n", 9);
+                    conn->wbuf.size += 9;
+                    ++wb->versions[i];
+                }
+            }
+        }
+        writeBehindSend(wb);
+        __sync_synchronize();
+        wb->sent = tail;
+        if (confirm)
+        {
+            wb->done = tail;
+        }
+        __sync_synchronize();
+        if (wb->waiting)
+        {
+            pthread_mutex_lock(&wb->lock);
+            pthread_cond_broadcast(&wb->drained);
+            pthread_mutex_unlock(&wb->lock);
+        }
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+freeWriteBehind(WriteBehind* wb)
+{
+    int i;
+    for (i = 0; wb->names && i < wb->numServers; ++i)
+    {
+        free(wb->names[i]);
     }
-    if (self->mc_ctxt)
+    free(wb->names);
+    freeConns(wb->conns, wb->numServers);
+    free(wb->retryTime);
+    free(wb->versions);
+    for (i = 0; wb->ring && wb->tail + i != wb->head; ++i)
     {
-        mcMemFreeCtxt(self->mc_ctxt);
-        self->mc_ctxt = 0;
+        free(wb->ring[(wb->tail + i) & (wb->size - 1)]);
+    }
+    free(wb->ring);
+    pthread_mutex_destroy(&wb->lock);
+    pthread_cond_destroy(&wb->wake);
+    pthread_cond_destroy(&wb->drained);
+    free(wb);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+enterWriteBehind(WriteBehind* wb)
+{
+    // Called with the GIL before it is released for waitWriteBehind, so that
+    // closeWriteBehind (which needs the GIL to start) waits for us before freeing wb.
+    pthread_mutex_lock(&wb->lock);
+    ++wb->waiting;
+    pthread_mutex_unlock(&wb->lock);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+waitWriteBehind(WriteBehind* wb, unsigned int target, int confirmed, double deadline)
+{
+    // Called without the GIL after enterWriteBehind, wait until the slots before target
+    // are sent, and with confirmed done by the servers, or until deadline (a
+    // profileTime(), 0 is none). Returns 1 if they are. wb can be freed as soon as this
+    // returns.
+    int done;
+    pthread_mutex_lock(&wb->lock);
+    __sync_synchronize();
+    while (! (done = (int)((confirmed ? wb->done : wb->sent) - target) >= 0) &&
+           ! wb->stop &&
+           (deadline == 0 || profileTime() < deadline))
+    {
+        if (wb->sleeping)
+        {
+            pthread_cond_signal(&wb->wake);
+        }
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 10 * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&wb->drained, &wb->lock, &until);
+    }
+    --wb->waiting;
+    pthread_mutex_unlock(&wb->lock);
+    return done;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+queueWrite(CmemcacheObject* self, const Key* key, const char* cmd, int cmdLen,
+           const char* value, int valuelen)
+{
+    // Put cmd (and value with its "\r\n") in the write behind ring. Returns 1 if it is
+    // queued, 0 if it was dropped, -1 with an exception.
+    WriteBehind* wb = self->writeBehind;
+    if (key->server < 0 || key->server >= wb->numServers)
+    {
+        ++self->numWritesDropped;
+        return 0;
+    }
+    const size_t size = cmdLen + (value ? valuelen + 2 : 0);
+    QueuedWrite* write = (QueuedWrite*)malloc(offsetof(QueuedWrite, data) + size);
+    if (write == NULL)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    write->server = key->server;
+    write->size = size;
+    memcpy(write->data, cmd, cmdLen);
+    if (value)
+    {
+        memcpy(write->data + cmdLen, value, valuelen);
+        memcpy(write->data + cmdLen + valuelen, "\r\n", 2);
+    }
+    
+    while (wb->head - wb->tail >= wb->size)
+    {
+        if (! wb->block || (callDeadline && profileTime() >= callDeadline))
+        {
+            free(write);
+            ++self->numWritesDropped;
+            return 0;
+        }
+        // Room is made by the thread, wait for it to send the oldest slot.
+        const unsigned int target = wb->head - wb->size + 1;
+        enterWriteBehind(wb);
+        BEGIN_RELEASE_GIL(self);
+        waitWriteBehind(wb, target, 0, callDeadline);
+        END_RELEASE_GIL;
+        if (self->writeBehind != wb)
+        {
+            // closed meanwhile, wb may be gone
+            free(write);
+            ++self->numWritesDropped;
+            return 0;
+        }
+    }
+    wb->ring[wb->head & (wb->size - 1)] = write;
+    __sync_synchronize();
+    ++wb->head;
+    __sync_synchronize();
+    ++self->numWritesQueued;
+    if (wb->head - wb->tail > self->maxWriteDepth)
+    {
+        self->maxWriteDepth = wb->head - wb->tail;
+    }
+    if (wb->sleeping)
+    {
+        pthread_mutex_lock(&wb->lock);
+        pthread_cond_signal(&wb->wake);
+        pthread_mutex_unlock(&wb->lock);
+    }
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+drainWriteBehind(CmemcacheObject* self)
+{
+    // Called with the GIL before a command that is not queued, wait until the servers
+    // did what is queued. Returns 0 if callDeadline passed first, the call then times
+    // out without sending anything.
+    WriteBehind* wb = self->writeBehind;
+    if (wb == NULL || wb->done == wb->head)
+    {
+        return 1;
+    }
+    const unsigned int target = wb->head;
+    const double deadline = callDeadline;
+    int done;
+    enterWriteBehind(wb);
+    BEGIN_RELEASE_GIL(self);
+    done = waitWriteBehind(wb, target, 1, deadline);
+    END_RELEASE_GIL;
+    if (! done && self->writeBehind == wb)
+    {
+        timedOutClient = self;
+        __sync_fetch_and_add(&self->numTimeouts, 1);
+        pushError(self, MCM_ERR_LVL_WARN, 'y', ETIMEDOUT, __FUNCTION__, __LINE__,
+                  "deadline exceeded waiting for the write behind queue");
+        return 0;
+    }
+    return 1;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static void
+closeWriteBehind(CmemcacheObject* self)
+{
+    // Send what is queued and stop the thread. Sets and deletes from now on wait for the
+    // servers again.
+    WriteBehind* wb = self->writeBehind;
+    if (wb == NULL)
+    {
+        return;
+    }
+    self->writeBehind = NULL;
+    Py_BEGIN_ALLOW_THREADS;
+    pthread_mutex_lock(&wb->lock);
+    wb->stop = 1;
+    pthread_cond_signal(&wb->wake);
+    pthread_cond_broadcast(&wb->drained);
+    pthread_mutex_unlock(&wb->lock);
+    pthread_join(wb->thread, NULL);
+    // callers waiting see stop, let them leave the lock first: waiting is only read
+    // under the lock, a waiter that decremented it may still be unlocking
+    pthread_mutex_lock(&wb->lock);
+    while (wb->waiting)
+    {
+        pthread_cond_broadcast(&wb->drained);
+        pthread_mutex_unlock(&wb->lock);
+        usleep(1000);
+        pthread_mutex_lock(&wb->lock);
     }
+    pthread_mutex_unlock(&wb->lock);
     Py_END_ALLOW_THREADS;
-    self->ob_type->tp_free((PyObject*)self);
+    freeWriteBehind(wb);
 }
 
-enum StoreType
+//----------------------------------------------------------------------------------------
+//
+static int
+openWriteBehind(CmemcacheObject* self, int size, int block)
 {
-    SET,
-    ADD,
-    REPLACE
-};
+    // Start the write behind thread for the current servers, with a ring of at least size
+    // slots. Returns -1 with an exception.
+    closeWriteBehind(self);
+    WriteBehind* wb = (WriteBehind*)calloc(1, sizeof(WriteBehind));
+    if (wb == NULL)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_cond_init(&wb->wake, NULL);
+    pthread_cond_init(&wb->drained, NULL);
+    wb->client = self;
+    wb->block = block;
+    wb->size = 2;
+    while ((int)wb->size < size && wb->size < (1u << 24))
+    {
+        wb->size <<= 1;
+    }
+    const Routing* routing = self->routing;
+    wb->numServers = routing ? routing->numServers : 0;
+    wb->ring = (QueuedWrite**)calloc(wb->size, sizeof(QueuedWrite*));
+    wb->names = (char**)calloc(wb->numServers + 1, sizeof(char*));
+    wb->conns = (Conn*)calloc(wb->numServers + 1, sizeof(Conn));
+    wb->retryTime = (double*)calloc(wb->numServers + 1, sizeof(double));
+    wb->versions = (int*)calloc(wb->numServers + 1, sizeof(int));
+    int i;
+    int nomem = ! wb->ring || ! wb->names || ! wb->conns || ! wb->retryTime ||
+        ! wb->versions;
+    for (i = 0; ! nomem && i < wb->numServers; ++i)
+    {
+        wb->conns[i].fd = -1;
+        nomem = (wb->names[i] = strdup(routing->servers[i].name)) == NULL;
+    }
+    if (nomem)
+    {
+        freeWriteBehind(wb);
+        PyErr_NoMemory();
+        return -1;
+    }
+    const int errnum = pthread_create(&wb->thread, NULL, writeBehindThread, wb);
+    if (errnum != 0)
+    {
+        freeWriteBehind(wb);
+        errno = errnum;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    self->writeBehind = wb;
+    return 0;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+restartWriteBehind(CmemcacheObject* self)
+{
+    // After set_servers(), what is queued is sent to the old servers first.
+    const int size = self->writeBehind->size;
+    const int block = self->writeBehind->block;
+    return openWriteBehind(self, size, block);
+}
 
 //----------------------------------------------------------------------------------------
 //
 static PyObject*
-cmemcache_store(PyObject* pyself, PyObject* args, enum StoreType storeType)
+cmemcache_open_write_behind(PyObject* pyself, PyObject* args, PyObject* kwds)
 {
     CmemcacheObject* self = (CmemcacheObject*)pyself;
     
-    assert(self->mc);
-    
-    char* key = NULL;
-    int keylen = 0;
-    const char* value = NULL;
-    int valuelen = 0;
-    time_t expTime;
-    long int expParam = 0;
-    int flags = 0;
+    static char* kwlist[] = { "size", "block", NULL };
+    int size = 4096;
+    int block = 0;
     
-    if (! PyArg_ParseTuple(args, "s#s#|li",
-                           &key, &keylen, &value, &valuelen, &expParam, &flags))
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|ii", kwlist, &size, &block))
+        return NULL;
+    if (size <= 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "size must be positive");
+        return NULL;
+    }
+    if (openWriteBehind(self, size, block) < 0)
         return NULL;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
 
-    expTime = expParamToExpTime(expParam);
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_flush_write_behind(PyObject* pyself, PyObject* args, PyObject* kwds)
+{
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
     
-    int retval = 0;
+    static char* kwlist[] = { "timeout", NULL };
+    PyObject* timeout = NULL;
     
-    Py_BEGIN_ALLOW_THREADS;
-    debug(("cmemcache_store %d %s '%s' time %ld flags %d\n",
-           storeType, key, value, expTime, flags));
-    switch(storeType)
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &timeout) ||
+        startDeadline(self, timeout) < 0)
+        return NULL;
+    WriteBehind* wb = self->writeBehind;
+    int done = 1;
+    if (wb)
     {
-        case SET:
-            retval = mcm_set(self->mc_ctxt,
-                             self->mc, key, keylen, value, valuelen, expTime, flags);
-            break;
-        case ADD:
-            retval = mcm_add(self->mc_ctxt,
-                             self->mc, key, keylen, value, valuelen, expTime, flags);
-            break;
-        case REPLACE:
-            retval = mcm_replace(self->mc_ctxt,
-                                 self->mc, key, keylen, value, valuelen, expTime, flags);
+        const unsigned int target = wb->head;
+        const double deadline = callDeadline;
+        enterWriteBehind(wb);
+        BEGIN_RELEASE_GIL(self);
+        done = waitWriteBehind(wb, target, 1, deadline);
+        END_RELEASE_GIL;
+    }
+    if (checkErrors(self) < 0)
+        return NULL;
+    return PyInt_FromLong(done);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_close_write_behind(PyObject* pyself, PyObject* args)
+{
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    
+    closeWriteBehind(self);
+    if (checkErrors(self) < 0)
+        return NULL;
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/*** Adaptive weights ***/
+
+/*
+  reweight() sets the weight of each server from its stats: proportional to its
+  limit_maxbytes, and lowered for servers that evicted more per byte than the others
+  since the previous reweight (down to half), raised for those that evicted less (up to
+  twice). With reweight_interval set, calls do that when it is due. The new routing is
+  swapped in between calls, keys routed before keep their server. Servers set with
+  weight 0, and those that don't answer, keep their weight.
+*/
+
+/* The stats replies of a reweight, on connections of its own */
+typedef struct
+{
+    Conn* conns;
+    Buffer* values;              /* one per conn */
+} ServerStats;
+
+//----------------------------------------------------------------------------------------
+//
+static int
+parseServerStats(CmemcacheObject* self, Conn* conn, void* arg)
+{
+    // parseStatsReplies into the buffer of the server of conn
+    ServerStats* stats = (ServerStats*)arg;
+    return parseStatsReplies(self, conn, &stats->values[conn - stats->conns]);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+statValue(const Buffer* stats, const char* name, unsigned long long* value)
+{
+    // The value of a stat collected by parseStatsReplies, -1 if it is not there.
+    const size_t nameLen = strlen(name);
+    const char* line = stats->data;
+    const char* end = stats->data + stats->size;
+    while (line < end)
+    {
+        const char* eol = memchr(line, '\n', end - line);
+        if ((size_t)(eol - line) > nameLen && memcmp(line, name, nameLen) == 0 &&
+            line[nameLen] == ' ')
+        {
+            const char* p = line + nameLen;
+            return parseDecimal(&p, eol, value);
+        }
+        line = eol + 1;
+    }
+    return -1;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static Routing*
+copyRouting(const Routing* routing)
+{
+    // A copy of the servers of routing, without buckets. NULL if out of memory.
+    Routing* copy = calloc(1, sizeof(Routing));
+    if (copy == NULL)
+        return NULL;
+    *copy = *routing;
+    copy->servers = calloc(routing->numServers, sizeof(Server));
+    copy->numServers = 0;
+    copy->numBuckets = 0;
+    copy->buckets = NULL;
+    int i;
+    for (i = 0; copy->servers && i < routing->numServers; ++i)
+    {
+        // freeRouting frees the names of the first numServers only
+        copy->servers[i] = routing->servers[i];
+        copy->servers[i].name = strdup(routing->servers[i].name);
+        if (copy->servers[i].name == NULL)
+        {
             break;
+        }
+        copy->numServers = i + 1;
     }
-    debug(("retval = %d\n", retval));
+    if (copy->numServers != routing->numServers)
+    {
+        freeRouting(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+reweightServers(CmemcacheObject* self)
+{
+    // Set the weights from the stats of the servers, within callDeadline, and swap in a
+    // new routing if they changed. -1 with an exception if out of memory.
+    Routing* const routing = self->routing;
+    self->nextReweight = profileTime() + self->reweightInterval;
+    if (routing == NULL || routing->numServers == 0)
+        return 0;
+    
+    // set_servers() and reweights in other threads swap (and free) the routing while
+    // the GIL is released, the work is dropped when that happened.
+    const unsigned int routingVersion = self->routingVersion;
+    const unsigned long numReweights = self->numReweights;
+#define routingSwapped(self) ((self)->routing != routing ||                          \
+                              (self)->routingVersion != routingVersion ||           \
+                              (self)->numReweights != numReweights)
+    const int numServers = routing->numServers;
+    // the copy gets the new weights, and has the names to ask while routing may be freed
+    Routing* copy = copyRouting(routing);
+    ServerStats stats;
+    stats.conns = calloc(numServers, sizeof(Conn));
+    stats.values = calloc(numServers, sizeof(Buffer));
+    struct pollfd* pollfds = calloc(numServers, sizeof(struct pollfd));
+    int* pollConns = calloc(numServers, sizeof(int));
+    double* shares = calloc(numServers, sizeof(double));
+    int i;
+    if (copy == NULL || stats.conns == NULL || stats.values == NULL || pollfds == NULL ||
+        pollConns == NULL || shares == NULL)
+    {
+        freeRouting(copy);
+        free(stats.conns);
+        free(stats.values);
+        free(pollfds);
+        free(pollConns);
+        free(shares);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < numServers; ++i)
+    {
+        Conn* conn = &stats.conns[i];
+        conn->fd = -1;
+        if (routing->servers[i].baseWeight > 0 && bufferReserve(&conn->wbuf, 7) == 0)
+        {
+            memcpy(conn->wbuf.data + conn->wbuf.size, "stats\r\n", 7);
+            conn->wbuf.size += 7;
+            ++conn->outstanding;
+        }
+    }
+    // Without the client lock, the calls of other threads on a shared client don't wait
+    // for the stats.
+    BEGIN_RELEASE_GIL(self);
+    pumpServerConns(self, stats.conns, copy->servers, numServers, pollfds, pollConns, 0,
+                    parseServerStats, &stats);
+    END_RELEASE_GIL;
+    freeConns(stats.conns, numServers);
+    free(pollfds);
+    free(pollConns);
+    // errors of the servers that fail are in last_errors(), they keep their weight
+    collectErrors(self, 0);
+    if (routingSwapped(self))
+    {
+        for (i = 0; i < numServers; ++i)
+        {
+            free(stats.values[i].data);
+        }
+        free(stats.values);
+        free(shares);
+        freeRouting(copy);
+        return 0;
+    }
+    
+    // share = capacity * 2 / (1 + evictions per byte / evictions per byte of all)
+    unsigned long long* evictions = calloc(numServers, sizeof(unsigned long long));
+    double capacity = 0;
+    double evicted = 0;
+    for (i = 0; evictions && i < numServers; ++i)
+    {
+        unsigned long long maxBytes;
+        Server* server = &routing->servers[i];
+        if (statValue(&stats.values[i], "limit_maxbytes", &maxBytes) < 0 ||
+            maxBytes == 0 || statValue(&stats.values[i], "evictions", &evictions[i]) < 0)
+            continue;
+        // a server that restarted counts from 0
+        const unsigned long long delta = evictions[i] >= server->evictions ?
+            evictions[i] - server->evictions : evictions[i];
+        server->evictions = copy->servers[i].evictions = evictions[i];
+        evictions[i] = delta;
+        shares[i] = maxBytes;
+        capacity += maxBytes;
+        evicted += delta;
+    }
+    double maxShare = 0;
+    for (i = 0; evictions && i < numServers; ++i)
+    {
+        if (shares[i] > 0 && evicted > 0)
+        {
+            shares[i] *= 2 / (1 + (evictions[i] / shares[i]) / (evicted / capacity));
+        }
+        maxShare = shares[i] > maxShare ? shares[i] : maxShare;
+    }
+    int changed = 0;
+    for (i = 0; evictions && i < numServers; ++i)
+    {
+        Server* server = &copy->servers[i];
+        if (shares[i] > 0)
+        {
+            server->weight = (int)(MAX_SERVER_WEIGHT * shares[i] / maxShare + 0.5);
+            server->weight = server->weight < 1 ? 1 : server->weight;
+        }
+        changed |= server->weight != routing->servers[i].weight;
+        copy->numBuckets += server->weight;
+    }
+    // Keys are routed by hash % numBuckets, so any new weight moves most of them. Swap
+    // only when the share of the buckets of a server moves by more than the threshold.
+    double moved = 0;
+    for (i = 0; changed && copy->numBuckets > 0 && routing->numBuckets > 0 &&
+             i < numServers; ++i)
+    {
+        const double delta = (double)copy->servers[i].weight / copy->numBuckets -
+            (double)routing->servers[i].weight / routing->numBuckets;
+        moved = delta > moved ? delta : -delta > moved ? -delta : moved;
+    }
+    const double threshold = self->reweightThreshold;
+    changed = changed && (threshold <= 0 || moved > threshold || routing->numBuckets == 0);
+    const int nomem = evictions == NULL;
+    free(evictions);
+    free(shares);
+    for (i = 0; i < numServers; ++i)
+    {
+        free(stats.values[i].data);
+    }
+    free(stats.values);
+    
+    // the buckets of the copy with the new weights
+    if (changed && !nomem)
+    {
+        copy->buckets = malloc(copy->numBuckets * sizeof(int));
+        int bucket = 0;
+        int w;
+        for (i = 0; copy->buckets && i < numServers; ++i)
+        {
+            for (w = 0; w < copy->servers[i].weight; ++w)
+            {
+                copy->buckets[bucket++] = i;
+            }
+        }
+    }
+    if (nomem || !changed || copy->buckets == NULL)
+    {
+        freeRouting(copy);
+        if (nomem || changed)
+        {
+            PyErr_NoMemory();
+            return -1;
+        }
+        return 0;
+    }
+    
+    // Swap with the GIL (parseKey) and ioLock (the calls in flight of a shared client)
+    // held, the calls in flight finish with the old routing.
+    CmemcacheObject* locked;
+    Py_BEGIN_ALLOW_THREADS;
+    locked = lockClient(self);
     Py_END_ALLOW_THREADS;
-
-    // retval == 0 means success, and retval < 0 are error values.
-    // Convert to memcache convention: Nonzero on success.
-    return PyInt_FromLong(retval == 0);
-}
-
-//----------------------------------------------------------------------------------------
-//
-static PyObject*
-cmemcache_set(PyObject* pyself, PyObject* args)
-{
-    return cmemcache_store(pyself, args, SET);
+    if (routingSwapped(self))
+    {
+        // the weights are of servers that may be gone
+        unlockClient(locked);
+        freeRouting(copy);
+        return 0;
+    }
+    self->routing = copy;
+    ++self->numReweights;
+    unlockClient(locked);
+    freeRouting(routing);
+    return 0;
+#undef routingSwapped
 }
 
 //----------------------------------------------------------------------------------------
 //
 static PyObject*
-cmemcache_add(PyObject* pyself, PyObject* args)
+cmemcache_reweight(PyObject* pyself, PyObject* args, PyObject* kwds)
 {
-    return cmemcache_store(pyself, args, ADD);
-}
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    
+    debug(("cmemcache_reweight\n"));
 
-//----------------------------------------------------------------------------------------
-//
-static PyObject*
-cmemcache_replace(PyObject* pyself, PyObject* args)
-{
-    return cmemcache_store(pyself, args, REPLACE);
+    static char* kwlist[] = { "timeout", NULL };
+    PyObject* timeout = NULL;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &timeout))
+        return NULL;
+    // not the periodic one of startDeadline as well
+    self->nextReweight = profileTime() + self->reweightInterval;
+    if (startDeadline(self, timeout) < 0 || reweightServers(self) < 0)
+        return NULL;
+    
+    const Routing* routing = self->routing;
+    const int numServers = routing ? routing->numServers : 0;
+    PyObject* weights = PyList_New(numServers);
+    int i;
+    for (i = 0; weights && i < numServers; ++i)
+    {
+        PyObject* item = Py_BuildValue("(si)", routing->servers[i].name,
+                                       routing->servers[i].weight);
+        if (item == NULL)
+        {
+            Py_CLEAR(weights);
+            break;
+        }
+        PyList_SET_ITEM(weights, i, item);
+    }
+    return weights;
 }
 
 //----------------------------------------------------------------------------------------
 //
 static PyObject*
-cmemcache_get_imp(PyObject* pyself, PyObject* args, int retFlags)
+cmemcache_flush_all(PyObject* pyself, PyObject* args, PyObject* kwds)
 {
     CmemcacheObject* self = (CmemcacheObject*)pyself;
     
+    debug(("cmemcache_flush_all\n"));
+
     assert(self->mc);
     
-    char* key = NULL;
-    int keylen = 0;
-
-    if (! PyArg_ParseTuple(args, "s#", &key, &keylen))
-    {
-        debug(("bad arguments\n"));
+    static char* kwlist[] = { "timeout", NULL };
+    PyObject* timeout = NULL;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &timeout) ||
+        startDeadline(self, timeout) < 0)
         return NULL;
-    }
-    debug(("cmemcache_get_imp %s len %d\n", key, keylen));
-    
-    struct memcache_req *req;
-    struct memcache_res *res;
-    
-    Py_BEGIN_ALLOW_THREADS;
-    req = mcm_req_new(self->mc_ctxt);
-    res = mcm_req_add(self->mc_ctxt, req, key, keylen);
-    mcm_res_free_on_delete(self->mc_ctxt, res, 1);
-    mcm_get(self->mc_ctxt, self->mc, req);
-    debug(("attempt %d found %d res %ld '%s'\n",
-           mcm_res_attempted(self->mc_ctxt, res),
-           mcm_res_found(self->mc_ctxt, res), res->size, (char*)res->val));
-    Py_END_ALLOW_THREADS;
     
-    PyObject* retval;
-    if (mcm_res_found(self->mc_ctxt, res))
+    if (! drainWriteBehind(self))
     {
-        if (retFlags)
-        {
-            retval = Py_BuildValue("s#i", res->val, res->size, (int)res->flags);
-        }
-        else
+        if (checkErrors(self) < 0)
+            return NULL;
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    BEGIN_MC_CALL(self, NULL);
+    if (useNative(self))
+    {
+        LineReply reply;
+        int server;
+        for (server = 0; server < self->numConns; ++server)
         {
-            retval = PyString_FromStringAndSize(res->val, res->size);
+            nativeCommand(self, server, "flush_all\r\n", 11, NULL, 0, &reply);
         }
     }
     else
     {
-        Py_INCREF(Py_None);
-        retval = Py_None;
+        debug_def(int retval =) mcm_flush_all(self->mc_ctxt, self->mc);
+        debug(("retval = %d\n", retval));
     }
-    mcm_req_free(self->mc_ctxt, req);
-    return retval;
+    END_MC_CALL;
+    nearClear(self);
+    Py_CLEAR(self->tombstones);
+    if (checkErrors(self) < 0)
+        return NULL;
+    
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
 //----------------------------------------------------------------------------------------
 //
 static PyObject*
-cmemcache_get(PyObject* pyself, PyObject* args)
+cmemcache_disconnect_all(PyObject* pyself, PyObject* args)
 {
-    return cmemcache_get_imp(pyself, args, 0);
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    
+    debug(("cmemcache_disconnect_all\n"));
+
+    assert(self->mc);
+
+    BEGIN_MC_CALL(self, NULL);
+    mcm_server_disconnect_all(self->mc_ctxt, self->mc);
+    int i;
+    for (i = 0; i < self->numConns; ++i)
+    {
+        connClose(&self->conns[i]);
+    }
+    END_MC_CALL;
+    if (checkErrors(self) < 0)
+        return NULL;
+    
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
 //----------------------------------------------------------------------------------------
 //
 static PyObject*
-cmemcache_getflags(PyObject* pyself, PyObject* args)
+cmemcache_last_errors(PyObject* pyself, PyObject* args)
 {
-    return cmemcache_get_imp(pyself, args, 1);
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    
+    collectErrors(self, 0);
+    PyObject* retval = self->lastErrors ? self->lastErrors : PyList_New(0);
+    self->lastErrors = NULL;
+    return retval;
 }
 
 //----------------------------------------------------------------------------------------
 //
 static PyObject*
-cmemcache_get_multi(PyObject* pyself, PyObject* args)
+cmemcache_get_client_stats(PyObject* pyself, PyObject* args)
 {
     CmemcacheObject* self = (CmemcacheObject*)pyself;
     
-    debug(("cmemcache_get_multi\n"));
+    collectErrors(self, 0);
+    return Py_BuildValue("{s:k,s:k,s:k,s:k,s:n,s:k,s:k,s:k,s:k,s:k,s:d,s:d,s:k,s:k,s:k,s:k,s:k,s:k,s:k,s:I,s:I}",
+                         "errors", self->numErrors,
+                         "fatal_errors", self->numFatalErrors,
+                         "errors_dropped", self->numErrorsDropped,
+                         "tombstone_hits", self->numTombstoneHits,
+                         "local_tombstones",
+                         self->tombstones ? PyDict_Size(self->tombstones) : 0,
+                         "near_hits", self->numNearHits,
+                         "near_misses", self->numNearMisses,
+                         "batches", self->numBatches,
+                         "batched_gets", self->numBatchedGets,
+                         "profiled_calls", self->numProfiledCalls,
+                         "released_time", self->releasedTime,
+                         "gil_wait_time", self->gilWaitTime,
+                         "timeouts", self->numTimeouts,
+                         "reweights", self->numReweights,
+                         "intern_hits", self->numInternHits,
+                         "intern_saved", self->internSaved,
+                         "writes_queued", self->numWritesQueued,
+                         "writes_dropped", self->numWritesDropped,
+                         "writes_failed", self->numWritesFailed,
+                         "write_depth", self->writeBehind ?
+                         self->writeBehind->head - self->writeBehind->tail : 0,
+                         "max_write_depth", self->maxWriteDepth);
+}
 
-    assert(self->mc);
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_route(PyObject* pyself, PyObject* keys)
+{
+    CmemcacheObject* self = (CmemcacheObject*)pyself;
     
-    PyObject* keys = NULL;
+    debug(("cmemcache_route\n"));
 
-    if (! PyArg_ParseTuple(args, "O", &keys))
+    KeyBatch batch;
+    if (parseKeys(self, keys, &batch) < 0)
         return NULL;
-    
-    struct memcache_req *req;
-    struct memcache_res *res;
-    req = mcm_req_new(self->mc_ctxt);
-    const int size = PySequence_Size(keys);
-    int i;
-    int error = 0;
-    for (i = 0; i < size && error == 0; ++i)
+
+    PyObject* retval = PyList_New(batch.size);
+    Py_ssize_t i;
+    for (i = 0; retval && i < batch.size; ++i)
     {
-        PyObject* key = NULL;
-        key = PySequence_GetItem(keys, i);
-        if (PyString_Check(key))
+        const int server = batch.keys[i].server;
+        PyObject* name = server < 0 ? Py_None :
+            PyString_FromString(self->routing->servers[server].name);
+        if (name == Py_None)
         {
-            char* ckey = PyString_AsString(key);
-            if (ckey)
-            {
-                debug(("key \"%s\" len %ld\n", ckey, PyString_Size(key)));
-                res = mcm_req_add(self->mc_ctxt, req, ckey, PyString_Size(key));
-                mcm_res_free_on_delete(self->mc_ctxt, res, 1);
-            }
-            else
-            {
-                PyErr_BadArgument();
-                error = 1;
-            }
+            Py_INCREF(Py_None);
         }
-        else
+        else if (name == NULL)
         {
-            debug(("not a string\n"));
-            PyErr_BadArgument();
-            error = 1;
+            Py_CLEAR(retval);
+            break;
         }
-        Py_DECREF(key);
-    }
-    PyObject* dict = PyDict_New();
-    if (error)
-    {
-        debug(("error\n"));
+        PyList_SET_ITEM(retval, i, name); // steals name reference
     }
-    else
+    freeKeys(&batch);
+    return retval;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static int
+parseStoreReplies(CmemcacheObject* self, Conn* conn, void* arg)
+{
+    unsigned long* stored = (unsigned long*)arg;
+    const char* line;
+    size_t len;
+    while (connLine(conn, &line, &len))
     {
-        Py_BEGIN_ALLOW_THREADS;
-        mcm_get(self->mc_ctxt, self->mc, req);
-        Py_END_ALLOW_THREADS;
-        
-        // Put all the found results in the dictionary.
-        TAILQ_FOREACH(res, &req->query, entries)
+        if (conn->outstanding == 0)
+            return -1;
+        --conn->outstanding;
+        if (len == 6 && memcmp(line, "STORED", 6) == 0)
         {
-            if (mcm_res_found(self->mc_ctxt, res))
-            {
-                debug(("res found, add %s\n", res->key));
-                PyObject* key = PyString_FromStringAndSize(res->key, res->len);
-                PyObject* val = PyString_FromStringAndSize(res->val, res->size);
-                PyDict_SetItem(dict, key, val);
-                Py_DECREF(key);
-                Py_DECREF(val);
-            }
+            ++*stored;
+        }
+        else if (!(len == 10 && memcmp(line, "NOT_STORED", 10) == 0) &&
+                 connReplyError(self, line, len) < 0)
+        {
+            return -1;
         }
     }
-    mcm_req_free(self->mc_ctxt, req);
-
-    return dict;
+    return 0;
 }
 
 //----------------------------------------------------------------------------------------
 //
 static PyObject*
-cmemcache_get_multiflags(PyObject* pyself, PyObject* args)
+cmemcache_load(PyObject* pyself, PyObject* args, PyObject* kwds)
 {
     CmemcacheObject* self = (CmemcacheObject*)pyself;
+    static char* kwlist[] = { "items", "window", "progress", "progress_interval", NULL };
+    PyObject* items = NULL;
+    int window = 64;
+    PyObject* progress = NULL;
+    long interval = 10000;
     
-    debug(("cmemcache_get_multiflags\n"));
-
-    assert(self->mc);
-    
-    PyObject* keys = NULL;
+    debug(("cmemcache_load\n"));
 
-    if (! PyArg_ParseTuple(args, "O", &keys))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iOl", kwlist,
+                                     &items, &window, &progress, &interval))
         return NULL;
+    // bulk operations have no deadline, the window bounds the waiting
+    callDeadline = 0;
+    if (progress == Py_None)
+    {
+        progress = NULL;
+    }
+    window = window < 1 ? 1 : window;
     
-    struct memcache_req *req;
-    struct memcache_res *res;
-    req = mc_req_new();
-    const int size = PySequence_Size(keys);
+    // no deadline, this waits for the queued writes as long as it takes
+    drainWriteBehind(self);
+    PyObject* iter = PyObject_GetIter(items);
+    if (iter == NULL)
+        return NULL;
+
+    // Commands are queued with the GIL only, so on connections of our own (like
+    // iter_get_multi), the ones of the client can be in use by another thread.
+    const unsigned int routingVersion = self->routingVersion;
+    const int numConns = self->numConns;
+    Conn* conns = calloc(numConns > 0 ? numConns : 1, sizeof(Conn));
+    if (conns == NULL)
+    {
+        Py_DECREF(iter);
+        return PyErr_NoMemory();
+    }
     int i;
+    for (i = 0; i < numConns; ++i)
+    {
+        conns[i].fd = -1;
+    }
+
+    unsigned long queued = 0;
+    unsigned long stored = 0;
+    unsigned long skipped = 0;
+    unsigned long nextProgress = interval;
+    int done = 0;
     int error = 0;
-    for (i = 0; i < size && error == 0; ++i)
+    int swapped = 0;
+    while (!done)
     {
-        PyObject* key = NULL;
-        key = PySequence_GetItem(keys, i);
-        if (PyString_Check(key))
+        // Queue commands with the GIL, until a server has a full window
+        int full = 0;
+        while (!full && !error)
         {
-            char* ckey = PyString_AsString(key);
-            if (ckey)
+            PyObject* item = PyIter_Next(iter);
+            if (item == NULL)
             {
-                debug(("key \"%s\" len %ld\n", ckey, PyString_Size(key)));
-                res = mc_req_add(req, ckey, PyString_Size(key));
-                mc_res_free_on_delete(res, 1);
+                error = PyErr_Occurred() != NULL;
+                done = 1;
+                break;
             }
-            else
+            PyObject* pykey = NULL;
+            const char* value = NULL;
+            int valueLen = 0;
+            int flags = 0;
+            long exptime = 0;
+            Key key;
+            if (!PyTuple_Check(item))
+            {
+                PyErr_SetString(PyExc_TypeError,
+                                "expected (key, value[, flags[, time]]) tuples");
+                error = 1;
+            }
+            else if (!PyArg_ParseTuple(item, "Os#|il", &pykey, &value, &valueLen,
+                                       &flags, &exptime) ||
+                     parseKey(self, pykey, &key) < 0)
             {
-                PyErr_BadArgument();
                 error = 1;
             }
+            else if (self->routingVersion != routingVersion)
+            {
+                swapped = error = 1;
+            }
+            else if (key.server < 0)
+            {
+                ++skipped;
+            }
+            else
+            {
+                Conn* conn = &conns[key.server];
+                forgetTombstone(self, &key);
+                if (connQueueSet(conn, key.key, key.len, flags, expParamToExpTime(exptime),
+                                 value, valueLen) < 0)
+                {
+                    PyErr_NoMemory();
+                    error = 1;
+                }
+                else
+                {
+                    ++queued;
+                    full = conn->outstanding >= window;
+                }
+            }
+            Py_DECREF(item);
+        }
+        done = done || error;
+        
+        // Send and receive without the GIL, until all servers are at half their window,
+        // or have no commands outstanding at all at the end.
+        BEGIN_MC_CALL(self, NULL);
+        // set_servers() in another thread can have swapped the servers while waiting
+        if (self->routingVersion == routingVersion)
+        {
+            Conn* const clientConns = self->conns;
+            self->conns = conns;
+            pumpConns(self, done ? 0 : window / 2, parseStoreReplies, &stored);
+            self->conns = clientConns;
         }
         else
         {
-            debug(("not a string\n"));
-            PyErr_BadArgument();
-            error = 1;
+            swapped = 1;
+        }
+        END_MC_CALL;
+        if (swapped && !error)
+        {
+            error = done = 1;
+        }
+
+        if (progress && !error && (done || queued >= nextProgress))
+        {
+            PyObject* retval = PyObject_CallFunction(progress, "kk", queued, stored);
+            Py_XDECREF(retval);
+            error = retval == NULL;
+            nextProgress = queued + interval;
         }
-        Py_DECREF(key);
     }
-    PyObject* dict = PyDict_New();
-    if (error)
+    Py_DECREF(iter);
+    freeConns(conns, numConns);
+    if (swapped)
     {
-        debug(("error\n"));
+        collectErrors(self, 0);
+        if (!PyErr_Occurred())
+        {
+            PyErr_SetString(PyExc_RuntimeError, "set_servers() during load()");
+        }
+        return NULL;
     }
-    else
+    if (error)
     {
-        Py_BEGIN_ALLOW_THREADS;
-        mc_get(self->mc, req);
-        Py_END_ALLOW_THREADS;
+        collectErrors(self, 0);
+        return NULL;
+    }
+    if (checkErrors(self) < 0)
+        return NULL;
+    
+    return Py_BuildValue("(kk)", stored, queued + skipped - stored);
+}
 
-        // Put all the found results in the dictionary.
-        TAILQ_FOREACH(res, &req->query, entries)
-        {
-            if (mc_res_found(res))
-            {
-	        debug(("res found, add %s %s f %d\n",
-                       res->key, (char*)res->val, res->flags));
-		PyObject* key = PyString_FromStringAndSize(res->key, res->len);
-		PyObject* val = NULL;
-                int flags = (int)res->flags;
-                if (flags == 0) {
-                    // Return the string.
-                    val = PyString_FromStringAndSize(res->val, res->size);
-                }
-                else if (flags & _FLAG_INTEGER) {
-                    val = PyInt_FromString(res->val, res->val + res->size - 1, 0);
-                }
-                else if (flags & _FLAG_LONG) {
-                    val = PyLong_FromString(res->val, res->val + res->size - 1, 0);
-                }
-                else if (flags & _FLAG_PICKLE) {
-                    // Create the string, put it in a tuple to pass as parameters to
-                    // unpickle
-                    val = PyString_FromStringAndSize(res->val, res->size);
-                    PyObject *tuple = PyTuple_New(1);
-                    PyTuple_SetItem(tuple, 0, val); // steals val reference
-                    val = PyObject_CallObject(loads, tuple);
-                    Py_DECREF(tuple);
-                }
+/*** Dump and restore ***/
 
-                if (val) {
-                    PyDict_SetItem(dict, key, val);
-                    Py_DECREF(val);
-                }
-                Py_DECREF(key);
-            }
-        }
-    }
-    mcm_req_free(self->mc_ctxt, req);
+/*
+  Dump file layout, all numbers little endian:
+    header: "CMEMDUMP", uint32 version, uint32 count, uint64 offset of the index
+    count entries: uint32 hash, uint32 flags, uint32 exptime, uint32 size, uint8 key
+                   length, key, value
+    index: count uint64 entry offsets
+  The hash is the one the key was routed with, so (hash, key) keys restore to the same
+  server.
+*/
 
-    return dict;
-}
+#define DUMP_MAGIC "CMEMDUMP"
+#define DUMP_VERSION 1
+#define DUMP_HEADER_SIZE 24
+#define DUMP_ENTRY_SIZE 17
+
+typedef struct
+{
+    FILE* f;
+    uint32_t exptime;
+    const KeyBatch* batch;
+    const int* order;            /* batch indices grouped by server */
+    int* next;                   /* per server, position in order of its next reply */
+    int* end;                    /* per server, end of its keys in order */
+    Buffer index;
+    unsigned long count;
+    uint64_t offset;             /* of the next entry */
+    int errnum;                  /* of a failed write */
+} DumpState;
 
 //----------------------------------------------------------------------------------------
 //
-static PyObject*
-cmemcache_delete(PyObject* pyself, PyObject* args)
+static void
+putUnsigned(unsigned char* p, uint64_t val, int nbytes)
 {
-    CmemcacheObject* self = (CmemcacheObject*)pyself;
-    
-    debug(("cmemcache_delete\n"));
-
-    assert(self->mc);
-    
-    char* key = NULL;
-    int keylen = 0;
-    time_t expTime;
-    long int expParam = 0;
-
-    if (! PyArg_ParseTuple(args, "s#|l", &key, &keylen, &expParam))
-        return NULL;
+    int i;
+    for (i = 0; i < nbytes; ++i)
+    {
+        p[i] = (unsigned char)(val >> (8 * i));
+    }
+}
 
-    expTime = expParamToExpTime(expParam);
+//----------------------------------------------------------------------------------------
+//
+static int
+dumpEntry(DumpState* state, uint32_t hash, const Value* value)
+{
+    unsigned char header[DUMP_ENTRY_SIZE];
+    putUnsigned(header, hash, 4);
+    putUnsigned(header + 4, value->flags, 4);
+    putUnsigned(header + 8, state->exptime, 4);
+    putUnsigned(header + 12, value->size, 4);
+    header[16] = value->keyLen;
+    if (bufferReserve(&state->index, 8) < 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    putUnsigned((unsigned char*)state->index.data + state->index.size, state->offset, 8);
+    state->index.size += 8;
+    if (fwrite(header, sizeof(header), 1, state->f) != 1 ||
+        fwrite(value->key, value->keyLen, 1, state->f) != 1 ||
+        (value->size > 0 && fwrite(value->data, value->size, 1, state->f) != 1))
+    {
+        return -1;
+    }
+    state->offset += sizeof(header) + value->keyLen + value->size;
+    ++state->count;
+    return 0;
+}
 
-    int retval;
-    
-    Py_BEGIN_ALLOW_THREADS;
-    debug(("cmemcache_delete %s expTime %ld\n", key, expTime));
-    retval = mcm_delete(self->mc_ctxt, self->mc, key, keylen, expTime);
-    debug(("retval = %d\n", retval));
-    Py_END_ALLOW_THREADS;
-    
-    return PyInt_FromLong(retval);
+//----------------------------------------------------------------------------------------
+//
+static int
+parseDumpReplies(CmemcacheObject* self, Conn* conn, void* arg)
+{
+    DumpState* state = (DumpState*)arg;
+    const int server = conn - self->conns;
+    Value value;
+    int retval = 0;
+    while (conn->outstanding > 0 && (retval = connValue(self, conn, &value)) > 0)
+    {
+        if (retval == 2)
+        {
+            --conn->outstanding;
+            continue;
+        }
+        // The values come in the order of the keys, missing keys are skipped. Find the
+        // key for its hash.
+        uint32_t hash = keyHash(value.key, value.keyLen);
+        while (state->next[server] < state->end[server])
+        {
+            const Key* key = &state->batch->keys[state->order[state->next[server]++]];
+            if (key->len == value.keyLen && memcmp(key->key, value.key, key->len) == 0)
+            {
+                hash = key->hash;
+                break;
+            }
+        }
+        if (state->errnum == 0 && dumpEntry(state, hash, &value) < 0)
+        {
+            state->errnum = errno;
+        }
+    }
+    return retval < 0 ? -1 : 0;
 }
 
 //----------------------------------------------------------------------------------------
 //
 static PyObject*
-cmemcache_incr_decr(PyObject* pyself, PyObject* args, int incr)
+cmemcache_dump(PyObject* pyself, PyObject* args, PyObject* kwds)
 {
     CmemcacheObject* self = (CmemcacheObject*)pyself;
+    static char* kwlist[] = { "keys", "path", "time", NULL };
+    PyObject* keys = NULL;
+    const char* path = NULL;
+    long exptime = 0;
     
-    debug(("cmemcache_incr_decr\n"));
+    debug(("cmemcache_dump\n"));
 
-    assert(self->mc);
-    
-    char* key = NULL;
-    int keylen = 0;
-    int delta = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|l", kwlist, &keys, &path, &exptime))
+        return NULL;
+    callDeadline = 0;
 
-    if (! PyArg_ParseTuple(args, "s#|i", &key, &keylen, &delta))
+    KeyBatch batch;
+    if (parseKeys(self, keys, &batch) < 0)
         return NULL;
 
-    int newval;
+    DumpState state;
+    memset(&state, 0, sizeof(state));
+    state.exptime = expParamToExpTime(exptime);
+    state.batch = &batch;
+    state.offset = DUMP_HEADER_SIZE;
     
-    Py_BEGIN_ALLOW_THREADS;
-    debug(("cmemcache_incr_decr %s %s delta %d\n", incr ? "incr" : "decr", key, delta));
-    if ( incr )
+    state.f = fopen(path, "wb");
+    if (state.f == NULL)
+    {
+        freeKeys(&batch);
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char*)path);
+    }
+    
+    int nomem = 0;
+    int* order = NULL;
+    BEGIN_MC_CALL(self, NULL);
+    unsigned char header[DUMP_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    if (fwrite(header, sizeof(header), 1, state.f) != 1)
     {
-        newval = mcm_incr(self->mc_ctxt, self->mc, key, keylen, delta);
+        state.errnum = errno;
+    }
+    // sized in the call, set_servers() in another thread can change numConns before
+    order = malloc((batch.size + 2 * self->numConns + 1) * sizeof(int));
+    if (order)
+    {
+        state.order = order;
+        state.next = order + batch.size;
+        state.end = state.next + self->numConns;
+        resetConns(self);
+        nomem = queueGets(self, &batch, order, state.next, state.end) < 0;
+        pumpConns(self, 0, parseDumpReplies, &state);
     }
     else
     {
-        newval = mcm_decr(self->mc_ctxt, self->mc, key, keylen, delta);
+        nomem = 1;
     }
-    debug(("newval %d errnum %d\n", newval, self->mc_ctxt->errnum));
-    Py_END_ALLOW_THREADS;
-
-    if ( self->mc_ctxt->errnum )
+    
+    // the index, then the header with the count and the index offset
+    memcpy(header, DUMP_MAGIC, 8);
+    putUnsigned(header + 8, DUMP_VERSION, 4);
+    putUnsigned(header + 12, state.count, 4);
+    putUnsigned(header + 16, state.offset, 8);
+    if (state.errnum == 0 &&
+        ((state.index.size > 0 &&
+          fwrite(state.index.data, state.index.size, 1, state.f) != 1) ||
+         fseek(state.f, 0, SEEK_SET) < 0 ||
+         fwrite(header, sizeof(header), 1, state.f) != 1))
     {
-        Py_INCREF(Py_None);
-        return Py_None;
+        state.errnum = errno;
     }
-    return PyInt_FromLong(newval);
-}
+    if (fclose(state.f) != 0 && state.errnum == 0)
+    {
+        state.errnum = errno;
+    }
+    END_MC_CALL;
+    
+    free(state.index.data);
+    free(order);
+    freeKeys(&batch);
+    if (nomem)
+    {
+        collectErrors(self, 0);
+        return PyErr_NoMemory();
+    }
+    if (state.errnum != 0)
+    {
+        collectErrors(self, 0);
+        errno = state.errnum;
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char*)path);
+    }
+    if (checkErrors(self) < 0)
+        return NULL;
 
-//----------------------------------------------------------------------------------------
-//
-static PyObject*
-cmemcache_incr(PyObject* pyself, PyObject* args)
-{
-    return cmemcache_incr_decr( pyself, args, 1 );
+    return PyInt_FromLong(state.count);
 }
 
 //----------------------------------------------------------------------------------------
 //
-static PyObject*
-cmemcache_decr(PyObject* pyself, PyObject* args)
+static const unsigned char*
+mappedEntry(const unsigned char* data, uint64_t indexOffset, uint64_t i)
 {
-    return cmemcache_incr_decr( pyself, args, 0 );
+    // Entry i of a mapped dump file, NULL if it is not within the entries.
+    const uint64_t offset = readUnsigned(data + indexOffset + 8 * i, 8);
+    if (offset < DUMP_HEADER_SIZE || offset + DUMP_ENTRY_SIZE > indexOffset)
+        return NULL;
+    const unsigned char* entry = data + offset;
+    if (offset + DUMP_ENTRY_SIZE + entry[16] + readUnsigned(entry + 12, 4) > indexOffset)
+        return NULL;
+    return entry;
 }
 
 //----------------------------------------------------------------------------------------
 //
 static PyObject*
-cmemcache_get_stats(PyObject* pyself, PyObject* args)
+cmemcache_restore(PyObject* pyself, PyObject* args, PyObject* kwds)
 {
     CmemcacheObject* self = (CmemcacheObject*)pyself;
+    static char* kwlist[] = { "path", "window", NULL };
+    const char* path = NULL;
+    int window = 64;
     
-    debug(("cmemcache_get_stats\n"));
+    debug(("cmemcache_restore\n"));
 
-    assert(self->mc);
-    PyObject* retval = PyList_New(0);
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|i", kwlist, &path, &window))
+        return NULL;
+    callDeadline = 0;
+    window = window < 1 ? 1 : window;
 
-    /* loop copied from mcm_server_disconnect_all, but is there some supported way of
-       going through all the servers? */
-    struct memcache_server *ms;
-    for (ms = self->mc->server_list.tqh_first; ms != NULL; ms = ms->entries.tqe_next)
+    const int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
     {
-        struct memcache_server_stats* stats;
-        
-        Py_BEGIN_ALLOW_THREADS;
-        stats = mcm_server_stats(self->mc_ctxt, self->mc, ms);
-        Py_END_ALLOW_THREADS;
-        
-        if (stats != NULL)
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char*)path);
+        if (fd >= 0)
         {
-            char buffer[128+1];
-            snprintf(buffer, 128, "%s:%s", ms->hostname, ms->port);
-            PyObject* name = PyString_FromString(buffer);
-            PyObject* dict = PyDict_New();
-
-            PyObject* valobj;
-            
-#define SET_SNPRINTF(d, key, fmt, val)           \
-            snprintf(buffer, 128, fmt, val);     \
-            valobj = PyString_FromString(buffer); \
-            PyDict_SetItemString(d, key, valobj); \
-            Py_DECREF(valobj);                    \
-            valobj = NULL
-            
-#define SET_TIME(d, key, val) SET_SNPRINTF(d, key, "%ld", val)
-#define SET_ITEMU32(d, key, val) SET_SNPRINTF(d, key, "%u", val)
-#define SET_ITEMU64(d, key, val) SET_SNPRINTF(d, key, "%llu", val)
-#define SET_TIMEVAL(d, key, val)                                \
-            SET_SNPRINTF(d, key, "%lf", val.tv_sec + val.tv_usec * 1.0e-9)
-                
-            SET_ITEMU32(dict, "pid", stats->pid);
-            SET_TIME(dict, "uptime", stats->uptime);
-            SET_TIME(dict, "time", stats->time);
-            PyDict_SetItem(dict, PyString_FromString("version"),
-                           PyString_FromString(stats->version));
-            SET_TIMEVAL(dict, "rusage_user", stats->rusage_user);
-            SET_TIMEVAL(dict, "rusage_system", stats->rusage_system);
-            SET_ITEMU32(dict, "curr_items", stats->curr_items);
-            SET_ITEMU64(dict, "total_items", stats->total_items);
-            SET_ITEMU64(dict, "bytes", stats->bytes);
-            SET_ITEMU32(dict, "curr_connections", stats->curr_connections);
-            SET_ITEMU64(dict, "total_connections", stats->total_connections);
-            SET_ITEMU32(dict, "connection_structures", stats->connection_structures);
-            SET_ITEMU64(dict, "cmd_get", stats->cmd_get);
-#ifdef SEAN_HACKS
-            SET_ITEMU64(dict, "cmd_refresh", stats->cmd_refresh);
-#endif
-            SET_ITEMU64(dict, "cmd_set", stats->cmd_set);
-            SET_ITEMU64(dict, "get_hits", stats->get_hits);
-            SET_ITEMU64(dict, "get_misses", stats->get_misses);
-#ifdef SEAN_HACKS
-            SET_ITEMU64(dict, "refresh_hits", stats->refresh_hits);
-            SET_ITEMU64(dict, "refresh_misses", stats->refresh_misses);
-#endif
-            SET_ITEMU64(dict, "bytes_read", stats->bytes_read);
-            SET_ITEMU64(dict, "bytes_written", stats->bytes_written);
-            SET_ITEMU64(dict, "limit_maxbytes", stats->limit_maxbytes);
-
-            PyObject* tuple = PyTuple_New(2);
-            PyTuple_SetItem(tuple, 0, name);
-            PyTuple_SetItem(tuple, 1, dict);
-            PyList_Append(retval, tuple);
-            
-            mcm_server_stats_free(self->mc_ctxt, stats);
+            close(fd);
         }
+        return NULL;
+    }
+    const size_t size = st.st_size;
+    const unsigned char* data = size < DUMP_HEADER_SIZE ? MAP_FAILED :
+        mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    uint64_t count = 0;
+    uint64_t indexOffset = 0;
+    if (data != MAP_FAILED)
+    {
+        count = readUnsigned(data + 12, 4);
+        indexOffset = readUnsigned(data + 16, 8);
+    }
+    if (data == MAP_FAILED || memcmp(data, DUMP_MAGIC, 8) != 0 ||
+        readUnsigned(data + 8, 4) != DUMP_VERSION ||
+        indexOffset < DUMP_HEADER_SIZE || indexOffset > size ||
+        count > (size - indexOffset) / 8)
+    {
+        if (data != MAP_FAILED)
+        {
+            munmap((void*)data, size);
+        }
+        PyErr_Format(PyExc_ValueError, "%s is not a cmemcache dump file", path);
+        return NULL;
     }
     
-    return retval;
-}
-
-//----------------------------------------------------------------------------------------
-//
-static PyObject*
-cmemcache_flush_all(PyObject* pyself, PyObject* args)
-{
-    CmemcacheObject* self = (CmemcacheObject*)pyself;
-    
-    debug(("cmemcache_flush_all\n"));
-
-    assert(self->mc);
-    
-    Py_BEGIN_ALLOW_THREADS;
-    debug_def(int retval =) mcm_flush_all(self->mc_ctxt, self->mc);
-    debug(("retval = %d\n", retval));
-    Py_END_ALLOW_THREADS;
+    // The keys exist again, forget their tombstones with the GIL first.
+    uint64_t i;
+    for (i = 0; self->tombstones && PyDict_Size(self->tombstones) > 0 && i < count; ++i)
+    {
+        const unsigned char* entry = mappedEntry(data, indexOffset, i);
+        Key key;
+        if (entry == NULL)
+            break;
+        key.key = (const char*)entry + DUMP_ENTRY_SIZE;
+        key.len = entry[16];
+        forgetTombstone(self, &key);
+    }
     
-    Py_INCREF(Py_None);
-    return Py_None;
-}
-
-//----------------------------------------------------------------------------------------
-//
-static PyObject*
-cmemcache_disconnect_all(PyObject* pyself, PyObject* args)
-{
-    CmemcacheObject* self = (CmemcacheObject*)pyself;
+    // no deadline, this waits for the queued writes as long as it takes
+    drainWriteBehind(self);
     
-    debug(("cmemcache_disconnect_all\n"));
+    // Queue the sets straight from the mapped file, and send them without the GIL.
+    unsigned long stored = 0;
+    int corrupt = 0;
+    int nomem = 0;
+    BEGIN_MC_CALL(self, NULL);
+    resetConns(self);
+    for (i = 0; i < count && !corrupt && !nomem; ++i)
+    {
+        const unsigned char* entry = mappedEntry(data, indexOffset, i);
+        if (entry == NULL)
+        {
+            corrupt = 1;
+            break;
+        }
+        const uint32_t hash = readUnsigned(entry, 4);
+        const int keyLen = entry[16];
+        const uint64_t valueSize = readUnsigned(entry + 12, 4);
+        // a damaged key would break the protocol, skip it like parseKey refuses it
+        const unsigned char* key = entry + DUMP_ENTRY_SIZE;
+        int valid = keyLen > 0 && keyLen <= MAX_KEY_LENGTH;
+        int k;
+        for (k = 0; valid && k < keyLen; ++k)
+        {
+            valid = key[k] > ' ' && key[k] != 127;
+        }
+        const int server = routeHash(self->routing, hash);
+        if (!valid || server < 0)
+        {
+            continue;
+        }
+        Conn* conn = &self->conns[server];
+        nomem = connQueueSet(conn, (const char*)key, keyLen,
+                             readUnsigned(entry + 4, 4), readUnsigned(entry + 8, 4),
+                             (const char*)entry + DUMP_ENTRY_SIZE + keyLen,
+                             valueSize) < 0;
+        if (conn->outstanding >= window)
+        {
+            pumpConns(self, window / 2, parseStoreReplies, &stored);
+        }
+    }
+    pumpConns(self, 0, parseStoreReplies, &stored);
+    munmap((void*)data, size);
+    END_MC_CALL;
 
-    assert(self->mc);
+    if (corrupt || nomem)
+    {
+        collectErrors(self, 0);
+        if (nomem)
+            return PyErr_NoMemory();
+        PyErr_Format(PyExc_ValueError, "%s is corrupt", path);
+        return NULL;
+    }
+    if (checkErrors(self) < 0)
+        return NULL;
 
-    Py_BEGIN_ALLOW_THREADS;
-    mcm_server_disconnect_all(self->mc_ctxt, self->mc);
-    Py_END_ALLOW_THREADS;
-    
-    Py_INCREF(Py_None);
-    return Py_None;
+    return Py_BuildValue("(kk)", stored, (unsigned long)(count - stored));
 }
 
 static PyMethodDef cmemcache_methods[] = {
@@ -849,38 +6254,50 @@ static PyMethodDef cmemcache_methods[] = {
     },
     
     {
-        "set", cmemcache_set, METH_VARARGS,
-        "set(key, value, time=0, flags=0) -- Unconditionally sets a key to a given value in the memcache.\n\n"
+        "set", (PyCFunction)cmemcache_set, METH_VARARGS | METH_KEYWORDS,
+        "set(key, value, time=0, flags=0, timeout=None) -- Unconditionally sets a key to a given value in the memcache.\n\n"
         "@return: Nonzero on success.\n@rtype: int\n"
     },
     
     {
-        "add", cmemcache_add, METH_VARARGS,
-        "add(key, value, time=0, flags=0) -- Add new key with value.\n\n"
+        "add", (PyCFunction)cmemcache_add, METH_VARARGS | METH_KEYWORDS,
+        "add(key, value, time=0, flags=0, timeout=None) -- Add new key with value.\n\n"
         "Like L{set}, but only stores in memcache if the key doesn't already exist."
     },
     
     {
-        "replace", cmemcache_replace, METH_VARARGS,
-        "replace(key, value, time=0, flags=0) -- replace existing key with value.\n\n"
+        "replace", (PyCFunction)cmemcache_replace, METH_VARARGS | METH_KEYWORDS,
+        "replace(key, value, time=0, flags=0, timeout=None) -- replace existing key with\n"
+        "value.\n\n"
         "Like L{set}, but only stores in memcache if the key already exists.\n"
         "The opposite of L{add}."
     },
+
+    {
+        "set_tombstone", (PyCFunction)cmemcache_set_tombstone, METH_VARARGS | METH_KEYWORDS,
+        "set_tombstone(key, time=0, timeout=None) -- Store that key does not exist.\n\n"
+        "Call this on a confirmed miss (the backend has no value for key either), get()\n"
+        "and get_multi() then return TOMBSTONE for key. With tombstone_ttl set the\n"
+        "tombstone is also kept in the client.\n"
+        "@return: Nonzero on success.\n"
+    },
     
     {
-        "get", cmemcache_get, METH_VARARGS,
-        "get(key) -- Retrieves a key from the memcache.\n\n@return: The value or None."
+        "get", (PyCFunction)cmemcache_get, METH_VARARGS | METH_KEYWORDS,
+        "get(key, timeout=None, serializers=None) -- Retrieves a key from the memcache.\n"
+        "With serializers the value is decoded by its flags like get_multiflags does.\n\n"
+        "@return: The value or None."
     },
     
     {
-        "getflags", cmemcache_getflags, METH_VARARGS,
-        "getflags(key) -- Retrieves a key from the memcache.\n\n"
+        "getflags", (PyCFunction)cmemcache_getflags, METH_VARARGS | METH_KEYWORDS,
+        "getflags(key, timeout=None) -- Retrieves a key from the memcache.\n\n"
         "@return: The (value,flags) or None."
     },
     
     {
-        "get_multi", cmemcache_get_multi, METH_VARARGS,
-        "get_multi(keys) --\n"
+        "get_multi", (PyCFunction)cmemcache_get_multi, METH_VARARGS | METH_KEYWORDS,
+        "get_multi(keys, timeout=None) --\n"
         "Retrieves multiple keys from the memcache doing just one query. All results are returned as strings. Use get_multiflags to get proper types.\n"
         ">>> success = mc.set(\"foo\", \"bar\")\n"
         ">>> success = mc.set(\"baz\", 42)\n"
@@ -892,13 +6309,15 @@ static PyMethodDef cmemcache_methods[] = {
         "the next one.\n"
         "\n"
         "@param keys: An array of keys.\n"
-        "@return:  A dictionary of key/value pairs that were available.\n"
+        "@return:  A dictionary of key/value pairs that were available, with a timeout\n"
+        "the ones that arrived in time.\n"
     },
     
     {
-        "get_multiflags", cmemcache_get_multiflags, METH_VARARGS,
-        "get_multiflags(keys) --\n"
+        "get_multiflags", (PyCFunction)cmemcache_get_multiflags, METH_VARARGS | METH_KEYWORDS,
+        "get_multiflags(keys, serializers=None, timeout=None) --\n"
         "Retrieves multiple keys from the memcache doing just one query. Uses the flags from mc.set() to figure out the type (see memcache set/get).\n"
+        "Values with flags not known to cmemcache are decoded with serializers[flags](value).\n"
         ">>> success = mc.set(\"foo\", \"bar\")\n"
         ">>> success = mc.set(\"baz\", 42)\n"
         ">>> mc.get_multi([\"foo\", \"baz\", \"foobar\"]) == {\"foo\": \"bar\", \"baz\": 42}\n"
@@ -909,18 +6328,33 @@ static PyMethodDef cmemcache_methods[] = {
         "the next one.\n"
         "\n"
         "@param keys: An array of keys.\n"
-        "@return:  A dictionary of key/value pairs that were available.\n"
+        "@param serializers: Optional dictionary of flags/loads function pairs.\n"
+        "@return:  A dictionary of key/value pairs that were available, with a timeout\n"
+        "the ones that arrived in time.\n"
+    },
+    
+    {
+        "iter_get_multi", (PyCFunction)cmemcache_iter_get_multi,
+        METH_VARARGS | METH_KEYWORDS,
+        "iter_get_multi(keys, batch_size=1000, serializers=None, timeout=None) -- Iterate\n"
+        "over the (key, value) pairs of the keys found.\n\n"
+        "keys can be any iterable, it is read batch_size keys at a time. Each batch is\n"
+        "sent to the servers, on connections of the iterator, before the values of the\n"
+        "batch before it are yielded, so memory stays bounded however many keys there\n"
+        "are. The values are strings, or decoded like get_multiflags() does with\n"
+        "serializers. timeout is the budget of each batch.\n"
+        "@raise RuntimeError: if set_servers() is called while iterating.\n"
     },
     
     {
-        "delete", cmemcache_delete, METH_VARARGS,
-        "delete(key, time=0) -- Deletes a key from the memcache.\n\n"
+        "delete", (PyCFunction)cmemcache_delete, METH_VARARGS | METH_KEYWORDS,
+        "delete(key, time=0, timeout=None) -- Deletes a key from the memcache.\n\n"
         "@return: Nonzero on success.\n@rtype: int"
     },
     
     {
-        "incr", cmemcache_incr, METH_VARARGS,
-        "incr(key, delta=1)\n"
+        "incr", (PyCFunction)cmemcache_incr, METH_VARARGS | METH_KEYWORDS,
+        "incr(key, delta=1, timeout=None)\n"
         "\n"
         "Sends a command to the server to atomically increment the value for C{key} by\n"
         "C{delta}, or by 1 if C{delta} is unspecified.  Returns None if C{key} doesn't\n"
@@ -945,8 +6379,8 @@ static PyMethodDef cmemcache_methods[] = {
     },
     
     {
-        "decr", cmemcache_decr, METH_VARARGS,
-        "decr(key, delta=1)\n"
+        "decr", (PyCFunction)cmemcache_decr, METH_VARARGS | METH_KEYWORDS,
+        "decr(key, delta=1, timeout=None)\n"
         "\n"
         "Like L{incr}, but decrements.  Unlike L{incr}, underflow is checked and\n"
         "new values are capped at 0.  If server value is 1, a decrement of 2\n"
@@ -958,8 +6392,105 @@ static PyMethodDef cmemcache_methods[] = {
     },
     
     {
-        "get_stats", cmemcache_get_stats, METH_NOARGS,
-        "get_stats() -- Get statistics from all servers.\n"
+        "route", cmemcache_route, METH_O,
+        "route(keys) -- The server of each key.\n\n"
+        "Keys are validated, and can be (hash, key) tuples to choose the server, just\n"
+        "like for all other methods.\n"
+        "@return: A list with the \"server:port\" of each key, None if there are no\n"
+        "servers.\n"
+        "@raise MemcachedKeyError: for invalid keys.\n"
+    },
+
+    {
+        "load", (PyCFunction)cmemcache_load, METH_VARARGS | METH_KEYWORDS,
+        "load(items, window=64, progress=None, progress_interval=10000) -- Bulk set.\n\n"
+        "Sets each (key, value[, flags[, time]]) tuple of the items iterable, values\n"
+        "must be strings. The sets are streamed to the servers on connections of their\n"
+        "own, with up to window sets in flight per server. Reading the items waits for\n"
+        "the servers when they can not keep up. progress(sent, stored) is called every\n"
+        "progress_interval items and at the end.\n"
+        "@return: (stored, failed) counts, see last_errors() for the failures.\n"
+    },
+
+    {
+        "dump", (PyCFunction)cmemcache_dump, METH_VARARGS | METH_KEYWORDS,
+        "dump(keys, path, time=0) -- Write the values of keys to a dump file.\n\n"
+        "The values are fetched with pipelined multi gets and written with their flags,\n"
+        "and time as the expire time, in a compact binary format, see restore().\n"
+        "@return: The number of values written.\n"
+    },
+
+    {
+        "restore", (PyCFunction)cmemcache_restore, METH_VARARGS | METH_KEYWORDS,
+        "restore(path, window=64) -- Set the values of a dump() file.\n\n"
+        "The file is memory mapped and its values are streamed to the servers like\n"
+        "load() does. Entries with an invalid key are skipped and counted as failed.\n"
+        "@return: (stored, failed) counts.\n"
+    },
+
+    {
+        "open_near_cache", (PyCFunction)cmemcache_open_near_cache,
+        METH_VARARGS | METH_KEYWORDS,
+        "open_near_cache(path, size=16<<20, slot_size=512, ttl=1.0, mode=0600) -- Cache\n"
+        "values in shared memory.\n\n"
+        "Values fetched by gets are kept for ttl seconds in the memory mapped file at\n"
+        "path, which is created with room for size bytes of slot_size slots and the\n"
+        "permissions mode when it does not exist. Gets look there first, so the\n"
+        "processes of a pre-fork server that open the same file share the values one of\n"
+        "them fetched. Values that do not fit in a slot are not cached. Stores, deletes\n"
+        "and flush_all() through a client with the file open invalidate its entries,\n"
+        "other writers are only seen after ttl.\n"
+    },
+
+    {
+        "close_near_cache", cmemcache_close_near_cache, METH_NOARGS,
+        "close_near_cache() -- Stop using the near cache file.\n"
+    },
+    
+    {
+        "open_write_behind", (PyCFunction)cmemcache_open_write_behind,
+        METH_VARARGS | METH_KEYWORDS,
+        "open_write_behind(size=4096, block=0) -- Send sets and deletes in the background.\n\n"
+        "set() and delete() put the command with noreply in a ring of size slots and return\n"
+        "without waiting for the server, a thread sends them in batches per server. When\n"
+        "the ring is full they are dropped, or with block set the caller waits for room (up\n"
+        "to its timeout). set() returns 1 if queued and 0 if dropped, delete() 0 and -1.\n"
+        "Errors of the thread are in last_errors(). Other commands are not queued, so a get\n"
+        "right after a set may not see the value yet, see flush_write_behind(). add(),\n"
+        "replace(), incr(), decr(), flush_all(), load() and restore() first wait until the\n"
+        "servers did the queued sets and deletes, so they are done in order. If their\n"
+        "timeout passes first they time out without being sent."
+    },
+
+    {
+        "flush_write_behind", (PyCFunction)cmemcache_flush_write_behind,
+        METH_VARARGS | METH_KEYWORDS,
+        "flush_write_behind(timeout=None) -- Wait until the queued sets and deletes are\n"
+        "done by the servers.\n\n"
+        "@return: 1 if they are, 0 if timeout passed first."
+    },
+
+    {
+        "close_write_behind", cmemcache_close_write_behind, METH_NOARGS,
+        "close_write_behind() -- Send the queued sets and deletes, stop the thread. Sets\n"
+        "and deletes wait for the servers again."
+    },
+    
+    {
+        "reweight", (PyCFunction)cmemcache_reweight, METH_VARARGS | METH_KEYWORDS,
+        "reweight(timeout=None) -- Set the server weights from their stats.\n\n"
+        "Each server gets a weight proportional to its limit_maxbytes, lowered (down to\n"
+        "half) when it evicted more per byte than the others since the previous\n"
+        "reweight, raised (up to twice) when it evicted less. The largest weight is 100.\n"
+        "Servers set with weight 0, and those that don't answer, keep their weight.\n"
+        "Changing the weights moves keys to other servers, like set_servers() does, so\n"
+        "the routing is only swapped when a weight changes. See reweight_interval.\n"
+        "@return: A list of the (\"server:port\", weight) of all servers.\n"
+    },
+
+    {
+        "get_stats", (PyCFunction)cmemcache_get_stats, METH_VARARGS | METH_KEYWORDS,
+        "get_stats(timeout=None) -- Get statistics from all servers.\n"
         "@return: A list of tuples ( server_identifier, stats_dictionary ).\n"
         "The dictionary contains a number of name/value pairs specifying\n"
         "the name of the status field and the string value associated with\n"
@@ -967,8 +6498,29 @@ static PyMethodDef cmemcache_methods[] = {
     },
     
     {
-        "flush_all", cmemcache_flush_all, METH_NOARGS,
-        "flush_all() -- flush all keys on all servers"
+        "last_errors", cmemcache_last_errors, METH_NOARGS,
+        "last_errors() -- The errors libmemcache reported since the previous call.\n\n"
+        "Errors do not raise exceptions unless raise_errors is set, calls return None\n"
+        "or 0 instead. Errors are collected per client, at most the last 32 are kept.\n"
+        "@return: A list of MemcachedConnectionError (with errno, MemcachedTimeoutError\n"
+        "for missed deadlines) and MemcachedServerError exceptions, all MemcachedError.\n"
+    },
+    
+    {
+        "get_client_stats", cmemcache_get_client_stats, METH_NOARGS,
+        "get_client_stats() -- Statistics of this client.\n"
+        "@return: A dictionary of counters: errors, fatal_errors (libmemcache would have\n"
+        "exited), errors_dropped (not in last_errors()), tombstone_hits, local_tombstones,\n"
+        "near_hits and near_misses (see open_near_cache()), batches and batched_gets\n"
+        "(see auto_batch), profiled_calls, released_time and gil_wait_time (see\n"
+        "profile), timeouts, reweights (see reweight()), intern_hits and intern_saved\n"
+        "(see intern_values), writes_queued, writes_dropped, writes_failed, write_depth\n"
+        "and max_write_depth (see open_write_behind())."
+    },
+    
+    {
+        "flush_all", (PyCFunction)cmemcache_flush_all, METH_VARARGS | METH_KEYWORDS,
+        "flush_all(timeout=None) -- flush all keys on all servers"
     },
     
     {
@@ -978,6 +6530,103 @@ static PyMethodDef cmemcache_methods[] = {
     {NULL}  /* Sentinel */
 };
 
+static PyMemberDef cmemcache_members[] = {
+    {
+        "raise_errors", T_INT, offsetof(CmemcacheObject, raiseErrors), 0,
+        "raise_errors -- if nonzero, a libmemcache error raises the MemcachedError of\n"
+        "last_errors() instead of returning None or 0."
+    },
+    {
+        "native", T_INT, offsetof(CmemcacheObject, native), 0,
+        "native -- if nonzero, send all commands over cmemcache's own connections\n"
+        "instead of libmemcache. Always on with unix domain socket servers\n"
+        "(\"unix:/path\" or \"/path\"), libmemcache only does TCP."
+    },
+    {
+        "tcp_nodelay", T_INT, offsetof(CmemcacheObject, tcpNoDelay), 0,
+        "tcp_nodelay -- set TCP_NODELAY on the native connections (default 1).\n"
+        "Like the other socket options it applies to new connections, see\n"
+        "disconnect_all()."
+    },
+    {
+        "keepalive", T_INT, offsetof(CmemcacheObject, keepAlive), 0,
+        "keepalive -- set SO_KEEPALIVE on the native TCP connections (default 1)."
+    },
+    {
+        "sndbuf", T_INT, offsetof(CmemcacheObject, sndBuf), 0,
+        "sndbuf -- SO_SNDBUF of the native connections, 0 (the default) leaves it\n"
+        "to the system."
+    },
+    {
+        "rcvbuf", T_INT, offsetof(CmemcacheObject, rcvBuf), 0,
+        "rcvbuf -- SO_RCVBUF of the native connections, 0 (the default) leaves it\n"
+        "to the system."
+    },
+    {
+        "tombstone_ttl", T_DOUBLE, offsetof(CmemcacheObject, tombstoneTtl), 0,
+        "tombstone_ttl -- seconds to keep tombstones in the client, so gets of those\n"
+        "keys don't go to the servers. 0 (the default) turns this off."
+    },
+    {
+        "auto_batch", T_INT, offsetof(CmemcacheObject, autoBatch), 0,
+        "auto_batch -- if nonzero, the client can be shared by threads and concurrent\n"
+        "get() calls are merged into multi gets of up to about this many keys. Only set\n"
+        "it while no other thread uses the client, and don't call set_servers() then."
+    },
+    {
+        "batch_window", T_INT, offsetof(CmemcacheObject, batchWindow), 0,
+        "batch_window -- microseconds a merged get waits for more gets (default 50)."
+    },
+    {
+        "profile", T_INT, offsetof(CmemcacheObject, profile), 0,
+        "profile -- if nonzero, count the seconds the calls run without the GIL, and\n"
+        "then wait to get it back, in get_client_stats()."
+    },
+    {
+        "timeout", T_DOUBLE, offsetof(CmemcacheObject, timeout), 0,
+        "timeout -- seconds each call may take, for calls without a timeout argument.\n"
+        "0 (the default) is none. Calls with a deadline use the native connections, and\n"
+        "when it passes return what they have so far (like a miss for gets, 0 for\n"
+        "stores) with timed_out set, see MemcachedTimeoutError."
+    },
+    {
+        "reweight_interval", T_DOUBLE, offsetof(CmemcacheObject, reweightInterval), 0,
+        "reweight_interval -- if nonzero, the first call after this many seconds does a\n"
+        "reweight() first, within timeout or else 1 second."
+    },
+    {
+        "reweight_threshold", T_DOUBLE, offsetof(CmemcacheObject, reweightThreshold), 0,
+        "reweight_threshold -- reweight() only changes the routing when the share of the\n"
+        "keys of a server moves by more than this, 0.05 by default. 0 changes it on any\n"
+        "new weight."
+    },
+    {
+        "intern_values", T_INT, offsetof(CmemcacheObject, internValues), 0,
+        "intern_values -- if nonzero, the gets of the same short str, int or long value\n"
+        "return the same object, from a table of about this many values. 0 (the default)\n"
+        "is off, see intern_hits and intern_saved in get_client_stats()."
+    },
+    {NULL}  /* Sentinel */
+};
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject*
+cmemcache_get_timed_out(PyObject* pyself, void* closure)
+{
+    return PyBool_FromLong(timedOutClient == (CmemcacheObject*)pyself);
+}
+
+static PyGetSetDef cmemcache_getset[] = {
+    {
+        "timed_out", cmemcache_get_timed_out, NULL,
+        "timed_out -- True if the last call of this thread missed its deadline, see\n"
+        "timeout.",
+        NULL
+    },
+    {NULL}  /* Sentinel */
+};
+
 static PyTypeObject cmemcache_CmemcacheType = {
     PyObject_HEAD_INIT(NULL)
     0,                         /*ob_size*/
@@ -1008,8 +6657,8 @@ static PyTypeObject cmemcache_CmemcacheType = {
     0,		               /* tp_iter */
     0,		               /* tp_iternext */
     cmemcache_methods,         /* tp_methods */
-    0,                         /* tp_members */
-    0,                         /* tp_getset */
+    cmemcache_members,         /* tp_members */
+    cmemcache_getset,          /* tp_getset */
     0,                         /* tp_base */
     0,                         /* tp_dict */
     0,                         /* tp_descr_get */
@@ -1021,6 +6670,19 @@ static PyTypeObject cmemcache_CmemcacheType = {
 };
 
 static PyMethodDef cmemcache_module_methods[] = {
+    {
+        "encode", cmemcache_encode, METH_O,
+        "encode(value) -- Encode value in the native format (stored with the native flag).\n\n"
+        "Handles None, bool, int, long, float, str, unicode, list, tuple and dict.\n"
+        "@raise TypeError: for any other type, including subclasses of those types."
+    },
+    
+    {
+        "decode", cmemcache_decode, METH_VARARGS,
+        "decode(buf) -- Decode a value created by encode().\n\n"
+        "@raise ValueError: if buf is not a valid native value."
+    },
+    
     {NULL}  /* Sentinel */
 };
 
@@ -1031,16 +6693,71 @@ PyMODINIT_FUNC
 init_cmemcache(void) 
 {
     PyObject* m;
+    PyObject* bases;
 
     debug(("init_cmemcache\n"));
     
     cmemcache_CmemcacheType.tp_new = PyType_GenericNew;
     if (PyType_Ready(&cmemcache_CmemcacheType) < 0)
         return;
+    if (PyType_Ready(&GetMultiIteratorType) < 0)
+        return;
 
     m = Py_InitModule3("_cmemcache", cmemcache_module_methods,
                        "Extension to memcached using libmemcache.");
 
+    /* libmemcache errors, see last_errors() */
+    MemcachedError = PyErr_NewException("_cmemcache.MemcachedError", NULL, NULL);
+    bases = Py_BuildValue("(OO)", MemcachedError, PyExc_IOError);
+    MemcachedConnectionError = PyErr_NewException("_cmemcache.MemcachedConnectionError",
+                                                  bases, NULL);
+    Py_XDECREF(bases);
+    MemcachedTimeoutError = PyErr_NewException("_cmemcache.MemcachedTimeoutError",
+                                               MemcachedConnectionError, NULL);
+    MemcachedServerError = PyErr_NewException("_cmemcache.MemcachedServerError",
+                                              MemcachedError, NULL);
+    
+    /* python-memcache compatible key exceptions, also available on StringClient */
+    MemcachedKeyError = PyErr_NewException("_cmemcache.MemcachedKeyError", NULL, NULL);
+    MemcachedKeyLengthError = PyErr_NewException("_cmemcache.MemcachedKeyLengthError",
+                                                 MemcachedKeyError, NULL);
+    MemcachedKeyCharacterError = PyErr_NewException(
+        "_cmemcache.MemcachedKeyCharacterError", MemcachedKeyError, NULL);
+    MemcachedKeyNoneError = PyErr_NewException("_cmemcache.MemcachedKeyNoneError",
+                                               MemcachedKeyError, NULL);
+    /* used to be a TypeError, so keep it one */
+    bases = Py_BuildValue("(OO)", MemcachedKeyError, PyExc_TypeError);
+    MemcachedKeyTypeError = PyErr_NewException("_cmemcache.MemcachedKeyTypeError",
+                                               bases, NULL);
+    Py_XDECREF(bases);
+    
+#define ADD_EXCEPTION(name)                                                     \
+    if (name)                                                                   \
+    {                                                                           \
+        Py_INCREF(name);                                                        \
+        PyModule_AddObject(m, #name, name);                                     \
+        PyDict_SetItemString(cmemcache_CmemcacheType.tp_dict, #name, name);     \
+    }
+    ADD_EXCEPTION(MemcachedError);
+    ADD_EXCEPTION(MemcachedConnectionError);
+    ADD_EXCEPTION(MemcachedTimeoutError);
+    ADD_EXCEPTION(MemcachedServerError);
+    ADD_EXCEPTION(MemcachedKeyError);
+    ADD_EXCEPTION(MemcachedKeyLengthError);
+    ADD_EXCEPTION(MemcachedKeyCharacterError);
+    ADD_EXCEPTION(MemcachedKeyNoneError);
+    ADD_EXCEPTION(MemcachedKeyTypeError);
+#undef ADD_EXCEPTION
+
+    /* the sentinel of set_tombstone(), compare with "is" */
+    Tombstone = PyObject_CallObject((PyObject*)&PyBaseObject_Type, NULL);
+    if (Tombstone)
+    {
+        Py_INCREF(Tombstone);
+        PyModule_AddObject(m, "TOMBSTONE", Tombstone);
+        PyDict_SetItemString(cmemcache_CmemcacheType.tp_dict, "TOMBSTONE", Tombstone);
+    }
+
     picklemodule = PyImport_ImportModule("cPickle");
     if (!picklemodule) {
         PyErr_Clear();
@@ -161,8 +161,11 @@ class memcachestor(store):
         # self.mc.flush_all()
 
     def setup(self, nv):
-        for n, v in nv.iteritems():
-            self.mc.set(n, v)
+        if hasattr(self.mc, 'load'):
+            self.mc.load(nv.iteritems())
+        else:
+            for n, v in nv.iteritems():
+                self.mc.set(n, v)
 
     def teardown(self, nv):
         for n in nv.iterkeys():
@@ -182,7 +185,7 @@ class memcachestor(store):
         memcache object not thread safe, return a new one for each thread.
         """
         # there is no state, so just return a fresh instance
-        return memcachedstor(self.module, self.name)
+        return memcachestor(self.module)
 
 #-----------------------------------------------------------------------------------------
 #
@@ -207,6 +210,10 @@ class test(object):
     """
     Test base class.
     """
+
+    # gets per name,value pair
+    numruns = 1
+
     def __init__(self, opts):
         self.opts = opts
 
@@ -323,6 +330,7 @@ class threadtest(test):
         test.__init__(self, opts)
         self.t = t
         self.name = 'thread-' + self.t.name
+        self.numruns = opts.threads * t.numruns
 
     def run( self, store, nv ):
 
@@ -370,7 +378,8 @@ def main():
 
     parser.add_option('-t', '--threads', action='store', type='int',
                       default=10,
-                      help="Number of threads to run." )
+                      help="Number of threads of the thread test, see scaling.py for "
+                      "more." )
     parser.add_option('-w', '--writeratio', action='store', type='float',
                       default=0.25,
                       help="Ratio of write:read actions." )
@@ -422,16 +431,15 @@ def main():
              seqnotesttest(opts),
              seqrndwrttest(opts),
              rndtest(opts, nv, random.seed(12)),
-             rndmultitest(opts, nv, random.seed(12))
-             #,
-             # threaded test does not tell us anything new:
-             # threadtest(opts, seqtest(opts))
+             rndmultitest(opts, nv, random.seed(12)),
+             threadtest(opts, seqtest(opts))
              ]
     stats = {}
     for t in tests:
         lstats = {}
         for s in stors:
-            print 'Doing %d iterations of %s with %s' % (opts.numpairs, t.name, s.name)
+            print 'Doing %d iterations of %s with %s' % (opts.numpairs * t.numruns,
+                                                         t.name, s.name)
             
             # reset random so they all do the same thing
             random.seed(12)
@@ -440,7 +448,7 @@ def main():
             t1 = time.time()
             lstats[s] = t1-t0
             print 'time elapsed ', t1-t0
-            print 'per get      ', (t1-t0)/opts.numpairs
+            print 'per get      ', (t1-t0)/(opts.numpairs * t.numruns)
         stats[t] = lstats
 
     for s in stors:
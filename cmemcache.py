@@ -50,14 +50,13 @@ More detailed documentation is available in the L{Client} and L{StringClient} cl
 __version__ = "$Revision$"
 __author__ = "$Author$"
 
-import traceback
 import types
 try:
     import cPickle as pickle
 except ImportError:
     import pickle
 
-from _cmemcache import StringClient
+from _cmemcache import StringClient, encode, decode, TOMBSTONE
 
 #-----------------------------------------------------------------------------------------
 #
@@ -72,34 +71,101 @@ def stderrlog(str):
 # To get any output one must create a Client(..., debug=1)
 log = stderrlog
 
+#-----------------------------------------------------------------------------------------
+#
+def readSetCommands(f):
+    """
+    Generate the (key, value, flags, time) tuples of a file of memcached protocol
+    "set <key> <flags> <exptime> <bytes>" commands, as used by L{Client.load}.
+    """
+    while True:
+        line = f.readline()
+        if not line:
+            break
+        parts = line.split()
+        if not parts:
+            continue
+        if len(parts) < 5 or parts[0] != 'set':
+            raise ValueError('expected a "set" command, got %r' % line)
+        size = int(parts[4])
+        value = f.read(size + 2)
+        if len(value) != size + 2 or value[size:] != '\r\n':
+            raise ValueError('bad data block for key %r' % parts[1])
+        yield (parts[1], value[:size], int(parts[2]), int(parts[3]))
+
 #-----------------------------------------------------------------------------------------
 #
 class Client(StringClient):
     """
     Use memcached flags parameter to set/add/replace to handle any python class as
     the cache value. Also does int, long conversion to/from string.
+
+    Values that are not str, int or long are serialized with pickle by default. Pass
+    C{serializer=Client._FLAG_NATIVE} to use the much faster native encoding for
+    None, bool, float, unicode, list, tuple and dict values (falls back to pickle for
+    other types), or register your own with L{register_serializer}. Note that
+    python-memcache clients can only read pickled values.
     """
 
     _FLAG_PICKLE  = 1<<0
     _FLAG_INTEGER = 1<<1
     _FLAG_LONG    = 1<<2
+    _FLAG_NATIVE  = 1<<3
+    _FLAG_TOMBSTONE = 1<<4
+
+    _FLAGS_BUILTIN = (_FLAG_PICKLE | _FLAG_INTEGER | _FLAG_LONG | _FLAG_NATIVE |
+                      _FLAG_TOMBSTONE)
 
-    def __init__(self, servers, debug=0):
+    def __init__(self, servers, debug=0, serializer=_FLAG_PICKLE):
         """
         Create a new Client object with the given list of servers.
 
         @param servers: C{servers} is passed to L{set_servers}.
         @param debug: whether to display error messages when a server can't be
         contacted. (A lot less verbose than memcache.py).
+        @param serializer: flags of the serializer used for values that are not str,
+        int or long, see L{set_serializer}.
         """
         StringClient.__init__(self, servers)
         self.debug = debug
+        # share the objects of repeated short str, int and long values
+        self.intern_values = 4096
+        # flags -> dumps, and flags -> loads for the registered serializers
+        self._dumps = {}
+        self._loads = {}
+        self.set_serializer(serializer)
+
+    def register_serializer(self, flags, dumps, loads):
+        """
+        Register a serializer, values it created are recognized by their flags.
+
+        @param flags: the memcached flags to store values with, must not overlap with
+        the cmemcache flags (L{_FLAGS_BUILTIN}).
+        @param dumps: function converting a value to a str.
+        @param loads: function converting a str created by dumps back to a value.
+        """
+        if flags & Client._FLAGS_BUILTIN or flags <= 0 or flags > 0xFFFF:
+            raise ValueError("serializer flags %x not available" % flags)
+        self._dumps[flags] = dumps
+        self._loads[flags] = loads
+
+    def set_serializer(self, flags):
+        """
+        Select the serializer used for values that are not str, int or long.
+
+        @param flags: L{_FLAG_PICKLE}, L{_FLAG_NATIVE}, or the flags of a serializer
+        added with L{register_serializer}.
+        """
+        if flags not in (Client._FLAG_PICKLE, Client._FLAG_NATIVE) and \
+               flags not in self._dumps:
+            raise ValueError("unknown serializer flags %x" % flags)
+        self.serializer = flags
     
     def _convert(self, val):
         """
         Convert val to str, flags tuple.
         """
-        # unicode strings are handled through pickle
+        # unicode strings are handled through the serializer
         if isinstance(val, str):
             flags = 0
         elif isinstance(val, int):
@@ -109,11 +175,19 @@ class Client(StringClient):
             flags = Client._FLAG_LONG
             val = "%d" % val
         else:
-            flags = Client._FLAG_PICKLE
-            val = pickle.dumps(val, 2)
+            flags = self.serializer
+            if flags == Client._FLAG_NATIVE:
+                try:
+                    val = encode(val)
+                except TypeError:
+                    flags = Client._FLAG_PICKLE
+            elif flags != Client._FLAG_PICKLE:
+                val = self._dumps[flags](val)
+            if flags == Client._FLAG_PICKLE:
+                val = pickle.dumps(val, 2)
         return (val, flags)
 
-    def set(self, key, val, time=0):
+    def set(self, key, val, time=0, timeout=None):
         """
         Unconditionally sets a key to a given value in the memcache.
 
@@ -123,13 +197,14 @@ class Client(StringClient):
         same memcache server, so you could use the user's unique id as the hash
         value.
 
+        @param timeout: seconds the call may take, None for the client L{timeout}.
         @return: Nonzero on success.
         @rtype: int
         """
         val, flags = self._convert(val)
-        return StringClient.set(self, key, val, time, flags)
+        return StringClient.set(self, key, val, time, flags, timeout)
 
-    def add(self, key, val, time=0):
+    def add(self, key, val, time=0, timeout=None):
         """
         Add new key with value.
         
@@ -139,9 +214,9 @@ class Client(StringClient):
         @rtype: int
         """
         val, flags = self._convert(val)
-        return StringClient.add(self, key, val, time, flags)
+        return StringClient.add(self, key, val, time, flags, timeout)
 
-    def replace(self, key, val, time=0):
+    def replace(self, key, val, time=0, timeout=None):
         """
         Replace existing key with value.
         
@@ -152,43 +227,75 @@ class Client(StringClient):
         @rtype: int
         """
         val, flags = self._convert(val)
-        return StringClient.replace(self, key, val, time, flags)
+        return StringClient.replace(self, key, val, time, flags, timeout)
 
-    def get(self, key):
+    def get(self, key, timeout=None):
         """
         Retrieves a key from the memcache.
         
-        @return: The value or None if key doesn't exist (or if there are decoding errors).
-        """
-        val = StringClient.getflags(self, key)
-        if val:
-            buf, flags = val
-            if flags == 0:
-                val = buf
-            elif flags & Client._FLAG_INTEGER:
-                val = int(buf)
-            elif flags & Client._FLAG_LONG:
-                val = long(buf)
-            elif flags & Client._FLAG_PICKLE:
-                try:
-                    val = pickle.loads(buf)
-                except:
-                    self.debuglog('Pickle error...\n%s' % traceback.format_exc())
-                    val = None
-            else:
-                self.debuglog("unknown flags on get: %x\n" % flags)
-                val = None
-
-        return val
+        @param timeout: seconds the call may take, None for the client L{timeout}. When
+        it passes, None is returned and L{timed_out} is set.
+        @return: The value or None if key doesn't exist (or if there are decoding errors),
+        TOMBSTONE if it was stored with L{set_tombstone}.
+        """
+        return StringClient.get(self, key, timeout, self._loads)
         
-    def get_multi(self, keys):
+    def get_multi(self, keys, timeout=None):
         """
         Retrieves multiple keys from the memcache doing just one query. Will use the flags
         of each entry to create the proper types (see get() and _convert()).
 
+        @param timeout: seconds the call may take, None for the client L{timeout}. When
+        it passes, the values that arrived are returned and L{timed_out} is set.
         @return:  A dictionary of key/value pairs that were available.
         """
-        return StringClient.get_multiflags(self, keys)
+        return StringClient.get_multiflags(self, keys, self._loads, timeout)
+
+    def iter_get_multi(self, keys, batch_size=1000, timeout=None):
+        """
+        Like get_multi(), but an iterator of the (key, val) pairs that were available.
+        The keys are read and fetched batch_size at a time, the next batch is in flight
+        while the pairs of the current one are yielded.
+
+        @param timeout: seconds each batch may take, None for the client L{timeout}.
+        """
+        return StringClient.iter_get_multi(self, keys, batch_size, self._loads, timeout)
+
+    def load(self, source, time=0, window=64, progress=None, progress_interval=10000):
+        """
+        Bulk set of (key, val[, flags[, time]]) items from an iterable, like
+        L{StringClient.load}, or of the "set" commands in a file or path (see
+        L{readSetCommands}, those values are stored as is). The flags of an item are
+        added to the ones of its serializer, time is the default expire time of the
+        items without one.
+
+        The sets are streamed to the servers with up to window sets in flight per
+        server, see L{StringClient.load}.
+
+        @return: (stored, failed) counts.
+        """
+        if isinstance(source, basestring):
+            f = open(source, 'rb')
+            try:
+                return StringClient.load(self, readSetCommands(f), window, progress,
+                                         progress_interval)
+            finally:
+                f.close()
+        if hasattr(source, 'readline'):
+            items = readSetCommands(source)
+        else:
+            items = self._convertItems(source, time)
+        return StringClient.load(self, items, window, progress, progress_interval)
+
+    def _convertItems(self, items, time):
+        for item in items:
+            val, flags = self._convert(item[1])
+            exptime = time
+            if len(item) > 2:
+                flags |= item[2]
+            if len(item) > 3:
+                exptime = item[3]
+            yield (item[0], val, flags, exptime)
 
     def debuglog(self, str):
         if self.debug:
@@ -0,0 +1,366 @@
+#!/usr/bin/env python
+#
+# $Id$
+#
+
+"""
+A stand-in memcached that injects faults, for the tests and benchmarks of cmemcache.
+Speaks the text protocol (get, gets, set, add, replace, append, prepend, cas, delete,
+incr, decr, stats, flush_all, version, verbosity, quit) from an in-memory dict, and on
+request: waits before each reply, drops connections, writes replies in pieces, reads
+requests slowly, or disconnects in the middle of a reply.
+
+Use it from python with FakeMemcached, or run it like memcached:
+
+    fakememcached.py -p 11311 --faults latency=0.001,cut=0.01
+"""
+
+import errno
+import os
+import random
+import socket
+import SocketServer
+import threading
+import time
+
+__version__ = "$Revision$"
+__author__ = "$Author$"
+
+FAULTS = ('latency', 'drop', 'partial', 'slow_read', 'chunk_delay', 'cut')
+
+#-----------------------------------------------------------------------------------------
+#
+def parseFaults(spec):
+    """
+    Parse a 'name=value,...' fault specification (see L{Faults}) to a dictionary.
+    """
+    faults = {}
+    for item in spec.split(','):
+        if not item.strip():
+            continue
+        name, sep, value = item.partition('=')
+        name = name.strip().replace('-', '_')
+        if name not in FAULTS or not sep:
+            raise ValueError('bad fault %r, expected one of %s=<value>' %
+                             (item, ', '.join(FAULTS)))
+        faults[name] = float(value)
+    return faults
+
+#-----------------------------------------------------------------------------------------
+#
+class Faults(object):
+    """
+    The faults of a FakeMemcached, change them at any time with L{FakeMemcached.set_faults}.
+    """
+
+    latency = 0.0       # seconds to wait before each reply
+    drop = 0.0          # probability that a command closes the connection unanswered
+    partial = 0         # write replies in pieces of this many bytes, 0 is at once
+    slow_read = 0       # read requests this many bytes at a time, 0 is at once
+    chunk_delay = 0.001 # seconds between the pieces of partial and slow_read
+    cut = 0.0           # probability that a reply is cut off halfway by a disconnect
+
+    def __init__(self, **faults):
+        for name, value in faults.items():
+            if name not in FAULTS:
+                raise ValueError('unknown fault %r' % name)
+            setattr(self, name, value)
+
+#-----------------------------------------------------------------------------------------
+#
+class Disconnect(Exception):
+    """
+    Raised to close the connection.
+    """
+
+#-----------------------------------------------------------------------------------------
+#
+class Handler(SocketServer.BaseRequestHandler):
+    """
+    One client connection.
+    """
+
+    def setup(self):
+        self.fake = self.server.fake
+        self.buf = ''
+        if self.request.family == socket.AF_INET:
+            # partial replies are paced by chunk_delay, not by Nagle
+            self.request.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.fake.connected(self.request)
+
+    def finish(self):
+        self.fake.disconnected(self.request)
+
+    def readline(self):
+        while True:
+            eol = self.buf.find('\r\n')
+            if eol >= 0:
+                line = self.buf[:eol]
+                self.buf = self.buf[eol + 2:]
+                return line
+            self.fill()
+
+    def read(self, size):
+        while len(self.buf) < size:
+            self.fill()
+        data = self.buf[:size]
+        self.buf = self.buf[size:]
+        return data
+
+    def fill(self):
+        faults = self.fake.faults
+        if faults.slow_read:
+            time.sleep(faults.chunk_delay)
+        data = self.request.recv(int(faults.slow_read) or 65536)
+        if not data:
+            raise Disconnect()
+        self.buf += data
+
+    def reply(self, data):
+        faults = self.fake.faults
+        if faults.latency:
+            time.sleep(faults.latency)
+        if faults.cut and self.fake.random.random() < faults.cut:
+            self.fake.count('cuts')
+            self.request.sendall(data[:len(data) // 2])
+            raise Disconnect()
+        piece = int(faults.partial)
+        if not piece:
+            self.request.sendall(data)
+            return
+        for i in xrange(0, len(data), piece):
+            if i:
+                time.sleep(faults.chunk_delay)
+            self.request.sendall(data[i:i + piece])
+
+    def handle(self):
+        try:
+            while True:
+                line = self.readline()
+                parts = line.split()
+                if not parts:
+                    continue
+                # storage commands first read the data block, then decide to drop
+                data = None
+                if parts[0] in ('set', 'add', 'replace', 'append', 'prepend', 'cas'):
+                    if len(parts) < 5 or not parts[4].isdigit():
+                        self.reply('CLIENT_ERROR bad command line format\r\n')
+                        continue
+                    data = self.read(int(parts[4]) + 2)[:-2]
+                self.fake.count('commands')
+                faults = self.fake.faults
+                if faults.drop and self.fake.random.random() < faults.drop:
+                    self.fake.count('drops')
+                    return
+                if parts[0] == 'quit':
+                    return
+                noreply = parts[-1] == 'noreply'
+                result = self.fake.execute(parts, data)
+                if not noreply:
+                    self.reply(result)
+        except Disconnect:
+            pass
+        except socket.error, e:
+            if e.args[0] not in (errno.ECONNRESET, errno.EPIPE, errno.EBADF):
+                raise
+
+#-----------------------------------------------------------------------------------------
+#
+class TCPServer(SocketServer.ThreadingMixIn, SocketServer.TCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+#-----------------------------------------------------------------------------------------
+#
+class UnixServer(SocketServer.ThreadingMixIn, SocketServer.UnixStreamServer):
+    daemon_threads = True
+
+#-----------------------------------------------------------------------------------------
+#
+class FakeMemcached(object):
+    """
+    A stand-in memcached in a thread of this process.
+
+    @ivar address: the server to pass to cmemcache, 'host:port' or the unix socket path.
+    @ivar faults: the current L{Faults}.
+    @ivar counts: dictionary of the commands, drops and cuts so far.
+    """
+
+    def __init__(self, address='127.0.0.1:0', seed=None, **faults):
+        """
+        @param address: 'host:port' to listen on (port 0 picks a free one), or a unix
+        socket path.
+        @param seed: seed of the random drops and cuts, for reproducible runs.
+        @param faults: the initial L{Faults}.
+        """
+        self.faults = Faults(**faults)
+        self.random = random.Random(seed)
+        self.store = {}
+        self.counts = {'commands': 0, 'drops': 0, 'cuts': 0}
+        self.nextCas = 1
+        self.lock = threading.Lock()
+        self.conns = set()
+        self.thread = None
+        self.server = None
+        self.bind(address)
+
+    def bind(self, address):
+        if address.startswith('/'):
+            if os.path.exists(address):
+                os.remove(address)
+            self.server = UnixServer(address, Handler)
+            self.address = address
+        else:
+            host, port = address.rsplit(':', 1)
+            self.server = TCPServer((host, int(port)), Handler)
+            self.address = '%s:%d' % self.server.server_address[:2]
+        self.server.fake = self
+
+    def connected(self, sock):
+        with self.lock:
+            self.conns.add(sock)
+
+    def disconnected(self, sock):
+        with self.lock:
+            self.conns.discard(sock)
+
+    def set_faults(self, **faults):
+        """
+        Replace the faults, the ones not given are off.
+        """
+        self.faults = Faults(**faults)
+
+    def count(self, name):
+        with self.lock:
+            self.counts[name] += 1
+
+    def start(self):
+        """
+        Serve in a daemon thread.
+        """
+        if self.server is None:
+            self.bind(self.address)
+        self.thread = threading.Thread(target=self.server.serve_forever,
+                                       kwargs={'poll_interval': 0.05})
+        self.thread.setDaemon(True)
+        self.thread.start()
+
+    def stop(self):
+        """
+        Stop listening and close all connections, like a killed memcached. The store is
+        kept, start() again serves it on the same address.
+        """
+        if self.server is None:
+            return
+        self.server.shutdown()
+        self.server.server_close()
+        self.server = None
+        with self.lock:
+            conns = list(self.conns)
+        for sock in conns:
+            try:
+                sock.shutdown(socket.SHUT_RDWR)
+            except socket.error:
+                pass
+        self.thread.join()
+
+    def execute(self, parts, data):
+        """
+        The reply to a command.
+        """
+        with self.lock:
+            return self._execute(parts[0], parts[1:], data)
+
+    def _execute(self, cmd, args, data):
+        store = self.store
+        if cmd in ('get', 'gets'):
+            out = []
+            for key in args:
+                if key in store:
+                    flags, value, cas = store[key]
+                    out.append('VALUE %s %d %d%s\r\n%s\r\n' %
+                               (key, flags, len(value),
+                                cmd == 'gets' and ' %d' % cas or '', value))
+            out.append('END\r\n')
+            return ''.join(out)
+        if data is not None:
+            key, flags = args[0], int(args[1])
+            if cmd == 'add' and key in store or \
+                   cmd in ('replace', 'append', 'prepend') and key not in store:
+                return 'NOT_STORED\r\n'
+            if cmd == 'cas':
+                if key not in store:
+                    return 'NOT_FOUND\r\n'
+                if store[key][2] != int(args[4]):
+                    return 'EXISTS\r\n'
+            if cmd == 'append':
+                flags, data = store[key][0], store[key][1] + data
+            elif cmd == 'prepend':
+                flags, data = store[key][0], data + store[key][1]
+            store[key] = (flags, data, self.nextCas)
+            self.nextCas += 1
+            return 'STORED\r\n'
+        if cmd == 'delete':
+            return store.pop(args[0], None) and 'DELETED\r\n' or 'NOT_FOUND\r\n'
+        if cmd in ('incr', 'decr'):
+            if args[0] not in store:
+                return 'NOT_FOUND\r\n'
+            flags, value, cas = store[args[0]]
+            try:
+                value = long(value)
+            except ValueError:
+                return 'CLIENT_ERROR cannot increment or decrement non-numeric value\r\n'
+            if cmd == 'incr':
+                value = (value + long(args[1])) & 0xFFFFFFFFFFFFFFFF
+            else:
+                value = max(value - long(args[1]), 0)
+            store[args[0]] = (flags, str(value), self.nextCas)
+            self.nextCas += 1
+            return '%d\r\n' % value
+        if cmd == 'stats':
+            stats = [('pid', os.getpid()), ('curr_items', len(store)),
+                     ('total_items', self.nextCas - 1),
+                     ('bytes', sum(len(v[1]) for v in store.values())),
+                     ('limit_maxbytes', 64 << 20), ('evictions', 0),
+                     ('bytes_read', 0), ('bytes_written', 0)]
+            return ''.join('STAT %s %s\r\n' % stat for stat in stats) + 'END\r\n'
+        if cmd == 'flush_all':
+            store.clear()
+            return 'OK\r\n'
+        if cmd == 'version':
+            return 'VERSION 1.4.0-fake\r\n'
+        if cmd == 'verbosity':
+            return 'OK\r\n'
+        return 'ERROR\r\n'
+
+#-------------------------------------------------------------------------------
+#
+def main():
+    import optparse
+    parser = optparse.OptionParser(__doc__.strip())
+    parser.add_option('-p', '--port', action='store', type='int', default=11211,
+                      help="TCP port to listen on." )
+    parser.add_option('-l', '--listen', action='store', default='127.0.0.1',
+                      help="Interface to listen on." )
+    parser.add_option('-s', '--socket', action='store',
+                      help="Unix socket path to listen on instead." )
+    parser.add_option('-m', '--memory', action='store', type='int',
+                      help="Ignored, for the memcached command line." )
+    parser.add_option('-f', '--faults', action='store', default='',
+                      help="Comma separated name=value faults, names: %s." %
+                      ', '.join(FAULTS))
+    parser.add_option('--seed', action='store', type='int',
+                      help="Seed of the random drops and cuts." )
+    opts, args = parser.parse_args()
+
+    server = FakeMemcached(opts.socket or '%s:%d' % (opts.listen, opts.port),
+                           opts.seed, **parseFaults(opts.faults))
+    server.start()
+    try:
+        while server.thread.isAlive():
+            server.thread.join(1)
+    except KeyboardInterrupt:
+        server.stop()
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,231 @@
+#!/usr/bin/env python
+#
+# $Id$
+#
+
+"""
+Measure how cmemcache scales with threads and servers. Starts memcached servers on
+consecutive ports, and for each number of servers and threads does get, get_multi and
+set in all threads at once. Prints a table of the throughput, latency and GIL profile
+(seconds per operation with the GIL held, released, and waiting to get it back) of each
+operation type. Write the table of a release with -o and compare with it later with -c.
+With -f the servers are fakememcached.py stand-ins with those faults, the table then has
+the throughput and tail latency under each fault.
+"""
+
+import cmemcache
+import os
+import signal
+import subprocess
+import sys
+import threading
+import time
+
+__version__ = "$Revision$"
+__author__ = "$Author$"
+
+OPS = ('get', 'get_multi', 'set')
+COLUMNS = ('op', 'servers', 'threads', 'ops/s', 'avg_ms', 'p99_ms', 'held_us',
+           'released_us', 'gil_wait_us', 'fault')
+
+#-----------------------------------------------------------------------------------------
+#
+def intList(s):
+    return [int(i) for i in s.split(',')]
+
+#-----------------------------------------------------------------------------------------
+#
+def startServers(opts, n, faults):
+    """
+    Start n memcached, or fakememcached.py with faults, return the processes and their
+    addresses.
+    """
+    procs = []
+    servers = []
+    for i in xrange(n):
+        port = opts.port + i
+        if faults:
+            fake = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                'fakememcached.py')
+            cmd = [sys.executable, fake, '--faults', faults, '--seed', str(port)]
+        else:
+            cmd = [opts.memcached, '-m', '64']
+        procs.append(subprocess.Popen(cmd + ['-p', str(port)]))
+        servers.append('127.0.0.1:%d' % port)
+    time.sleep(0.5)
+    return procs, servers
+
+#-----------------------------------------------------------------------------------------
+#
+def stopServers(procs):
+    for proc in procs:
+        os.kill(proc.pid, signal.SIGINT)
+        proc.wait()
+
+#-----------------------------------------------------------------------------------------
+#
+class Worker(threading.Thread):
+    """
+    Do opts.number operations of one type, timing each one.
+    """
+
+    def __init__(self, opts, mc, op, keys, value, start):
+        threading.Thread.__init__(self)
+        self.opts = opts
+        self.mc = mc
+        self.op = op
+        self.keys = keys
+        self.value = value
+        self.start_ = start
+        self.latencies = []
+
+    def run(self):
+        mc = self.mc
+        keys = self.keys
+        nkeys = len(keys)
+        multi = self.opts.multi
+        latencies = self.latencies
+        clock = time.time
+        self.start_.wait()
+        for i in xrange(self.opts.number):
+            k = i % nkeys
+            t0 = clock()
+            if self.op == 'get':
+                mc.get(keys[k])
+            elif self.op == 'get_multi':
+                mc.get_multi(keys[k:k + multi])
+            else:
+                mc.set(keys[k], self.value)
+            latencies.append(clock() - t0)
+
+#-----------------------------------------------------------------------------------------
+#
+def measure(opts, servers, op, nthreads, keys, value, fault):
+    """
+    Run op in nthreads threads at once, return a row of the table.
+    """
+    if opts.shared:
+        mc = cmemcache.StringClient(servers)
+        mc.auto_batch = opts.shared
+        clients = [mc] * nthreads
+    else:
+        clients = [cmemcache.StringClient(servers) for i in xrange(nthreads)]
+    for mc in clients:
+        mc.profile = 1
+        mc.native = opts.native
+
+    start = threading.Event()
+    workers = [Worker(opts, mc, op, keys, value, start) for mc in clients]
+    for w in workers:
+        w.start()
+    t0 = time.time()
+    start.set()
+    for w in workers:
+        w.join()
+    elapsed = time.time() - t0
+
+    latencies = sorted(l for w in workers for l in w.latencies)
+    n = len(latencies)
+    released = gilWait = 0.0
+    for mc in set(clients):
+        stats = mc.get_client_stats()
+        released += stats['released_time']
+        gilWait += stats['gil_wait_time']
+    avg = sum(latencies) / n
+    held = max(avg - (released + gilWait) / n, 0)
+    return (op, len(servers), nthreads, n / elapsed, avg * 1e3,
+            latencies[int(n * 0.99)] * 1e3, held * 1e6, released / n * 1e6,
+            gilWait / n * 1e6, fault)
+
+#-----------------------------------------------------------------------------------------
+#
+def formatRow(row):
+    return '%-10s %7s %7s %10s %8s %8s %8s %11s %11s  %s' % tuple(
+        isinstance(c, float) and '%.*f' % (c < 100 and 3 or 0, c) or c for c in row)
+
+#-----------------------------------------------------------------------------------------
+#
+def readTable(path):
+    """
+    Read a table written with -o, keyed by (op, servers, threads, fault).
+    """
+    table = {}
+    for line in open(path):
+        cols = line.split()
+        if cols and cols[0] in OPS:
+            table[rowKey(cols)] = [float(c) for c in cols[3:9]]
+    return table
+
+#-----------------------------------------------------------------------------------------
+#
+def rowKey(cols):
+    # tables of before the fault column are without faults
+    return tuple(cols[:3] + (cols[9:10] or ['-']))
+
+#-------------------------------------------------------------------------------
+#
+def main():
+    import optparse
+    parser = optparse.OptionParser(__doc__.strip())
+    parser.add_option('-t', '--threads', action='store', type='string',
+                      default='1,2,4,8,16,32,64',
+                      help="Comma separated numbers of threads." )
+    parser.add_option('-s', '--servers', action='store', type='string',
+                      default='1,2,4,8,16',
+                      help="Comma separated numbers of servers." )
+    parser.add_option('-n', '--number', action='store', type='int', default=2000,
+                      help="Operations per thread." )
+    parser.add_option('-k', '--keys', action='store', type='int', default=10000,
+                      help="Number of keys." )
+    parser.add_option('-v', '--valuesize', action='store', type='int', default=100,
+                      help="Value size." )
+    parser.add_option('-m', '--multi', action='store', type='int', default=10,
+                      help="Keys per get_multi." )
+    parser.add_option('--shared', action='store', type='int', default=0,
+                      help="Share one client between the threads with this auto_batch." )
+    parser.add_option('--native', action='store', type='int', default=0,
+                      help="Use the native connections instead of libmemcache." )
+    parser.add_option('-p', '--port', action='store', type='int', default=22122,
+                      help="Port of the first memcached." )
+    parser.add_option('--memcached', action='store', default='memcached',
+                      help="The memcached to start." )
+    parser.add_option('-f', '--faults', action='append',
+                      help="Start fakememcached.py with these faults instead, like "
+                      "latency=0.001,drop=0.01. Repeat to measure several." )
+    parser.add_option('-o', '--output', action='store',
+                      help="Also write the table to this file." )
+    parser.add_option('-c', '--compare', action='store',
+                      help="Compare the throughput with a table written with -o." )
+    opts, args = parser.parse_args()
+
+    baseline = opts.compare and readTable(opts.compare)
+    out = opts.output and open(opts.output, 'w')
+    header = formatRow(COLUMNS) + (baseline and '   vs base' or '')
+    print header
+    if out:
+        out.write(formatRow(COLUMNS) + '\n')
+
+    keys = ['scale%d' % i for i in xrange(opts.keys)]
+    value = 'v' * opts.valuesize
+    for faults in opts.faults or [None]:
+        for nservers in intList(opts.servers):
+            procs, servers = startServers(opts, nservers, faults)
+            try:
+                cmemcache.StringClient(servers).load((k, value) for k in keys)
+                for op in OPS:
+                    for nthreads in intList(opts.threads):
+                        row = measure(opts, servers, op, nthreads, keys, value,
+                                      faults or '-')
+                        line = formatRow(row)
+                        if out:
+                            out.write(line + '\n')
+                            out.flush()
+                        base = baseline and baseline.get(rowKey(line.split()))
+                        if base:
+                            line += '   %8.2f' % (row[3] / base[0])
+                        print line
+            finally:
+                stopServers(procs)
+
+if __name__ == '__main__':
+    main()
@@ -11,7 +11,7 @@ Test for cmemcache module.
 __version__ = "$Revision$"
 __author__ = "$Author$"
 
-import os, signal, socket, subprocess, unittest, time, sys
+import os, signal, socket, subprocess, threading, unittest, time, sys
 
 #-----------------------------------------------------------------------------------------
 #
@@ -53,6 +53,12 @@ class TestCmemcache( unittest.TestCase ):
         self.failUnlessEqual(mc.incr('nonexistantnumber'), None)
         self.failUnlessEqual(mc.decr('nonexistantnumber'), None)
 
+        # (hash, key) tuples store the key on the server of hash
+        mc.set((12, 'blo'), 'bla')
+        self.failUnlessEqual(mc.get((12, 'blo')), 'bla')
+        self.failUnlessEqual(mc.get_multi([(12, 'blo')]), {'blo': 'bla'})
+        self.failUnlessRaises(mc.MemcachedKeyCharacterError, lambda: mc.set("a a", "b b"))
+
         # try weird server formats
         # number is not a server
         self.failUnlessRaises(TypeError, lambda: mc.set_servers([12]))
@@ -212,6 +218,399 @@ class TestCmemcache( unittest.TestCase ):
         t1 = time.time()
         print 'time elapsed', t1-t0, 'for', n, 'get_multi'
 
+    def _test_serializers(self, mcm):
+        """
+        Test the native and registered serializers of Client.
+        """
+        mc = mcm.Client(self.servers, serializer=mcm.Client._FLAG_NATIVE)
+        val = {'bla': [u'bl\xfc', 1.5, None, True], 'blo': (12, 123456789L)}
+        test_setget(mc, 'native', val, self.failUnlessEqual)
+        self.failUnlessEqual(mc.getflags('native')[1], mcm.Client._FLAG_NATIVE)
+        # types the native encoding does not handle are pickled
+        test_setget(mc, 'pickled', set([1, 2]), self.failUnlessEqual)
+        self.failUnlessEqual(mc.getflags('pickled')[1], mcm.Client._FLAG_PICKLE)
+
+        mc.register_serializer(1<<8, repr, eval)
+        self.failUnlessRaises(ValueError,
+                              lambda: mc.register_serializer(mc._FLAG_PICKLE, repr, eval))
+        mc.set_serializer(1<<8)
+        test_setget(mc, 'repr', [1, 'bla'], self.failUnlessEqual)
+        self.failUnlessEqual(mc.getflags('repr')[1], 1<<8)
+        d = mc.get_multi(['native', 'pickled', 'repr'])
+        self.failUnlessEqual(d, {'native': val, 'pickled': set([1, 2]), 'repr': [1, 'bla']})
+
+        # integers are parsed from the reply bytes, decr pads them with spaces
+        mc.set('number', -42)
+        mc.set('longnumber', 2**70)
+        mcm.StringClient.set(mc, 'padded', '9 ', 0, mc._FLAG_INTEGER)
+        mcm.StringClient.set(mc, 'notanumber', '9x', 0, mc._FLAG_INTEGER)
+        d = mc.get_multi(['number', 'longnumber', 'padded', 'notanumber'])
+        self.failUnlessEqual(d, {'number': -42, 'longnumber': 2**70, 'padded': 9})
+        self.failUnless(type(d['padded']) is int)
+        self.failUnlessEqual(mc.get('notanumber'), None)
+
+        # repeated short values are shared, longer ones are not
+        mc.set('short', 'bla')
+        mc.set('long', 'bla' * 10)
+        stats = mc.get_client_stats()
+        self.assert_(mc.get('number') is mc.get_multi(['number'])['number'])
+        self.assert_(mc.get('short') is mc.get('short'))
+        self.assert_(mc.get('long') is not mc.get('long'))
+        newStats = mc.get_client_stats()
+        self.assert_(newStats['intern_hits'] >= stats['intern_hits'] + 2)
+        self.assert_(newStats['intern_saved'] > stats['intern_saved'])
+        mc.intern_values = 0
+        self.assert_(mc.get('short') is not mc.get('short'))
+
+    def _test_load(self, mcm):
+        """
+        Test the bulk loader.
+        """
+        mc = mcm.Client(self.servers)
+        items = [('load%d' % i, i % 3 and 'bla' * i or i) for i in xrange(1000)]
+        progress = []
+        self.failUnlessEqual(mc.load(items, window=8, progress_interval=100,
+                                     progress=lambda sent, stored: progress.append(stored)),
+                             (1000, 0))
+        self.assert_(len(progress) >= 10)
+        self.failUnlessEqual(progress[-1], 1000)
+        self.failUnlessEqual(mc.get_multi([key for key, val in items]), dict(items))
+
+        # items are (key, val[, flags[, time]]) like for StringClient, an explicit time
+        # of 0 does not expire
+        self.failUnlessEqual(mc.load([('loadflags', 'bla', 1 << 8),
+                                      ('loadforever', 'bla', 0, 0)], time=1), (2, 0))
+        self.failUnlessEqual(mc.getflags('loadflags'), ('bla', 1 << 8))
+        time.sleep(2)
+        self.failUnlessEqual(mc.get('loadforever'), 'bla')
+
+        # files of set commands are stored as is
+        import StringIO
+        f = StringIO.StringIO('set load0 12 0 3\r\nbli\r\nset load1 0 0 0\r\n\r\n')
+        self.failUnlessEqual(mc.load(f), (2, 0))
+        self.failUnlessEqual(mc.getflags('load0'), ('bli', 12))
+        self.failUnlessEqual(mc.get('load1'), '')
+        self.failUnlessRaises(ValueError, lambda: mc.load(StringIO.StringIO('get bla\r\n')))
+        for block in ('bli\n\r', 'bli\nxx', 'bl\r\n'):
+            f = StringIO.StringIO('set load0 0 0 3\r\n' + block)
+            self.failUnlessRaises(ValueError, lambda: mc.load(f))
+
+        # sets to servers that are not running fail
+        mc = mcm.Client(self.servers + self.servers_unknown)
+        stored, failed = mc.load(items)
+        self.failUnlessEqual(stored + failed, 1000)
+        self.assert_(failed > 0)
+        self.assert_(mc.last_errors())
+
+    def _test_dump(self, mcm):
+        """
+        Test dump and restore.
+        """
+        import tempfile
+        mc = mcm.StringClient(self.servers)
+        for i in xrange(100):
+            mc.set('dump%d' % i, 'bla' * i, 0, i)
+        keys = ['dump%d' % i for i in xrange(100)]
+        path = tempfile.mktemp()
+        try:
+            self.failUnlessEqual(mc.dump(keys + ['doesnotexist'], path), 100)
+            for key in keys:
+                mc.delete(key)
+            self.failUnlessEqual(mc.restore(path), (100, 0))
+            for i in xrange(100):
+                self.failUnlessEqual(mc.getflags('dump%d' % i), ('bla' * i, i))
+
+            # entries with a damaged key are skipped and counted as not stored
+            data = open(path, 'rb').read()
+            open(path, 'wb').write(data.replace('dump42', 'dum 42', 1))
+            mc.delete('dump42')
+            self.failUnlessEqual(mc.restore(path), (99, 1))
+            self.failUnlessEqual(mc.get('dump42'), None)
+            self.failUnlessEqual(mc.get('dump43'), 'bla' * 43)
+
+            open(path, 'wb').write('bla')
+            self.failUnlessRaises(ValueError, lambda: mc.restore(path))
+        finally:
+            os.remove(path)
+
+    def _test_iter_get_multi(self, mcm):
+        """
+        Test the streaming multi get.
+        """
+        mc = mcm.Client(self.servers)
+        for i in xrange(250):
+            mc.set('iter%d' % i, i % 2 and 'bla' * i or [i])
+        keys = ('iter%d' % i for i in xrange(300))
+        it = mc.iter_get_multi(keys, batch_size=40)
+        key, val = it.next()
+
+        # the client can be used while iterating
+        mc.set('iter1', 'changed')
+        self.failUnlessEqual(mc.get('iter1'), 'changed')
+        result = dict(it)
+        result[key] = val
+        self.failUnlessEqual(len(result), 250)
+        self.failUnlessEqual(result['iter249'], 'bla' * 249)
+        self.failUnlessEqual(result['iter248'], [248])
+        self.failIf('iter250' in result)
+        self.failUnlessRaises(StopIteration, it.next)
+
+        self.failUnlessEqual(list(mcm.StringClient(self.servers).iter_get_multi(['iter3'])),
+                             [('iter3', 'blablabla')])
+        self.failUnlessEqual(list(mc.iter_get_multi([])), [])
+        self.failUnlessRaises(mc.MemcachedKeyError,
+                              lambda: list(mc.iter_get_multi(['iter0', 'bad key'])))
+        it = mc.iter_get_multi(['iter1'] * 3, batch_size=1)
+        it.next()
+        mc.set_servers(self.servers)
+        self.failUnlessRaises(RuntimeError, it.next)
+
+    def _test_tombstones(self, mcm):
+        """
+        Test negative caching.
+        """
+        mc = mcm.Client(self.servers)
+        mc.delete('absent')
+        self.failUnlessEqual(mc.get('absent'), None)
+        self.failUnless(mc.set_tombstone('absent'))
+        self.failUnless(mc.get('absent') is mcm.TOMBSTONE)
+        self.failUnless(mc.get_multi(['absent'])['absent'] is mcm.TOMBSTONE)
+        smc = mcm.StringClient(self.servers)
+        self.failUnless(smc.get('absent') is smc.TOMBSTONE)
+        self.failUnlessEqual(smc.get_multi(['absent', 'doesnotexist']),
+                             {'absent': smc.TOMBSTONE})
+
+        # mirrored in the client, until this client stores the key
+        mc.tombstone_ttl = 10
+        mc.get('absent')
+        smc.set('absent', 'bla')
+        self.failUnless(mc.get('absent') is mcm.TOMBSTONE)
+        self.failUnless(mc.get_multi(['absent'])['absent'] is mcm.TOMBSTONE)
+        self.failUnlessEqual(mc.get_client_stats()['tombstone_hits'], 2)
+        mc.set('absent', 'bli')
+        self.failUnlessEqual(mc.get('absent'), 'bli')
+
+        # or loads, restores, increments or flushes it
+        import tempfile
+        def mirror(key):
+            smc.set_tombstone(key)
+            self.failUnless(mc.get(key) is mcm.TOMBSTONE)
+            smc.delete(key)
+            self.failUnless(mc.get(key) is mcm.TOMBSTONE)
+        mirror('tombload')
+        mc.load([('tombload', 'bla')])
+        self.failUnlessEqual(mc.get('tombload'), 'bla')
+        path = tempfile.mktemp()
+        try:
+            self.failUnlessEqual(smc.dump(['tombload'], path), 1)
+            mirror('tombload')
+            self.failUnlessEqual(mc.restore(path), (1, 0))
+            self.failUnlessEqual(mc.get('tombload'), 'bla')
+        finally:
+            os.remove(path)
+        mirror('tombnumber')
+        smc.set('tombnumber', '5')
+        self.failUnlessEqual(mc.incr('tombnumber'), 6)
+        self.failUnlessEqual(mc.get('tombnumber'), '6')
+        mirror('tombflushed')
+        mc.native = 1
+        mc.flush_all()
+        smc.set('tombflushed', 'bla')
+        self.failUnlessEqual(mc.get('tombflushed'), 'bla')
+
+    def _test_native(self, mcm):
+        """
+        Test the native transport, and unix domain sockets if memcached can listen on
+        one.
+        """
+        mc = mcm.StringClient(self.servers)
+        mc.native = 1
+        self._test_base(mcm, mc)
+        mc = mcm.Client(self.servers)
+        mc.native = 1
+        self._test_sgra(mc, {'bla': 'bli'}, [1, 2], 'will not be set')
+
+        path = '/tmp/cmemcache-test-%d.sock' % os.getpid()
+        memcached = subprocess.Popen("memcached -m 10 -s %s" % path, shell=True)
+        try:
+            time.sleep(0.5)
+            if os.path.exists(path):
+                mc = mcm.StringClient(['unix:' + path])
+                self._test_sgra(mc, 'blu', 'replace', 'will not be set')
+                self.failUnlessEqual(mc.get_stats()[0][0], 'unix:' + path)
+        finally:
+            os.kill(memcached.pid, signal.SIGINT)
+            if os.path.exists(path):
+                os.remove(path)
+
+    def _test_reweight(self, mcm):
+        """
+        Test the weights from the stats of memcached on unix domain sockets of 40 and
+        10 MB.
+        """
+        paths = ['/tmp/cmemcache-test-%d-%d.sock' % (os.getpid(), mb) for mb in (40, 10)]
+        procs = [subprocess.Popen("memcached -m %d -s %s" % (mb, path), shell=True)
+                 for mb, path in zip((40, 10), paths)]
+        try:
+            time.sleep(0.5)
+            if [path for path in paths if os.path.exists(path)] == paths:
+                servers = ['unix:' + path for path in paths]
+                unknown = self.servers_unknown[0]
+                mc = mcm.StringClient(servers + [(unknown, 3), (self.servers[0], 0)])
+                weights = [(servers[0], 100), (servers[1], 25), (unknown, 3),
+                           (self.servers[0], 0)]
+                self.failUnlessEqual(mc.reweight(), weights)
+                self.failUnlessEqual(mc.get_client_stats()['reweights'], 1)
+                self.assert_(mc.last_errors())
+                routes = mc.route(['reweight%d' % i for i in xrange(1000)])
+                self.assert_(600 < routes.count(servers[0]) < 900)
+                self.failIf(self.servers[0] in routes)
+                # unchanged weights keep the routing
+                self.failUnlessEqual(mc.reweight(), weights)
+                self.failUnlessEqual(mc.get_client_stats()['reweights'], 1)
+
+                # so do small changes of the shares, up to reweight_threshold
+                mc.set_servers([(servers[0], 96), (servers[1], 25)])
+                self.failUnlessEqual(mc.reweight(), [(servers[0], 96), (servers[1], 25)])
+                self.failUnlessEqual(mc.get_client_stats()['reweights'], 1)
+                mc.reweight_threshold = 0
+                self.failUnlessEqual(mc.reweight(), weights[:2])
+                self.failUnlessEqual(mc.get_client_stats()['reweights'], 2)
+
+                # periodic
+                mc.set_servers(servers)
+                mc.reweight_interval = 0.1
+                mc.get('bla')
+                self.failUnlessEqual(mc.get_client_stats()['reweights'], 3)
+                mc.get('bla')
+                self.failUnlessEqual(mc.get_client_stats()['reweights'], 3)
+                self.failUnlessEqual(mc.reweight(), weights[:2])
+        finally:
+            for proc, path in zip(procs, paths):
+                os.kill(proc.pid, signal.SIGINT)
+                if os.path.exists(path):
+                    os.remove(path)
+
+    def _test_near_cache(self, mcm):
+        """
+        Test the shared memory near cache, with two clients standing in for two
+        processes.
+        """
+        path = '/tmp/cmemcache-test-%d.near' % os.getpid()
+        mc = mcm.Client(self.servers)
+        other = mcm.StringClient(self.servers)
+        try:
+            mc.open_near_cache(path, size=1 << 20, ttl=10)
+            other.open_near_cache(path)
+            mc.set('near', 'bla')
+            mc.set('nearint', 42)
+            self.failUnlessEqual(mc.get('near'), 'bla')
+            self.failUnlessEqual(mc.get_multi(['nearint']), {'nearint': 42})
+
+            # served from the file until ttl, or a store through a client that has it
+            self.failUnless(mcm.StringClient(self.servers).set('near', 'bli'))
+            self.failUnlessEqual(other.get('near'), 'bla')
+            self.failUnlessEqual(other.get_multi(['near', 'nearint']),
+                                 {'near': 'bla', 'nearint': '42'})
+            self.failUnlessEqual(other.get_client_stats()['near_hits'], 3)
+            other.set('near', 'blu')
+            self.failUnlessEqual(mc.get('near'), 'blu')
+            mc.delete('near')
+            self.failUnlessEqual(other.get('near'), None)
+
+            # values larger than a slot go to the servers each time
+            mc.set('nearbig', 'x' * 1000)
+            self.failUnlessEqual(mc.get('nearbig'), 'x' * 1000)
+            hits = mc.get_client_stats()['near_hits']
+            self.failUnlessEqual(mc.get('nearbig'), 'x' * 1000)
+            self.failUnlessEqual(mc.get_client_stats()['near_hits'], hits)
+            self.failUnlessEqual(os.stat(path).st_mode & 0777, 0600)
+
+            # slots left in the middle of a write by a dead process are taken over
+            import mmap, struct
+            pid = os.fork()
+            if pid == 0:
+                os._exit(0)
+            os.waitpid(pid, 0)
+            f = open(path, 'r+b')
+            m = mmap.mmap(f.fileno(), 0)
+            numSlots, slotSize = struct.unpack('II', m[12:20])
+            for slot in xrange(numSlots):
+                offset = 24 + slot * slotSize
+                m[offset:offset + 8] = struct.pack('II', 1, pid)
+            m.close()
+            f.close()
+            mc.set('neardead', 'bla')
+            hits = mc.get_client_stats()['near_hits']
+            self.failUnlessEqual(mc.get('neardead'), 'bla')
+            self.failUnlessEqual(mc.get('neardead'), 'bla')
+            self.failUnlessEqual(mc.get_client_stats()['near_hits'], hits + 1)
+            mc.close_near_cache()
+        finally:
+            if os.path.exists(path):
+                os.remove(path)
+
+    def _test_auto_batch(self, mcm):
+        """
+        Test merging the gets of threads sharing a client.
+        """
+        mc = mcm.Client(self.servers)
+        for i in xrange(50):
+            mc.set('batch%d' % i, i)
+        mc.auto_batch = 8
+        errors = []
+        def reader():
+            for i in xrange(50):
+                if mc.get('batch%d' % i) != i or mc.get('nobatch%d' % i) is not None:
+                    errors.append(i)
+        threads = [threading.Thread(target=reader) for i in xrange(8)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.failUnlessEqual(errors, [])
+        stats = mc.get_client_stats()
+        self.failUnlessEqual(stats['batched_gets'], 8 * 100)
+        self.failUnless(0 < stats['batches'] <= 8 * 100)
+
+        # the other commands can share the client too
+        mc.profile = 1
+        mc.set('batch0', 'bla')
+        self.failUnlessEqual(mc.get('batch0'), 'bla')
+        self.failUnlessEqual(mc.get_client_stats()['profiled_calls'], 2)
+        mc.auto_batch = 0
+
+    def _test_timeout(self, mcm):
+        """
+        Test deadlines with a server that accepts connections but never replies.
+        """
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.bind(('127.0.0.1', 0))
+        sock.listen(5)
+        slow = '127.0.0.1:%d' % sock.getsockname()[1]
+        try:
+            mc = mcm.Client([self.servers[0], slow])
+            keys = ['timeout%d' % i for i in xrange(20)]
+            routes = mc.route(keys)
+            fast = keys[routes.index(self.servers[0])]
+            mc.set(fast, 'bla')
+            start = time.time()
+            self.failUnlessEqual(mc.get_multi(keys, timeout=0.2), {fast: 'bla'})
+            self.failUnless(time.time() - start < 2)
+            self.failUnless(mc.timed_out)
+            self.failUnless(isinstance(mc.last_errors()[-1], mc.MemcachedTimeoutError))
+
+            # the client default
+            mc.timeout = 0.2
+            self.failUnlessEqual(mc.get(keys[routes.index(slow)]), None)
+            self.failUnless(mc.timed_out)
+            self.failUnlessEqual(mc.get(fast), 'bla')
+            self.failIf(mc.timed_out)
+            self.failUnlessEqual(mc.get(fast, timeout=0), 'bla')
+            self.failUnlessEqual(mc.get_client_stats()['timeouts'], 2)
+        finally:
+            sock.close()
+
     def _test_create_leak(self, mcm):
         """
         Dan Helfman reported a memory leak Client create/dealloc.
@@ -240,6 +639,244 @@ class TestCmemcache( unittest.TestCase ):
         self.failUnlessEqual(mc.get('bla'), None)
         self.failUnlessEqual(mc.set('bla', 'bli'), 0)
 
+        if hasattr(mc, 'last_errors'):
+            # cmemcache collects the errors per client
+            mc.last_errors()
+            mc.get('bla')
+            errors = mc.last_errors()
+            self.assert_(errors)
+            self.assert_(isinstance(errors[0], mc.MemcachedError))
+            self.failUnlessEqual(mc.last_errors(), [])
+            self.assert_(mc.get_client_stats()['errors'] >= len(errors))
+            mc.raise_errors = 1
+            self.failUnlessRaises(mc.MemcachedError, lambda: mc.get('bla'))
+            mc.raise_errors = 0
+
+    def test_native_encoding(self):
+        """
+        Test encode/decode of the native serializer, no memcached needed.
+        """
+        import _cmemcache
+        for val in [None, True, False, 0, -1, 128, -2**31, 2**62, 2**100, -2**100, 1.5,
+                    'bli\000bli', u'bl\xfc', [1, [2, (3,)]], {'bla': {'blo': [None]}}]:
+            newval = _cmemcache.decode(_cmemcache.encode(val))
+            self.failUnlessEqual(newval, val)
+            self.failUnlessEqual(type(newval), type(val))
+        self.failUnlessRaises(TypeError, lambda: _cmemcache.encode(set()))
+        self.failUnlessRaises(TypeError, lambda: _cmemcache.encode(Exception()))
+        # truncated and corrupt values
+        for buf in ['', '\002N', '\001s\005\000\000\000bli', '\001NN', '\001?']:
+            self.failUnlessRaises(ValueError, lambda: _cmemcache.decode(buf))
+
+    def test_keys(self):
+        """
+        Test key validation and routing, no memcached needed.
+        """
+        import binascii, random
+        import _cmemcache
+        servers = ['127.0.0.1:11211', ('127.0.0.1:11212', 3)]
+        mc = _cmemcache.StringClient(servers)
+
+        # same routing as memcache.py, including weights
+        buckets = ['127.0.0.1:11211'] + ['127.0.0.1:11212'] * 3
+        def server(key):
+            return buckets[(((binascii.crc32(key) & 0xffffffff) >> 16) & 0x7fff) % 4]
+        keys = ['key%d' % random.randint(0, 1000000) for i in xrange(1000)]
+        self.failUnlessEqual(mc.route(keys), [server(key) for key in keys])
+        self.failUnlessEqual(mc.route([(0, 'bla'), (1, 'bla')]), buckets[:2])
+
+        self.failUnlessRaises(mc.MemcachedKeyCharacterError, lambda: mc.get('a a'))
+        self.failUnlessRaises(mc.MemcachedKeyCharacterError, lambda: mc.get('a\001'))
+        self.failUnlessRaises(mc.MemcachedKeyLengthError, lambda: mc.set('a' * 251, 'b'))
+        self.failUnlessRaises(mc.MemcachedKeyNoneError, lambda: mc.delete(''))
+        self.failUnlessRaises(mc.MemcachedKeyNoneError, lambda: mc.incr(None))
+        self.failUnlessRaises(TypeError, lambda: mc.get_multi(['bla', 12]))
+        self.failUnlessRaises(mc.MemcachedKeyTypeError, lambda: mc.get(('bla', 'bli')))
+
+        mc.set_servers([])
+        self.failUnlessEqual(mc.route(['bla']), [None])
+
+    def test_routing(self):
+        """
+        Test that get_multi() finds the keys set() routed to weighted servers, on the
+        libmemcache connections. No memcached needed.
+        """
+        import cmemcache, fakememcached
+        servers = [fakememcached.FakeMemcached(), fakememcached.FakeMemcached()]
+        for server in servers:
+            server.start()
+        try:
+            mc = cmemcache.Client([servers[0].address, (servers[1].address, 3)])
+            items = dict(('route%d' % i, i) for i in xrange(200))
+            for key, value in items.items():
+                mc.set(key, value)
+            self.failUnlessEqual(mc.get_multi(items.keys()), items)
+            for key, value in items.items()[:20]:
+                self.failUnlessEqual(mc.get(key), value)
+
+            # (hash, key) tuples go to the server of hash, 0 included
+            for i in xrange(8):
+                key = 'routetuple%d' % i
+                mc.set((0, key), 'first')
+                mc.set((1, key), 'second')
+                self.failUnlessEqual(mc.get((0, key)), 'first')
+                self.failUnlessEqual(mc.get((1, key)), 'second')
+                self.failUnlessEqual(mc.get_multi([(0, key), 'route1']),
+                                     {key: 'first', 'route1': 1})
+                self.failUnlessEqual(mc.get_multi([(1, key)]), {key: 'second'})
+        finally:
+            for server in servers:
+                server.stop()
+
+    def test_faults(self):
+        """
+        Test StringClient against fakememcached.py with each fault, no memcached needed.
+        Prints the throughput and tail latency of get under each fault. The faults are
+        tested on the native connections, libmemcache exits on some (see Known Bugs).
+        """
+        import cmemcache, fakememcached
+        server = fakememcached.FakeMemcached(seed=1)
+        server.start()
+        try:
+            mc = cmemcache.StringClient([server.address])
+            mc.native = 1
+            keys = ['fault%d' % i for i in xrange(20)]
+            value = 'bla' * 100
+            for key in keys:
+                mc.set(key, value)
+
+            def measure(fault, n=50):
+                latencies = []
+                for i in xrange(n):
+                    t0 = time.time()
+                    mc.get(keys[i % len(keys)])
+                    latencies.append(time.time() - t0)
+                latencies.sort()
+                print '%-24s %8.0f gets/s p99 %.3f ms' % (
+                    fault, n / sum(latencies), latencies[int(n * 0.99)] * 1e3)
+                return latencies[int(n * 0.99)]
+
+            measure('none')
+            server.set_faults(latency=0.05)
+            self.failUnlessEqual(mc.get(keys[0]), value)
+            self.assert_(measure('latency=0.05', 5) >= 0.05)
+            self.failUnlessEqual(mc.get(keys[0], timeout=0.01), None)
+            self.assert_(mc.timed_out)
+
+            # replies and requests in pieces arrive whole
+            server.set_faults(partial=7, slow_read=5, chunk_delay=0)
+            measure('partial=7,slow_read=5')
+            self.failUnlessEqual(mc.set('fault', value * 3), 1)
+            self.failUnlessEqual(mc.get('fault'), value * 3)
+            self.failUnlessEqual(mc.get_multi(keys), dict.fromkeys(keys, value))
+
+            # dropped connections and replies cut off halfway are misses and errors,
+            # the next call reconnects
+            for fault in ('drop', 'cut'):
+                server.set_faults(**{fault: 1})
+                mc.last_errors()
+                self.failUnlessEqual(mc.get(keys[0]), None)
+                # the values before the cut are kept
+                self.assert_(len(mc.get_multi(keys)) < len(keys))
+                self.assert_(mc.last_errors())
+                server.set_faults(**{fault: 0.1})
+                measure('%s=0.1' % fault)
+                server.set_faults()
+                self.failUnlessEqual(mc.get(keys[0]), value)
+            self.assert_(server.counts['drops'] and server.counts['cuts'])
+
+            # a restarted server is reconnected to, see testReconnect.py
+            server.stop()
+            self.failUnlessEqual(mc.get(keys[0]), None)
+            self.failUnlessEqual(mc.set(keys[0], value), 0)
+            server.start()
+            self.failUnlessEqual(mc.get(keys[0]), value)
+            self.failUnlessEqual(mc.set(keys[0], value), 1)
+        finally:
+            server.stop()
+
+    def test_write_behind(self):
+        """
+        Test sets and deletes through the write behind thread, no memcached needed.
+        """
+        import cmemcache, fakememcached
+        server = fakememcached.FakeMemcached()
+        server.start()
+        try:
+            mc = cmemcache.StringClient([server.address])
+            mc.native = 1
+            mc.open_write_behind(size=8, block=1)
+            items = dict(('wb%d' % i, 'bla%d' % i) for i in xrange(100))
+            for key, val in items.items():
+                self.failUnlessEqual(mc.set(key, val), 1)
+            self.failUnlessEqual(mc.delete('wb0'), 0)
+            self.failUnlessEqual(mc.flush_write_behind(), 1)
+            del items['wb0']
+            self.failUnlessEqual(mc.get_multi(items.keys() + ['wb0']), items)
+            stats = mc.get_client_stats()
+            self.failUnlessEqual(stats['writes_queued'], 101)
+            self.failUnlessEqual(stats['writes_dropped'], 0)
+            self.assert_(stats['max_write_depth'] <= 8)
+
+            # a full ring drops the sets, the server reads them slowly
+            mc.open_write_behind(size=4)
+            server.set_faults(slow_read=16, chunk_delay=0.01)
+            results = [mc.set('wbbig%d' % i, 'x' * 65536) for i in xrange(200)]
+            server.set_faults()
+            self.assert_(0 in results)
+            self.failUnlessEqual(mc.get_client_stats()['writes_dropped'], results.count(0))
+            self.failUnlessEqual(mc.flush_write_behind(timeout=20), 1)
+            self.failUnlessEqual(mc.get_client_stats()['write_depth'], 0)
+
+            # commands that are not queued wait until the servers did the queued ones
+            mc.open_write_behind(size=64)
+            server.set_faults(slow_read=256, chunk_delay=0.001)
+            for i in xrange(20):
+                mc.set('wbpad%d' % i, 'x' * 4096)
+            mc.set('wbnum', '5')
+            mc.delete('wb1')
+            self.failUnlessEqual(mc.incr('wbnum'), 6)
+            self.failUnlessEqual(mc.add('wb1', 'new'), 1)
+            server.set_faults()
+            self.failUnlessEqual(mc.get('wb1'), 'new')
+
+            # sets to a server that is down are lost and reported
+            server.stop()
+            mc.last_errors()
+            self.failUnlessEqual(mc.set('wblost', 'bla'), 1)
+            self.failUnlessEqual(mc.flush_write_behind(), 1)
+            self.failUnlessEqual(mc.get_client_stats()['writes_failed'], 1)
+            self.assert_(mc.last_errors())
+            server.start()
+
+            # closing lets the threads blocked on a full ring or a flush go
+            for close in (mc.close_write_behind, lambda: mc.set_servers([server.address])):
+                mc.open_write_behind(size=2, block=1)
+                dropped = mc.get_client_stats()['writes_dropped']
+                server.set_faults(slow_read=16, chunk_delay=0.01)
+                value = 'x' * (1 << 20)
+                threads = [threading.Thread(target=mc.set, args=('wbblock%d' % i, value))
+                           for i in xrange(10)]
+                threads.append(threading.Thread(target=mc.flush_write_behind))
+                for thread in threads:
+                    thread.start()
+                time.sleep(0.2)
+                # close sends what is queued, let the server catch up meanwhile
+                threading.Timer(0.5, server.set_faults).start()
+                close()
+                for thread in threads:
+                    thread.join(10)
+                    self.failIf(thread.isAlive())
+                self.assert_(mc.get_client_stats()['writes_dropped'] > dropped)
+
+            # sets wait for the server again once closed
+            mc.close_write_behind()
+            mc.get('wb1')
+            self.failUnlessEqual(mc.set('wb1', 'bli'), 1)
+            self.failUnlessEqual(mc.get('wb1'), 'bli')
+        finally:
+            server.stop()
+
     def test_memcache(self):
         # quick check if memcached is running
         ip, port = self.servers[0].split(':')
@@ -281,6 +918,16 @@ class TestCmemcache( unittest.TestCase ):
         cmc = cmemcache.Client(self.servers)
         self._test_base(cmemcache, cmc)
         self._test_client(cmemcache)
+        self._test_serializers(cmemcache)
+        self._test_load(cmemcache)
+        self._test_dump(cmemcache)
+        self._test_iter_get_multi(cmemcache)
+        self._test_tombstones(cmemcache)
+        self._test_native(cmemcache)
+        self._test_reweight(cmemcache)
+        self._test_near_cache(cmemcache)
+        self._test_auto_batch(cmemcache)
+        self._test_timeout(cmemcache)
         self._test_create_leak(cmemcache)
 
         # if we created memcached for our test, then shut it down
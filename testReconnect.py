@@ -4,10 +4,12 @@
 #
 
 """
-Do (c)memcache get and set, start, stop memcached by hand to see if get/set reconnects.
+Do (c)memcache get and set while a fakememcached.py server is stopped and started every
+few calls, to see if get/set reconnects. With -s, use that memcached instead and start,
+stop it by hand.
 """
 
-import memcache, cmemcache
+import cmemcache, fakememcached
 
 __version__ = "$Revision$"
 __author__ = "$Author$"
@@ -21,41 +23,64 @@ def main():
     parser = optparse.OptionParser(__doc__.strip())
     parser.add_option( '-n', '--number', action='store', type='int', default=100,
                        help="Number of get/set." )
+    parser.add_option( '-r', '--restart', action='store', type='int', default=5,
+                       help="Stop or start the server every this many get/set." )
+    parser.add_option( '-s', '--server', action='store',
+                       help="Use this memcached, started and stopped by hand." )
+    parser.add_option( '--native', action='store', type='int', default=0,
+                       help="Use the native connections instead of libmemcache." )
     parser.add_option( '-v', '--verbose', action='count', default=0,
                        help="Verbose level." )
     opts, args = parser.parse_args()
 
-    servers = ["127.0.0.1:11211", "127.0.0.1:11222"]
-    servers = ["127.0.0.1:11211"]
+    fake = None
+    if opts.server:
+        servers = [opts.server]
+    else:
+        fake = fakememcached.FakeMemcached()
+        fake.start()
+        servers = [fake.address]
 
-    mc = memcache.Client(servers)
-    cmc = cmemcache.Client(servers)
+    clients = [('cmc', cmemcache.Client(servers))]
+    clients[0][1].native = opts.native
+    try:
+        import memcache
+    except ImportError:
+        pass
+    else:
+        clients.insert(0, ('mc', memcache.Client(servers)))
 
     k = 'bla'
     v = 'bli'
+    running = True
+    failures = 0
     for i in xrange(opts.number):
-        if mc.get(k) == None:
-            print 'mc.get() failed'
-        else:
-            print 'mc.get() succesful'
-        if mc.set(k, v) == 0:
-            print 'mc.set() failed'
-        else:
-            print 'mc.set() succesful'
-
-        if cmc.get(k) == None:
-            print 'cmc.get() failed'
-        else:
-            print 'cmc.get() succesful'
-        if cmc.set(k, v) == 0:
-            print 'cmc.set() failed'
-        else:
-            print 'cmc.set() success'
-            # print 'recreate Client'
-            # cmc = cmemcache.Client(servers)
-
-        s = random.random()
-        sleep(s)
+        if fake and i and i % opts.restart == 0:
+            if running:
+                fake.stop()
+            else:
+                fake.start()
+            running = not running
+            print 'server', running and 'started' or 'stopped'
+
+        for name, mc in clients:
+            if mc.get(k) == None:
+                print '%s.get() failed' % name
+            else:
+                print '%s.get() succesful' % name
+            stored = mc.set(k, v) != 0
+            print '%s.set() %s' % (name, stored and 'succesful' or 'failed')
+            if fake and stored != running:
+                failures += 1
+
+        if not fake:
+            sleep(random.random())
+
+    if fake:
+        fake.stop()
+        print failures and '%d unexpected results' % failures or 'all reconnected'
+        return failures and 1 or 0
 
 if __name__ == '__main__':
-    main()
+    import sys
+    sys.exit(main())